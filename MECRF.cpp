@@ -0,0 +1,647 @@
+#include "MECRF.hpp"
+#include "MELBFGS.hpp"
+#include "METokenizer.hpp"
+#include <iostream>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+/* ビーム探索の候補: 元の仮説に単語yを続けたもの */
+struct BeamCandidate {
+  double score;      /* 続けた後の対数スコア */
+  int    hypothesis; /* 元の仮説の番号 */
+  int    y;          /* 続ける単語 */
+};
+
+/* 候補の順序: スコアの降順. 同じなら元の仮説, 単語の順 */
+static bool candidate_order(const BeamCandidate &a, const BeamCandidate &b)
+{
+  if (a.score != b.score) {
+    return a.score > b.score;
+  }
+  if (a.hypothesis != b.hypothesis) {
+    return a.hypothesis < b.hypothesis;
+  }
+  return a.y < b.y;
+}
+
+/* コンストラクタ. 周辺素性のエネルギーu(y)とその降順リスト, モデルの疎な枝は予測器から1度だけ引いておく */
+MECRF::MECRF(std::shared_ptr<const MEPredictor> predictor, int sequence_length, int count_bias, int num_threads, int max_iteration)
+{
+  this->predictor       = predictor;
+  this->sequence_length = sequence_length;
+  this->count_bias      = count_bias;
+  this->max_iteration   = max_iteration;
+  prior_variance        = CRF_PRIOR_VARIANCE;
+  label_size            = predictor->get_label_size();
+  max_in_degree         = 0;
+  thread_pool           = new METhreadPool(num_threads);
+  out_offset.assign(label_size+1, 0);
+  in_offset.assign(label_size+1, 0);
+
+  predictor->get_marginal_energy(marginal_energy);
+  marginal_ranking.resize(label_size);
+  for (int y = 0; y < label_size; y++) {
+    marginal_ranking[y] = y;
+  }
+  std::sort(marginal_ranking.begin(), marginal_ranking.end(), [this](int a, int b) {
+    if (marginal_energy[a] != marginal_energy[b]) {
+      return marginal_energy[a] > marginal_energy[b];
+    }
+    return a < b;
+  });
+
+  /* 遷移素性を作るまではモデルの条件付き素性の枝だけ */
+  build_edges(std::vector<std::pair<int, int> >());
+}
+
+/* デストラクタ */
+MECRF::~MECRF(void)
+{
+  delete thread_pool;
+}
+
+/* ファイル名の配列を受け取り, 系列と遷移素性を作る */
+void MECRF::read_file_str_list(const std::vector<std::string> &filenames)
+{
+  MEPatternIndex   pair_index; /* 系列内の遷移(y', y) -> 遷移ID */
+  std::vector<int> pair_count; /* 遷移ID -> 頻度 */
+
+  sequences.clear();
+  for (int file_i = 0; file_i < (int)filenames.size(); file_i++) {
+    METokenizer tokenizer;
+    const char *word;
+    int word_length;
+    std::vector<int> words; /* ファイルの単語列の内部表現. 語彙に無い単語は-1 */
+
+    if (!tokenizer.open(filenames[file_i])) {
+      std::cerr << "Error : cannot open file \"" << filenames[file_i] << "\"." << std::endl;
+      continue;
+    }
+    while (tokenizer.next_word(&word, &word_length)) {
+      int word_id = predictor->encode_word(std::string(word, word_length));
+      words.push_back(word_id < label_size ? word_id : -1); /* yになり得ない単語は語彙に無い単語と同じに扱う */
+    }
+    add_sequences(words, pair_index, pair_count);
+  }
+
+  build_transitions(pair_index, pair_count);
+  std::cout << "CRF sequences : " << sequences.size() << " Transition features : " << get_num_transitions() << std::endl;
+}
+
+/* 読んだ単語列を長さsequence_lengthの系列に区切って加える.
+   系列は語彙に無い単語の手前で打ち切り, 遷移を持たない(長さ1以下の)系列は学習に効かないので捨てる */
+void MECRF::add_sequences(const std::vector<int> &words, MEPatternIndex &pair_index, std::vector<int> &pair_count)
+{
+  int context_length = predictor->get_maxN_gram() - 1;
+
+  for (int begin = 0; begin < (int)words.size(); begin += sequence_length) {
+    Sequence sequence;
+    sequence.context.assign(words.begin() + std::max(0, begin - context_length), words.begin() + begin);
+    for (int t = 0; t < sequence_length && begin + t < (int)words.size() && words[begin + t] != -1; t++) {
+      sequence.labels.push_back(words[begin + t]);
+    }
+    if (sequence.labels.size() < 2) {
+      continue;
+    }
+
+    for (int t = 1; t < (int)sequence.labels.size(); t++) {
+      int pair_id = pair_index.insert(&sequence.labels[t-1], 2);
+      if (pair_id == (int)pair_count.size()) {
+        pair_count.push_back(0);
+      }
+      pair_count[pair_id]++;
+    }
+    sequences.push_back(sequence);
+  }
+}
+
+/* 頻度がcount_biasを超える遷移を(y', y)の昇順に素性IDを振って素性にし, 疎な枝を作り直す.
+   最後に各系列の遷移を枝IDに直し, 遷移素性の経験期待値を数える */
+void MECRF::build_transitions(const MEPatternIndex &pair_index, const std::vector<int> &pair_count)
+{
+  std::vector<std::pair<int, int> > pairs; /* 素性にする(y', y) */
+
+  for (int pair_id = 0; pair_id < pair_index.size(); pair_id++) {
+    if (pair_count[pair_id] > count_bias) {
+      const int *key = pair_index.get_key(pair_id);
+      pairs.push_back(std::make_pair(key[0], key[1]));
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+
+  build_edges(pairs);
+  transition_parameter.assign(pairs.size(), 0.0f);
+  empirical_count.assign(pairs.size(), 0.0f);
+
+  /* 系列の遷移の枝IDと, 遷移素性の系列あたりの出現回数 */
+  for (int s_i = 0; s_i < (int)sequences.size(); s_i++) {
+    Sequence &sequence = sequences[s_i];
+    sequence.edges.assign(sequence.labels.size(), -1);
+    for (int t = 1; t < (int)sequence.labels.size(); t++) {
+      int e = edge_index.find(&sequence.labels[t-1], 2);
+      sequence.edges[t] = e;
+      if (e != -1 && edge_transition[e] != -1) {
+        empirical_count[edge_transition[e]] += 1.0 / sequences.size();
+      }
+    }
+  }
+}
+
+/* 疎な枝を(y', y)の昇順に枝IDを振って作る.
+   y'毎に, 直前の1語y'を文脈にしてモデルの条件付き素性を集計し(Y(y')とlog Z(y')), 遷移素性の組と併合する.
+   遷移元の索引は枝IDの区間, 遷移先の索引はCSR形式で持つ */
+void MECRF::build_edges(const std::vector<std::pair<int, int> > &transition_pairs)
+{
+  std::vector<std::pair<int, double> > cond_scores; /* Y(y')の(y, u(y)+e(y|y')) */
+  std::vector<std::pair<int, int> >    entry;       /* (y, 枝ID) */
+  std::vector<int>                     context(1);  /* 文脈y' */
+  int p_i = 0;                                      /* 次に併合する遷移素性 */
+
+  edge_index.clear();
+  edge_src.clear();
+  edge_dst.clear();
+  edge_energy.clear();
+  edge_transition.clear();
+  transition_edge.assign(transition_pairs.size(), -1);
+  src_log_norm.assign(label_size, 0.0f);
+  out_offset.assign(label_size+1, 0);
+  for (int src = 0; src < label_size; src++) {
+    context[0] = src;
+    predictor->score_conditional(context, cond_scores, &src_log_norm[src]);
+
+    /* どちらもyの昇順なので併合する */
+    int c_i = 0;
+    while (c_i < (int)cond_scores.size() || (p_i < (int)transition_pairs.size() && transition_pairs[p_i].first == src)) {
+      bool has_cond       = (c_i < (int)cond_scores.size());
+      bool has_transition = (p_i < (int)transition_pairs.size() && transition_pairs[p_i].first == src);
+      int  dst;
+      if (has_cond && has_transition) {
+        dst = std::min(cond_scores[c_i].first, transition_pairs[p_i].second);
+      } else {
+        dst = has_cond ? cond_scores[c_i].first : transition_pairs[p_i].second;
+      }
+
+      int key[2] = {src, dst};
+      int e = edge_index.insert(key, 2);
+      edge_src.push_back(src);
+      edge_dst.push_back(dst);
+      edge_energy.push_back(0.0f);
+      edge_transition.push_back(-1);
+      if (has_cond && cond_scores[c_i].first == dst) {
+        edge_energy[e] = cond_scores[c_i].second - marginal_energy[dst];
+        c_i++;
+      }
+      if (has_transition && transition_pairs[p_i].second == dst) {
+        edge_transition[e] = p_i;
+        transition_edge[p_i] = e;
+        p_i++;
+      }
+      out_offset[src+1]++;
+      entry.push_back(std::make_pair(dst, e));
+    }
+  }
+  for (int y = 0; y < label_size; y++) {
+    out_offset[y+1] += out_offset[y];
+  }
+
+  /* 遷移先毎のリスト. 枝IDは遷移元の順なので, (y, 枝ID)で並べればy毎に遷移元の昇順になる */
+  std::sort(entry.begin(), entry.end());
+  in_offset.assign(label_size+1, 0);
+  in_edge.resize(entry.size());
+  for (int e_i = 0; e_i < (int)entry.size(); e_i++) {
+    in_offset[entry[e_i].first+1]++;
+    in_edge[e_i] = entry[e_i].second;
+  }
+  max_in_degree = 0;
+  for (int y = 0; y < label_size; y++) {
+    max_in_degree = std::max(max_in_degree, in_offset[y+1]);
+    in_offset[y+1] += in_offset[y];
+  }
+}
+
+/* 遷移素性のガウス事前分布の分散σ^2をセットする */
+void MECRF::set_prior_variance(double prior_variance)
+{
+  this->prior_variance = prior_variance;
+}
+
+/* 遷移素性の数 */
+int MECRF::get_num_transitions(void) const
+{
+  return transition_parameter.size();
+}
+
+/* 枝の組毎に決まる部分 d_e = e(y|y') + ψ(y', y) */
+double MECRF::edge_delta(int e) const
+{
+  double delta = edge_energy[e];
+  if (edge_transition[e] != -1) {
+    delta += transition_parameter[edge_transition[e]];
+  }
+  return delta;
+}
+
+/* 遷移素性のパラメタparameterでの, 枝毎のexp(d_e) - 1 */
+void MECRF::calc_edge_factor(const std::vector<double> &parameter, std::vector<double> &edge_factor) const
+{
+  edge_factor.resize(edge_src.size());
+  for (int e = 0; e < (int)edge_src.size(); e++) {
+    double delta = edge_energy[e];
+    if (edge_transition[e] != -1) {
+      delta += parameter[edge_transition[e]];
+    }
+    edge_factor[e] = exp(delta) - 1.0f;
+  }
+}
+
+/* 最初の単語の対数確率log P(y|x). 学習では系列毎に文脈が変わりキャッシュが効かないので, 予測器のキャッシュを通さずに求める */
+void MECRF::calc_first_potential(const std::vector<int> &context, std::vector<double> &first_potential) const
+{
+  std::vector<std::pair<int, double> > cond_scores;
+  double log_norm_factor;
+
+  predictor->score_conditional(context, cond_scores, &log_norm_factor);
+  first_potential.resize(label_size);
+  for (int y = 0; y < label_size; y++) {
+    first_potential[y] = marginal_energy[y] - log_norm_factor;
+  }
+  for (int c_i = 0; c_i < (int)cond_scores.size(); c_i++) {
+    first_potential[cond_scores[c_i].first] = cond_scores[c_i].second - log_norm_factor;
+  }
+}
+
+/* 遷移素性のパラメタをL-BFGS法で学習する.
+   目的関数は系列あたりの条件付き対数尤度からガウス事前分布の対数を引いたもの
+     L(ψ) = (1/M) Σ_s log P(y_s|x_s) - Σ_k ψ_k^2/(2σ^2 M)
+   で, 勾配は ∂L/∂ψ_k = (経験期待値) - (前向き後ろ向きで求めたモデル期待値) - ψ_k/(σ^2 M) */
+void MECRF::learning(void)
+{
+  LearningObjective objective(this);
+  MELBFGS optimizer(LBFGS_HISTORY_SIZE, max_iteration);
+  std::vector<double> parameter(transition_parameter);
+
+  if (transition_parameter.empty()) {
+    std::cout << "CRF : no transition features to learn." << std::endl;
+    return;
+  }
+
+  objective.prior_scale = (prior_variance > 0.0f) ? 1.0 / (prior_variance * sequences.size()) : 0.0f;
+  if (!optimizer.minimize(objective, parameter)) {
+    std::cerr << "Warning : CRF learning stopped before convergence." << std::endl;
+  }
+  transition_parameter = parameter;
+}
+
+/* 目的関数のコンストラクタ */
+MECRF::LearningObjective::LearningObjective(MECRF *crf)
+{
+  this->crf      = crf;
+  prior_scale    = 0.0f;
+  log_likelihood = 0.0f;
+}
+
+/* パラメタxでの目的関数 -(L(ψ)) と勾配 -(∂L/∂ψ).
+   系列について独立なので, 系列を区間に分けて並列に計算し, 期待値はスレッド毎に集計してから足し合わせる */
+double MECRF::LearningObjective::evaluate(const std::vector<double> &x, std::vector<double> &gradient)
+{
+  int num_transitions = x.size();
+  int num_threads     = crf->thread_pool->get_num_threads();
+  std::vector<double>               edge_factor;                          /* exp(d_e) - 1 */
+  std::vector<std::vector<double> > thread_expected(num_threads);        /* スレッド毎のモデル期待値 */
+  std::vector<double>               thread_likelihood(num_threads, 0.0f); /* スレッド毎の対数尤度 */
+  double prior = 0.0f;
+
+  crf->transition_parameter = x;
+  crf->calc_edge_factor(x, edge_factor);
+
+  crf->thread_pool->parallel_for(crf->sequences.size(), [&](int s_begin, int s_end, int thread_id) {
+    std::vector<double> first_potential, alpha, beta, work; /* 系列毎に使い回す作業領域 */
+    std::vector<double> &expected = thread_expected[thread_id];
+    expected.assign(num_transitions, 0.0f);
+    for (int s_i = s_begin; s_i < s_end; s_i++) {
+      thread_likelihood[thread_id] += crf->accumulate_expectation(crf->sequences[s_i], edge_factor, expected,
+                                                                 first_potential, alpha, beta, work);
+    }
+  });
+
+  /* スレッド番号順に足し合わせる */
+  double sum_likelihood = 0.0f;
+  gradient.assign(num_transitions, 0.0f);
+  for (int thread_id = 0; thread_id < num_threads; thread_id++) {
+    if (thread_expected[thread_id].empty()) {
+      continue; /* 担当区間が無かったスレッド */
+    }
+    for (int k = 0; k < num_transitions; k++) {
+      gradient[k] += thread_expected[thread_id][k];
+    }
+    sum_likelihood += thread_likelihood[thread_id];
+  }
+
+  double num_sequences = crf->sequences.size();
+  for (int k = 0; k < num_transitions; k++) {
+    gradient[k] = gradient[k] / num_sequences - crf->empirical_count[k] + prior_scale * x[k];
+    prior      += 0.5f * prior_scale * x[k] * x[k];
+  }
+  log_likelihood = sum_likelihood / num_sequences;
+
+  return -(log_likelihood - prior);
+}
+
+/* 反復毎の経過の印字 */
+bool MECRF::LearningObjective::progress(int iteration, const std::vector<double> &x, double value, double gradient_norm)
+{
+  std::cout << "CRF [" << iteration << "] : " << "Objective : " << -value << " Gradient Norm : " << gradient_norm
+            << " Log Likelihood / Sequence : " << log_likelihood << std::endl;
+  return true;
+}
+
+/* 系列の対数尤度を返し, 遷移素性のモデル期待値をexpected_countに足し込む.
+   位置t-1からtへの遷移(y', y)の周辺確率は exp(α_{t-1}(y') - log Z(y') + u(y) + d(y', y) + β_t(y) - log Z(x)).
+   最初の単語の対数確率は予測器のキャッシュを通さずに求める(学習の大量の文脈でキャッシュを追い出さない) */
+double MECRF::accumulate_expectation(const Sequence &sequence, const std::vector<double> &edge_factor,
+                                     std::vector<double> &expected_count, std::vector<double> &first_potential,
+                                     std::vector<double> &alpha, std::vector<double> &beta, std::vector<double> &work) const
+{
+  int length = sequence.labels.size();
+
+  calc_first_potential(sequence.context, first_potential);
+  forward(first_potential, length, edge_factor, alpha, work);
+  backward(length, edge_factor, beta, work);
+
+  /* log Z(x) = log Σ_y exp(α_{T-1}(y)) */
+  const double *last = &alpha[(size_t)(length-1) * label_size];
+  double max_alpha = max_value(last, label_size);
+  double sum_z = 0.0f;
+  for (int y = 0; y < label_size; y++) {
+    sum_z += exp(last[y] - max_alpha);
+  }
+  double log_norm_factor = max_alpha + log(sum_z);
+
+  /* 正解の単語列のスコア */
+  double score = first_potential[sequence.labels[0]];
+  for (int t = 1; t < length; t++) {
+    score += marginal_energy[sequence.labels[t]] - src_log_norm[sequence.labels[t-1]];
+    if (sequence.edges[t] != -1) {
+      score += edge_delta(sequence.edges[t]);
+    }
+  }
+
+  /* 遷移素性の周辺確率. 遷移素性IDは遷移元の順なのでalphaはほぼ順に読む */
+  for (int t = 1; t < length; t++) {
+    const double *prev = &alpha[(size_t)(t-1) * label_size];
+    const double *next = &beta[(size_t)t * label_size];
+    for (int k = 0; k < (int)transition_edge.size(); k++) {
+      int e   = transition_edge[k];
+      int src = edge_src[e], dst = edge_dst[e];
+      expected_count[k] += exp(prev[src] - src_log_norm[src] + marginal_energy[dst] + edge_energy[e] + transition_parameter[k]
+                               + next[dst] - log_norm_factor);
+    }
+  }
+
+  return score - log_norm_factor;
+}
+
+/* 前向き計算.
+     α_0(y) = log P(y|x)
+     α_t(y) = u(y) + a + log( Σ_{y'} e^{α'(y')-a} + Σ_{e∈in(y)} e^{α'(y'_e)-a}(e^{d_e} - 1) ),
+       α'(y') = α_{t-1}(y') - log Z(y'),  a = max_{y'} α'(y')
+   全体の和はyによらないので1段で1度だけ求め, yに入る疎な枝の分だけ足す */
+void MECRF::forward(const std::vector<double> &first_potential, int length, const std::vector<double> &edge_factor,
+                    std::vector<double> &alpha, std::vector<double> &work) const
+{
+  alpha.resize((size_t)length * label_size);
+  work.resize(label_size);
+  std::copy(first_potential.begin(), first_potential.begin() + label_size, alpha.begin());
+
+  for (int t = 1; t < length; t++) {
+    const double *prev = &alpha[(size_t)(t-1) * label_size];
+    double       *cur  = &alpha[(size_t)t * label_size];
+    for (int y = 0; y < label_size; y++) {
+      work[y] = prev[y] - src_log_norm[y];
+    }
+    double max_prev = max_value(&work[0], label_size);
+    double sum_prev = 0.0f;
+    for (int y = 0; y < label_size; y++) {
+      work[y]   = exp(work[y] - max_prev);
+      sum_prev += work[y];
+    }
+    for (int y = 0; y < label_size; y++) {
+      double sum = sum_prev;
+      for (int j = in_offset[y]; j < in_offset[y+1]; j++) {
+        int e = in_edge[j];
+        sum += work[edge_src[e]] * edge_factor[e];
+      }
+      /* 桁落ちで0以下になった和は, 表せる最小の正の値で止める */
+      cur[y] = marginal_energy[y] + max_prev + log(std::max(sum, DBL_MIN));
+    }
+  }
+}
+
+/* 後ろ向き計算.
+     β_{T-1}(y) = 0
+     β_{t-1}(y') = -log Z(y') + b + log( Σ_y e^{g(y)-b} + Σ_{e∈out(y')} e^{g(y_e)-b}(e^{d_e} - 1) ),  g(y) = u(y) + β_t(y), b = max_y g(y) */
+void MECRF::backward(int length, const std::vector<double> &edge_factor,
+                     std::vector<double> &beta, std::vector<double> &work) const
+{
+  beta.resize((size_t)length * label_size);
+  work.resize(label_size);
+  std::fill(beta.begin() + (size_t)(length-1) * label_size, beta.end(), 0.0f);
+
+  for (int t = length-1; t >= 1; t--) {
+    const double *next = &beta[(size_t)t * label_size];
+    double       *cur  = &beta[(size_t)(t-1) * label_size];
+    for (int y = 0; y < label_size; y++) {
+      work[y] = marginal_energy[y] + next[y];
+    }
+    double max_next = max_value(&work[0], label_size);
+    double sum_next = 0.0f;
+    for (int y = 0; y < label_size; y++) {
+      work[y]   = exp(work[y] - max_next);
+      sum_next += work[y];
+    }
+    for (int y = 0; y < label_size; y++) {
+      double sum = sum_next;
+      for (int e = out_offset[y]; e < out_offset[y+1]; e++) {
+        sum += work[edge_dst[e]] * edge_factor[e];
+      }
+      cur[y] = max_next + log(std::max(sum, DBL_MIN)) - src_log_norm[y];
+    }
+  }
+}
+
+/* 長さlengthの系列全体の対数正規化項 */
+double MECRF::calc_log_norm_factor(const std::vector<double> &first_potential, int length) const
+{
+  std::vector<double> edge_factor, alpha, work;
+
+  calc_edge_factor(transition_parameter, edge_factor);
+  forward(first_potential, length, edge_factor, alpha, work);
+
+  const double *last = &alpha[(size_t)(length-1) * label_size];
+  double max_alpha = max_value(last, label_size);
+  double sum_z = 0.0f;
+  for (int y = 0; y < label_size; y++) {
+    sum_z += exp(last[y] - max_alpha);
+  }
+  return max_alpha + log(sum_z);
+}
+
+/* ビタビ算法.
+     δ_t(y) = u(y) + max( max_{y'∉in(y)} δ'(y'), max_{e∈in(y)} δ'(y'_e) + d_e ),  δ'(y') = δ_{t-1}(y') - log Z(y')
+   疎な枝の無いy'についての最大値は, δ'の上位(最大の入次数+1)個を1度だけ並べておき,
+   yに疎な枝を持つy'を飛ばして先頭を取ればよい */
+std::pair<std::vector<std::string>, double> MECRF::viterbi(const std::vector<std::string> &pattern_x, int length) const
+{
+  std::vector<double> first_potential, delta, shifted, next_delta;
+  std::vector<int>    backpointer((size_t)std::max(length, 0) * label_size, -1); /* t*|Y| + y -> 直前の単語 */
+  std::vector<int>    order(label_size);                                       /* δ'の降順の単語 */
+  int num_top = std::min(label_size, max_in_degree + 1);
+
+  if (length <= 0 || label_size == 0) {
+    return std::make_pair(std::vector<std::string>(), 0.0);
+  }
+
+  predictor->get_log_probs(predictor->encode_pattern_x(pattern_x), first_potential);
+  delta = first_potential;
+  shifted.resize(label_size);
+  next_delta.resize(label_size);
+  for (int t = 1; t < length; t++) {
+    for (int y = 0; y < label_size; y++) {
+      shifted[y] = delta[y] - src_log_norm[y];
+      order[y]   = y;
+    }
+    std::partial_sort(order.begin(), order.begin() + num_top, order.end(), [&shifted](int a, int b) {
+      if (shifted[a] != shifted[b]) {
+        return shifted[a] > shifted[b];
+      }
+      return a < b;
+    });
+
+    for (int y = 0; y < label_size; y++) {
+      double best     = -HUGE_VAL;
+      int    best_src = -1;
+      for (int j = in_offset[y]; j < in_offset[y+1]; j++) {
+        int e = in_edge[j];
+        double score = shifted[edge_src[e]] + edge_delta(e);
+        if (score > best || (score == best && edge_src[e] < best_src)) {
+          best     = score;
+          best_src = edge_src[e];
+        }
+      }
+      for (int o_i = 0; o_i < num_top; o_i++) {
+        int key[2] = {order[o_i], y};
+        if (edge_index.find(key, 2) != -1) {
+          continue;
+        }
+        if (shifted[order[o_i]] > best || (shifted[order[o_i]] == best && order[o_i] < best_src)) {
+          best     = shifted[order[o_i]];
+          best_src = order[o_i];
+        }
+        break;
+      }
+      next_delta[y] = marginal_energy[y] + best;
+      backpointer[(size_t)t * label_size + y] = best_src;
+    }
+    delta.swap(next_delta);
+  }
+
+  /* 最後の単語から辿る */
+  int y = std::max_element(delta.begin(), delta.end()) - delta.begin();
+  double score = delta[y];
+  std::vector<int> labels(length);
+  for (int t = length-1; t >= 0; t--) {
+    labels[t] = y;
+    if (t > 0) {
+      y = backpointer[(size_t)t * label_size + y];
+    }
+  }
+
+  return std::make_pair(decode_labels(labels), exp(score - calc_log_norm_factor(first_potential, length)));
+}
+
+/* ビーム探索. 各仮説を伸ばす候補は, 最後の単語から出る疎な枝の行き先と,
+   疎な枝の無い単語のうちu(y)の上位beam_width個だけで足りる(log Z(y')は仮説毎に共通で, 残るのは全体でbeam_width個なので) */
+std::vector<std::pair<std::vector<std::string>, double> >
+MECRF::beam_search(const std::vector<std::string> &pattern_x, int length, int beam_width) const
+{
+  std::vector<std::pair<std::vector<std::string>, double> > result;
+  std::vector<std::pair<std::vector<int>, double> > beam, next_beam; /* 仮説の(単語列, 対数スコア) */
+  std::vector<BeamCandidate> candidates;
+  std::vector<double> first_potential;
+
+  if (length <= 0 || beam_width <= 0 || label_size == 0) {
+    return result;
+  }
+
+  /* 最初の単語はlog P(y|x)の上位 */
+  predictor->get_log_probs(predictor->encode_pattern_x(pattern_x), first_potential);
+  for (int y = 0; y < label_size; y++) {
+    BeamCandidate candidate = {first_potential[y], 0, y};
+    candidates.push_back(candidate);
+  }
+  int num_keep = std::min((int)candidates.size(), beam_width);
+  std::partial_sort(candidates.begin(), candidates.begin() + num_keep, candidates.end(), candidate_order);
+  for (int c_i = 0; c_i < num_keep; c_i++) {
+    beam.push_back(std::make_pair(std::vector<int>(1, candidates[c_i].y), candidates[c_i].score));
+  }
+
+  for (int t = 1; t < length; t++) {
+    candidates.clear();
+    for (int h_i = 0; h_i < (int)beam.size(); h_i++) {
+      int    last  = beam[h_i].first.back();
+      double score = beam[h_i].second - src_log_norm[last];
+      for (int e = out_offset[last]; e < out_offset[last+1]; e++) {
+        BeamCandidate candidate = {score + marginal_energy[edge_dst[e]] + edge_delta(e), h_i, edge_dst[e]};
+        candidates.push_back(candidate);
+      }
+      int num_added = 0;
+      for (int r_i = 0; r_i < label_size && num_added < beam_width; r_i++) {
+        int key[2] = {last, marginal_ranking[r_i]};
+        if (edge_index.find(key, 2) != -1) {
+          continue;
+        }
+        BeamCandidate candidate = {score + marginal_energy[marginal_ranking[r_i]], h_i, marginal_ranking[r_i]};
+        candidates.push_back(candidate);
+        num_added++;
+      }
+    }
+
+    num_keep = std::min((int)candidates.size(), beam_width);
+    std::partial_sort(candidates.begin(), candidates.begin() + num_keep, candidates.end(), candidate_order);
+    next_beam.clear();
+    for (int c_i = 0; c_i < num_keep; c_i++) {
+      std::vector<int> labels(beam[candidates[c_i].hypothesis].first);
+      labels.push_back(candidates[c_i].y);
+      next_beam.push_back(std::make_pair(labels, candidates[c_i].score));
+    }
+    beam.swap(next_beam);
+  }
+
+  /* 確率に直す */
+  double log_norm_factor = calc_log_norm_factor(first_potential, length);
+  for (int h_i = 0; h_i < (int)beam.size(); h_i++) {
+    result.push_back(std::make_pair(decode_labels(beam[h_i].first), exp(beam[h_i].second - log_norm_factor)));
+  }
+  return result;
+}
+
+/* 内部表現の単語列を文字列に直す */
+std::vector<std::string> MECRF::decode_labels(const std::vector<int> &labels) const
+{
+  std::vector<std::string> words;
+  for (int t = 0; t < (int)labels.size(); t++) {
+    words.push_back(predictor->decode_word(labels[t]));
+  }
+  return words;
+}
+
+/* 対数スコアの最大値 */
+double MECRF::max_value(const double *values, int size)
+{
+  double max = -HUGE_VAL;
+  for (int i = 0; i < size; i++) {
+    max = std::max(max, values[i]);
+  }
+  return max;
+}
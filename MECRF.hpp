@@ -0,0 +1,133 @@
+#ifndef MECRF_H_INCLUDED
+#define MECRF_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <memory>
+
+#include "MEPatternIndex.hpp"
+#include "MEPredictor.hpp"
+#include "METhreadPool.hpp"
+#include "MEOptimizer.hpp"
+
+/* 線形連鎖CRFのデフォルト値 */
+const int    CRF_SEQUENCE_LENGTH = 4;   /* 学習に使う系列(文脈の後に続く単語列)の長さ */
+const int    CRF_MAX_ITERATION   = 100; /* 学習(L-BFGS法)の最大反復回数 */
+const double CRF_PRIOR_VARIANCE  = 1.0; /* 遷移素性のガウス事前分布の分散σ^2. 0以下なら使わない */
+
+/* 最大エントロピーモデルに遷移素性を加えた線形連鎖CRF.
+   文脈xに続く単語列y_1..y_Tのスコアを
+     S(y|x) = log P(y_1|x) + Σ_{t≥2} ( log P(y_t|y_{t-1}) + ψ(y_{t-1}, y_t) ),  P(y|x) = exp(S(y|x))/Z(x)
+   とする. log P(y|x), log P(y|y')は学習済みの最大エントロピーモデルの対数確率で, t≥2の枝の土台は直前の1語を文脈にした
+     log P(y|y') = u(y) + e(y|y') - log Z(y')   (e(y|y')はy∈Y(y')の時だけ0でない)
+   と分かれる. ψは学習データに現れた単語の2つ組(y', y)毎の遷移素性のパラメタで, 素性の無い組は0.
+   u(y)は遷移先だけ, log Z(y')は遷移元だけで決まるので, 枝のうち組毎に決まる部分d(y', y) = e(y|y') + ψ(y', y)は
+   モデルの条件付き素性のある組と遷移素性のある組(合わせて「疎な枝」)の外では0になる.
+   そこで前向き/後ろ向きの和は最大エントロピーモデルの正規化項と同じく, 全体の和に疎な枝のずれを足して求める.
+     Σ_{y'} exp(α(y') - log Z(y') + d(y', y)) = Σ_{y'} exp(α(y') - log Z(y')) + Σ_{y'∈in(y)} exp(α(y') - log Z(y'))(exp(d(y', y)) - 1)
+   1段あたりO(|Y| + 疎な枝の数)で, 値はすべて最大の項で割ってから足す対数で持つ.
+   ポテンシャルは予測器から引くので, 予測器(モデル)を学習し直したらCRFも作り直すこと */
+class MECRF {
+private:
+  /* 学習に使う系列: 文脈xと, それに続く単語列 */
+  struct Sequence {
+    std::vector<int> context;     /* 文脈xの内部表現(末尾maxN_gram-1語) */
+    std::vector<int> labels;      /* 続く単語列y_1..y_T */
+    std::vector<int> edges;       /* t(≥2)番目の遷移(y_{t-1}, y_t)の疎な枝ID. 無ければ-1 */
+  };
+
+  /* 目的関数: 系列あたりの負の対数尤度と事前分布の項 */
+  class LearningObjective : public MEObjective {
+  public:
+    double                                prior_scale;     /* 事前分布の係数 1/(σ^2 M) (Mは系列数). 0なら事前分布なし */
+  private:
+    MECRF                                *crf;             /* パラメタを書き込み, 期待値を計算するCRF */
+    double                                log_likelihood;  /* 直前に評価した点での系列あたりの対数尤度 */
+  public:
+    LearningObjective(MECRF *crf);
+    double evaluate(const std::vector<double> &x, std::vector<double> &gradient);
+    bool progress(int iteration, const std::vector<double> &x, double value, double gradient_norm);
+  };
+
+  std::shared_ptr<const MEPredictor> predictor;            /* ポテンシャルを引く予測器. 学習したスナップショットを持ち続ける */
+  int                                label_size;           /* yの値域の大きさ|Y| */
+  int                                sequence_length;      /* 学習に使う系列の長さ */
+  int                                count_bias;           /* 頻度がこの値以下の遷移は素性にしない */
+  int                                max_iteration;        /* 学習の最大反復回数 */
+  double                             prior_variance;       /* 遷移素性のガウス事前分布の分散σ^2 */
+  METhreadPool                      *thread_pool;          /* 前向き後ろ向き計算の並列化に使うスレッドプール */
+  std::vector<Sequence>              sequences;            /* 学習に使う系列 */
+  std::vector<double>                marginal_energy;      /* y -> 周辺素性のみによるエネルギーu(y). 学習データに無いyは-∞ */
+  std::vector<int>                   marginal_ranking;     /* marginal_energyの降順(同じ値ならIDの昇順)に並べたy */
+  std::vector<double>                src_log_norm;         /* y' -> 直前の1語y'を文脈にした正規化項log Z(y') */
+  MEPatternIndex                     edge_index;           /* 疎な枝(y', y) -> 枝ID. IDは(y', y)の昇順 */
+  std::vector<int>                   edge_src;             /* 枝ID -> 遷移元y' */
+  std::vector<int>                   edge_dst;             /* 枝ID -> 遷移先y */
+  std::vector<double>                edge_energy;          /* 枝ID -> モデルの条件付き素性のエネルギーe(y|y'). 無ければ0 */
+  std::vector<int>                   edge_transition;      /* 枝ID -> 遷移素性ID. 無ければ-1 */
+  std::vector<int>                   transition_edge;      /* 遷移素性ID -> 枝ID. 遷移素性IDも(y', y)の昇順 */
+  std::vector<double>                transition_parameter; /* 遷移素性ID -> パラメタψ(y', y) */
+  std::vector<double>                empirical_count;      /* 遷移素性ID -> 系列あたりの出現回数(経験期待値) */
+  std::vector<int>                   out_offset;           /* y' -> y'から出る枝IDの先頭(枝IDは遷移元の順なのでそのまま区間) */
+  std::vector<int>                   in_offset;            /* y -> in_edgeの先頭位置(CSR形式) */
+  std::vector<int>                   in_edge;              /* yに入る枝ID. y毎に遷移元の昇順 */
+  int                                max_in_degree;        /* 1つのyに入る枝の最大数 */
+
+public:
+  /* コンストラクタ. predictorは学習済みモデルの予測器のスナップショット */
+  MECRF(std::shared_ptr<const MEPredictor> predictor, int sequence_length=CRF_SEQUENCE_LENGTH, int count_bias=1,
+        int num_threads=1, int max_iteration=CRF_MAX_ITERATION);
+  /* デストラクタ */
+  ~MECRF(void);
+
+  /* ファイル名の配列を受け取り, 系列と遷移素性を作る */
+  void read_file_str_list(const std::vector<std::string> &filenames);
+  /* 遷移素性のガウス事前分布の分散σ^2をセットする. 0以下なら事前分布を使わない */
+  void set_prior_variance(double prior_variance);
+  /* 遷移素性のパラメタをL-BFGS法で学習する */
+  void learning(void);
+  /* 遷移素性の数 */
+  int get_num_transitions(void) const;
+  /* 文脈(文字列パターン)に続く長さlengthの単語列のうち, 最も確率の高いものをビタビ算法で求め,
+     (単語列, 確率)の組で返す */
+  std::pair<std::vector<std::string>, double> viterbi(const std::vector<std::string> &pattern_x, int length) const;
+  /* 文脈に続く長さlengthの単語列を幅beam_widthのビーム探索で求め, 上位から(単語列, 確率)の組で返す */
+  std::vector<std::pair<std::vector<std::string>, double> >
+    beam_search(const std::vector<std::string> &pattern_x, int length, int beam_width) const;
+
+private:
+  /* 読んだ単語列から学習系列を切り出して加え, 遷移の頻度を数える */
+  void add_sequences(const std::vector<int> &words, MEPatternIndex &pair_index, std::vector<int> &pair_count);
+  /* 頻度がcount_biasを超える遷移を素性にし, 疎な枝を作り直す */
+  void build_transitions(const MEPatternIndex &pair_index, const std::vector<int> &pair_count);
+  /* モデルの条件付き素性のある組と, 遷移素性にする組transition_pairs((y', y)の昇順)を併せて疎な枝にし,
+     遷移元/遷移先の索引を作る */
+  void build_edges(const std::vector<std::pair<int, int> > &transition_pairs);
+  /* 疎な枝eの組毎に決まる部分d_e = e(y|y') + ψ(y', y)を今のパラメタで返す */
+  double edge_delta(int e) const;
+  /* 遷移素性のパラメタparameterでの, 疎な枝毎のexp(d(y', y)) - 1をedge_factorにセットする */
+  void calc_edge_factor(const std::vector<double> &parameter, std::vector<double> &edge_factor) const;
+  /* 文脈xでの最初の単語の対数確率log P(y|x)をyの順にfirst_potentialにセットする. キャッシュを通さない */
+  void calc_first_potential(const std::vector<int> &context, std::vector<double> &first_potential) const;
+  /* 前向き計算. alpha[t*|Y| + y]にt番目(0始まり)がyで終わる部分列の対数スコア和をセットする.
+     edge_factor[e]はexp(d_e) - 1, workは作業用 */
+  void forward(const std::vector<double> &first_potential, int length, const std::vector<double> &edge_factor,
+               std::vector<double> &alpha, std::vector<double> &work) const;
+  /* 後ろ向き計算. beta[t*|Y| + y]にt番目がyである時の, それ以降の対数スコア和をセットする */
+  void backward(int length, const std::vector<double> &edge_factor,
+                std::vector<double> &beta, std::vector<double> &work) const;
+  /* 系列の対数尤度を返し, 遷移素性のモデル期待値をexpected_countに足し込む */
+  double accumulate_expectation(const Sequence &sequence, const std::vector<double> &edge_factor,
+                                std::vector<double> &expected_count, std::vector<double> &first_potential,
+                                std::vector<double> &alpha, std::vector<double> &beta, std::vector<double> &work) const;
+  /* 長さlengthの系列全体の対数正規化項log Z(x) */
+  double calc_log_norm_factor(const std::vector<double> &first_potential, int length) const;
+  /* 内部表現の単語列を文字列に直す */
+  std::vector<std::string> decode_labels(const std::vector<int> &labels) const;
+  /* 対数スコアの最大値. 全て-∞なら-∞ */
+  static double max_value(const double *values, int size);
+
+};
+
+#endif /* MECRF_H_INCLUDED */
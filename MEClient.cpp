@@ -0,0 +1,130 @@
+#include "MEClient.hpp"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* コンストラクタ */
+MEClient::MEClient(void)
+{
+  fd = -1;
+}
+
+/* デストラクタ */
+MEClient::~MEClient(void)
+{
+  close();
+}
+
+/* サーバに接続する */
+bool MEClient::connect(const std::string &socket_path)
+{
+  struct sockaddr_un address;
+
+  close();
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error : socket path \"" << socket_path << "\" is too long." << std::endl;
+    return false;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || ::connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    std::cerr << "Error : cannot connect to \"" << socket_path << "\" : " << strerror(errno) << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+/* 接続を閉じる */
+void MEClient::close(void)
+{
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+/* 次の単語のランキング */
+bool MEClient::get_ranking(const std::vector<std::string> &pattern_x, int ranking_size,
+                           std::vector<std::pair<std::string, double> > &ranking)
+{
+  return request(REQUEST_RANKING, pattern_x, ranking_size, 0, 0, ranking);
+}
+
+/* 複数単語の補完. 単語列は空白区切りで返ってくるので分ける */
+bool MEClient::get_completions(const std::vector<std::string> &pattern_x, int max_length, int beam_width, int num_results,
+                               std::vector<std::pair<std::vector<std::string>, double> > &completions)
+{
+  std::vector<std::pair<std::string, double> > results;
+
+  completions.clear();
+  if (!request(REQUEST_COMPLETION, pattern_x, num_results, max_length, beam_width, results)) {
+    return false;
+  }
+  for (int r_i = 0; r_i < (int)results.size(); r_i++) {
+    std::vector<std::string> words;
+    size_t current = 0, found;
+    while ((found = results[r_i].first.find(' ', current)) != std::string::npos) {
+      words.push_back(std::string(results[r_i].first, current, found - current));
+      current = found + 1;
+    }
+    words.push_back(std::string(results[r_i].first, current));
+    completions.push_back(std::make_pair(words, results[r_i].second));
+  }
+  return true;
+}
+
+/* サーバの停止 */
+bool MEClient::shutdown_server(void)
+{
+  std::vector<std::pair<std::string, double> > results;
+  return request(REQUEST_SHUTDOWN, std::vector<std::string>(), 0, 0, 0, results);
+}
+
+/* 要求の送信と応答の受信 */
+bool MEClient::request(unsigned int type, const std::vector<std::string> &pattern_x, int count, int max_length, int beam_width,
+                       std::vector<std::pair<std::string, double> > &results)
+{
+  MEMessage message;
+  std::string context;
+
+  results.clear();
+  if (fd == -1) {
+    return false;
+  }
+
+  for (int i = 0; i < (int)pattern_x.size(); i++) {
+    context += (i > 0 ? " " : "") + pattern_x[i];
+  }
+  message.put_int(type);
+  message.put_int(count);
+  message.put_int(max_length);
+  message.put_int(beam_width);
+  message.put_string(context);
+  if (!message.send(fd) || !message.receive(fd)) {
+    std::cerr << "Error : lost connection to the server." << std::endl;
+    close();
+    return false;
+  }
+
+  unsigned int status      = message.get_int();
+  int          num_results = message.get_int();
+  for (int r_i = 0; r_i < num_results && message.is_ok(); r_i++) {
+    std::string text = message.get_string();
+    double      prob = message.get_double();
+    results.push_back(std::make_pair(text, prob));
+  }
+  if (!message.is_ok() || status != RESPONSE_OK) {
+    std::cerr << "Error : server returned an error." << std::endl;
+    results.clear();
+    return false;
+  }
+  return true;
+}
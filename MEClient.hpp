@@ -0,0 +1,40 @@
+#ifndef MECLIENT_H_INCLUDED
+#define MECLIENT_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <utility>
+
+#include "MEMessage.hpp"
+
+/* 予測サーバ(MEServer)のクライアント. 1つの接続で要求を順に送り, 応答を待つ */
+class MEClient {
+private:
+  int fd; /* サーバへの接続. 未接続なら-1 */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  MEClient(void);
+  ~MEClient(void);
+
+  /* socket_pathのサーバに接続する. 接続できなければfalse */
+  bool connect(const std::string &socket_path);
+  /* 接続を閉じる */
+  void close(void);
+  /* 文脈の次の単語の上位ranking_sizeを(単語, 確率)の組で得る. 通信に失敗したらfalse */
+  bool get_ranking(const std::vector<std::string> &pattern_x, int ranking_size,
+                   std::vector<std::pair<std::string, double> > &ranking);
+  /* 文脈を最大max_length語まで伸ばす単語列の上位num_results個を(単語列, 確率)の組で得る. 通信に失敗したらfalse */
+  bool get_completions(const std::vector<std::string> &pattern_x, int max_length, int beam_width, int num_results,
+                       std::vector<std::pair<std::vector<std::string>, double> > &completions);
+  /* サーバを停止させる */
+  bool shutdown_server(void);
+
+private:
+  /* 要求を送って応答を受け取り, 結果の(文字列, 確率)の組を返す. 失敗/エラー応答ならfalse */
+  bool request(unsigned int type, const std::vector<std::string> &pattern_x, int count, int max_length, int beam_width,
+               std::vector<std::pair<std::string, double> > &results);
+
+};
+
+#endif /* MECLIENT_H_INCLUDED */
@@ -0,0 +1,77 @@
+#include "MEContextCache.hpp"
+
+/* コンストラクタ */
+MEContextCache::MEContextCache(size_t capacity)
+{
+  this->capacity = capacity;
+  num_hits       = 0;
+  num_misses     = 0;
+}
+
+/* デストラクタ */
+MEContextCache::~MEContextCache(void) { ; }
+
+/* キーのエントリを探す */
+bool MEContextCache::lookup(const std::vector<int> &key, Entry &entry)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::map<std::vector<int>, EntryList::iterator>::iterator map_it = entry_map.find(key);
+
+  if (map_it == entry_map.end()) {
+    num_misses++;
+    return false;
+  }
+
+  /* 最近使ったエントリとして先頭に移す */
+  entries.splice(entries.begin(), entries, map_it->second);
+  entry = *map_it->second;
+  num_hits++;
+  return true;
+}
+
+/* エントリを登録/更新する */
+void MEContextCache::store(const Entry &entry)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::map<std::vector<int>, EntryList::iterator>::iterator map_it = entry_map.find(entry.key);
+
+  if (capacity == 0) {
+    return;
+  }
+
+  /* 既にあれば上書きして先頭に移す */
+  if (map_it != entry_map.end()) {
+    *map_it->second = entry;
+    entries.splice(entries.begin(), entries, map_it->second);
+    return;
+  }
+
+  /* 容量を超えるなら末尾(最も長く使われていない)エントリを捨てる */
+  if (entries.size() >= capacity) {
+    entry_map.erase(entries.back().key);
+    entries.pop_back();
+  }
+
+  entries.push_front(entry);
+  entry_map[entry.key] = entries.begin();
+}
+
+/* 全エントリを捨て, 統計も0に戻す */
+void MEContextCache::clear(void)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  entries.clear();
+  entry_map.clear();
+  num_hits   = 0;
+  num_misses = 0;
+}
+
+/* ヒット数, ミス数を取得する */
+void MEContextCache::get_statistics(unsigned long *hits, unsigned long *misses)
+{
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  *hits   = num_hits;
+  *misses = num_misses;
+}
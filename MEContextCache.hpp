@@ -0,0 +1,54 @@
+#ifndef MECONTEXTCACHE_H_INCLUDED
+#define MECONTEXTCACHE_H_INCLUDED
+
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <cstddef>
+
+const size_t CONTEXT_CACHE_SIZE = 1024; /* 文脈キャッシュのデフォルトのエントリ数 */
+
+/* 予測の文脈xについての計算結果を持つ, 容量制限付きのLRUキャッシュ.
+   キーはxの内部表現の接尾辞(予測に効く部分)で, log Z(x)とY(x)の対数得点, 最後に求めた上位ランキングを持つ.
+   全ての操作は排他制御されるので, 複数スレッドから同時に使ってよい */
+class MEContextCache {
+public:
+  /* キャッシュのエントリ */
+  struct Entry {
+    std::vector<int>                     key;             /* xの接尾辞 */
+    double                               log_norm_factor; /* log Z(x) */
+    std::vector<std::pair<int, double> > cond_scores;     /* Y(x)の(y, log z(y)exp(e(y|x))). yの昇順 */
+    std::vector<std::pair<int, double> > ranking;         /* 最後に求めた上位ランキング. (単語ID, 確率) */
+    int                                  ranking_size;    /* rankingを求めた時のランキングサイズ. 未計算なら-1 */
+  };
+
+private:
+  typedef std::list<Entry> EntryList;
+
+  size_t                                               capacity;    /* 最大エントリ数 */
+  EntryList                                            entries;     /* エントリ. 先頭ほど最近使った */
+  std::map<std::vector<int>, EntryList::iterator>      entry_map;   /* キー -> エントリ */
+  unsigned long                                        num_hits;    /* ヒット数 */
+  unsigned long                                        num_misses;  /* ミス数 */
+  std::mutex                                           cache_mutex; /* 排他制御 */
+
+public:
+  /* コンストラクタ. capacityは最大エントリ数(0ならキャッシュしない) */
+  MEContextCache(size_t capacity=CONTEXT_CACHE_SIZE);
+  /* デストラクタ */
+  ~MEContextCache(void);
+
+  /* キーのエントリを探し, あればentryにコピーしてtrue. ヒット/ミス数を数える */
+  bool lookup(const std::vector<int> &key, Entry &entry);
+  /* エントリを登録/更新する. 容量を超えたら最も長く使われていないエントリを捨てる */
+  void store(const Entry &entry);
+  /* 全エントリを捨て, ヒット数, ミス数も0に戻す */
+  void clear(void);
+  /* ヒット数, ミス数を取得する */
+  void get_statistics(unsigned long *hits, unsigned long *misses);
+
+};
+
+#endif /* MECONTEXTCACHE_H_INCLUDED */
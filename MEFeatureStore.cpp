@@ -0,0 +1,170 @@
+#include "MEFeatureStore.hpp"
+
+/* コンストラクタ */
+MEFeatureStore::MEFeatureStore(void)
+{
+  pattern_offset.assign(1, 0);
+}
+
+/* デストラクタ */
+MEFeatureStore::~MEFeatureStore(void) { ; }
+
+/* 素性の数 */
+int MEFeatureStore::size(void) const
+{
+  return pattern_y.size();
+}
+
+bool MEFeatureStore::empty(void) const
+{
+  return pattern_y.empty();
+}
+
+/* 全ての素性を削除 */
+void MEFeatureStore::clear(void)
+{
+  pattern_offset.assign(1, 0);
+  pattern_buffer.clear();
+  pattern_y.clear();
+  weight.clear();
+  count.clear();
+  empirical_prob.clear();
+  empirical_E.clear();
+  model_E.clear();
+  parameter.clear();
+  is_marginal.clear();
+}
+
+/* 領域の確保 */
+void MEFeatureStore::reserve(int num_features, int pattern_size)
+{
+  pattern_offset.reserve(num_features+1);
+  pattern_buffer.reserve(pattern_size);
+  pattern_y.reserve(num_features);
+  weight.reserve(num_features);
+  count.reserve(num_features);
+  empirical_prob.reserve(num_features);
+  empirical_E.reserve(num_features);
+  model_E.reserve(num_features);
+  parameter.reserve(num_features);
+  is_marginal.reserve(num_features);
+}
+
+/* 素性の追加 */
+int MEFeatureStore::push_back(const int *pattern_x, int x_size, int pattern_y, int count, double weight)
+{
+  pattern_buffer.insert(pattern_buffer.end(), pattern_x, pattern_x + x_size);
+  pattern_offset.push_back(pattern_buffer.size());
+  this->pattern_y.push_back(pattern_y);
+  this->weight.push_back(weight);
+  this->count.push_back(count);
+  empirical_prob.push_back(0.0f);
+  empirical_E.push_back(0.0f);
+  model_E.push_back(0.0f);
+  parameter.push_back(0.0f);  /* パラメタの初期値は要審議 */
+  is_marginal.push_back(0);
+
+  return this->pattern_y.size() - 1;
+}
+
+/* 他の集合の素性を値ごと追加 */
+int MEFeatureStore::push_back(const MEFeatureStore &src, int f_i)
+{
+  int new_index = push_back(src.get_pattern_x(f_i), src.get_x_size(f_i), src.pattern_y[f_i],
+                            src.count[f_i], src.weight[f_i]);
+  empirical_prob[new_index] = src.empirical_prob[f_i];
+  empirical_E[new_index]    = src.empirical_E[f_i];
+  model_E[new_index]        = src.model_E[f_i];
+  parameter[new_index]      = src.parameter[f_i];
+  is_marginal[new_index]    = src.is_marginal[f_i];
+
+  return new_index;
+}
+
+/* 残す素性を前に詰める. 詰める先は常に読む位置以前なので, その場で上書きしてよい */
+void MEFeatureStore::compact(const std::vector<char> &is_kept)
+{
+  int num_kept = 0, buffer_size = 0;
+
+  for (int f_i = 0; f_i < size(); f_i++) {
+    if (!is_kept[f_i]) {
+      continue;
+    }
+    int begin = pattern_offset[f_i], end = pattern_offset[f_i+1];
+    for (int p_i = begin; p_i < end; p_i++) {
+      pattern_buffer[buffer_size++] = pattern_buffer[p_i];
+    }
+    pattern_offset[num_kept+1]  = buffer_size;
+    pattern_y[num_kept]         = pattern_y[f_i];
+    weight[num_kept]            = weight[f_i];
+    count[num_kept]             = count[f_i];
+    empirical_prob[num_kept]    = empirical_prob[f_i];
+    empirical_E[num_kept]       = empirical_E[f_i];
+    model_E[num_kept]           = model_E[f_i];
+    parameter[num_kept]         = parameter[f_i];
+    is_marginal[num_kept]       = is_marginal[f_i];
+    num_kept++;
+  }
+
+  pattern_offset.resize(num_kept+1);
+  pattern_buffer.resize(buffer_size);
+  pattern_y.resize(num_kept);
+  weight.resize(num_kept);
+  count.resize(num_kept);
+  empirical_prob.resize(num_kept);
+  empirical_E.resize(num_kept);
+  model_E.resize(num_kept);
+  parameter.resize(num_kept);
+  is_marginal.resize(num_kept);
+}
+
+/* 単語IDの付け替え. パターンの長さは変わらないので, 連結した配列をそのまま書き換える */
+void MEFeatureStore::remap_words(const std::vector<int> &new_word_id)
+{
+  for (int p_i = 0; p_i < (int)pattern_buffer.size(); p_i++) {
+    pattern_buffer[p_i] = new_word_id[pattern_buffer[p_i]];
+  }
+  for (int f_i = 0; f_i < size(); f_i++) {
+    pattern_y[f_i] = new_word_id[pattern_y[f_i]];
+  }
+}
+
+/* パターンの取得ルーチン */
+int MEFeatureStore::get_N_gram(int f_i) const
+{
+  return get_x_size(f_i) + 1;
+}
+
+int MEFeatureStore::get_x_size(int f_i) const
+{
+  return pattern_offset[f_i+1] - pattern_offset[f_i];
+}
+
+const int *MEFeatureStore::get_pattern_x(int f_i) const
+{
+  return pattern_buffer.data() + pattern_offset[f_i];
+}
+
+int MEFeatureStore::get_pattern_y(int f_i) const
+{
+  return pattern_y[f_i];
+}
+
+/* (pattern_x, pattern_y)を連結したキー */
+void MEFeatureStore::get_pattern_key(int f_i, std::vector<int> &key) const
+{
+  key.assign(get_pattern_x(f_i), get_pattern_x(f_i) + get_x_size(f_i));
+  key.push_back(pattern_y[f_i]);
+}
+
+/* 使用しているメモリ量（概算） */
+size_t MEFeatureStore::memory_size(void) const
+{
+  return pattern_buffer.capacity() * sizeof(int) + pattern_y.capacity() * memory_per_feature(0);
+}
+
+/* 素性1つあたりのメモリ量（概算）: pattern_x, オフセット, y/頻度, 5つの実数値, 周辺素性フラグ */
+size_t MEFeatureStore::memory_per_feature(int x_size)
+{
+  return (x_size + 3) * sizeof(int) + 5 * sizeof(double) + sizeof(char);
+}
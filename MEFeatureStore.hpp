@@ -0,0 +1,63 @@
+#ifndef MEFEATURESTORE_H_INCLUDED
+#define MEFEATURESTORE_H_INCLUDED
+
+#include <vector>
+#include <cstddef>
+
+/* Maximum Entropy Model （最大エントロピーモデル）の素性の集合.
+   素性毎の値を値の種類毎の配列に持つ(structure of arrays). 素性はインデックス(0,1,2,...)で指す.
+   素性(N_gram, pattern_x, pattern_y)のpattern_xは1本の配列に連結して格納し(素性毎のヒープ確保をしない),
+   pattern_x[0]=x_1, ... , pattern_x[N_gram-2]=x_{N_gram-1} をオフセットで引く.
+   学習のループはパラメタや期待値の配列を頭から舐めるだけになる */
+class MEFeatureStore {
+private:
+  std::vector<int>    pattern_offset; /* 素性 -> pattern_bufferの先頭位置. 末尾に番兵を持つ(size()+1要素) */
+  std::vector<int>    pattern_buffer; /* 全素性のpattern_xを連結した配列 */
+  std::vector<int>    pattern_y;      /* 素性 -> Nグラムの今の単語 */
+
+public:
+  std::vector<double> weight;         /* 素性の重み */
+  std::vector<int>    count;          /* 素性のパターンが学習データで表れた回数 */
+  std::vector<double> empirical_prob; /* 素性の学習データにおける経験確率 */
+  std::vector<double> empirical_E;    /* 素性の経験期待値 */
+  std::vector<double> model_E;        /* 素性のモデル期待値 */
+  std::vector<double> parameter;      /* 素性に付随する, モデルのパラメタ */
+  std::vector<char>   is_marginal;    /* 周辺素性（yのみに依存して活性化する素性）か否（条件付き素性）か */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  MEFeatureStore(void);
+  ~MEFeatureStore(void);
+
+  /* 素性の数 */
+  int size(void) const;
+  bool empty(void) const;
+  /* 全ての素性を削除 */
+  void clear(void);
+  /* num_features個の素性と, 連結したpattern_xの長さの合計pattern_sizeの領域を確保 */
+  void reserve(int num_features, int pattern_size);
+  /* 素性(長さx_sizeのpattern_x, pattern_y)を末尾に追加してインデックスを返す. 経験確率/期待値/パラメタは0 */
+  int push_back(const int *pattern_x, int x_size, int pattern_y, int count=1, double weight=1.0f);
+  /* srcのf_i番目の素性を, 全ての値と共に末尾に追加してインデックスを返す */
+  int push_back(const MEFeatureStore &src, int f_i);
+  /* is_kept[f_i]が0でない素性だけを順序を保って前に詰め, 残りを捨てる */
+  void compact(const std::vector<char> &is_kept);
+  /* 全ての素性のパターンの単語IDをnew_word_idで付け替える */
+  void remap_words(const std::vector<int> &new_word_id);
+
+  /* パターンの取得ルーチン. pattern_xの指す先は素性を追加/削除するまで有効 */
+  int get_N_gram(int f_i) const;
+  int get_x_size(int f_i) const;
+  const int *get_pattern_x(int f_i) const;
+  int get_pattern_y(int f_i) const;
+  /* (pattern_x, pattern_y)を連結したキーをkeyに書く */
+  void get_pattern_key(int f_i, std::vector<int> &key) const;
+
+  /* 使用しているメモリ量[byte]（概算） */
+  size_t memory_size(void) const;
+  /* pattern_xの長さがx_sizeの素性1つあたりのメモリ量[byte]（概算. メモリ予算の見積もり用） */
+  static size_t memory_per_feature(int x_size);
+
+};
+
+#endif /* MEFEATURESTORE_H_INCLUDED */
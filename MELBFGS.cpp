@@ -0,0 +1,143 @@
+#include "MELBFGS.hpp"
+#include <cmath>
+#include <algorithm>
+
+/* コンストラクタ */
+MELBFGS::MELBFGS(int history_size, int max_iteration, double epsilon)
+{
+  this->history_size  = history_size;
+  this->max_iteration = max_iteration;
+  this->epsilon       = epsilon;
+}
+
+/* デストラクタ */
+MELBFGS::~MELBFGS(void)
+{
+}
+
+/* xを初期値としてobjectiveを最小化する.
+   収束判定は, 勾配ノルムが十分小さくなった時か, 目的関数の相対減少量がepsilonを下回った時 */
+bool MELBFGS::minimize(MEObjective &objective, std::vector<double> &x)
+{
+  int n = x.size();
+  std::vector<double> gradient(n), direction(n);        /* 現在の勾配, 探索方向 */
+  std::vector<double> next_x(n), next_gradient(n);      /* 直線探索の試行点と, そこでの勾配 */
+  double value, next_value;                             /* 目的関数の値 */
+
+  history.clear();
+  value = objective.evaluate(x, gradient);
+  if (std::isnan(value) || std::isinf(value)) {
+    return false;
+  }
+
+  for (int iteration = 0; iteration < max_iteration; iteration++) {
+    double gradient_norm = sqrt(dot(gradient, gradient));
+    double x_norm        = sqrt(dot(x, x));
+    if (gradient_norm / std::max(1.0, x_norm) < epsilon) {
+      return true;
+    }
+
+    /* 探索方向. 近似が壊れて降下方向でなくなったら, 履歴を捨てて最急降下方向にする */
+    calc_direction(gradient, direction);
+    double direction_gradient = dot(direction, gradient);
+    if (!(direction_gradient > 0.0f)) {
+      history.clear();
+      direction = gradient;
+      direction_gradient = gradient_norm * gradient_norm;
+    }
+
+    /* バックトラッキング直線探索. 履歴が無い(最急降下の)時は, 最初の歩幅を勾配の大きさで正規化する.
+       値が非数/無限になった点も減少しなかったものとして歩幅を縮める */
+    double step = history.empty() ? 1.0 / gradient_norm : 1.0;
+    bool   is_accepted = false;
+    for (int search_i = 0; search_i < LBFGS_MAX_LINE_SEARCH; search_i++) {
+      for (int i = 0; i < n; i++) {
+        next_x[i] = x[i] - step * direction[i];
+      }
+      next_value = objective.evaluate(next_x, next_gradient);
+      if (!std::isnan(next_value) && !std::isinf(next_value)
+          && next_value <= value - LBFGS_ARMIJO_COEFFICIENT * step * direction_gradient) {
+        is_accepted = true;
+        break;
+      }
+      step *= 0.5f;
+    }
+    if (!is_accepted) {
+      if (history.empty()) {
+        return false; /* 最急降下方向でも減少しない */
+      }
+      history.clear(); /* 近似を捨ててやり直す */
+      continue;
+    }
+
+    /* 更新の記録. 曲率条件 y・s > 0 を満たさない更新は近似を壊すので捨てる */
+    Correction correction;
+    correction.s.resize(n); correction.y.resize(n);
+    for (int i = 0; i < n; i++) {
+      correction.s[i] = next_x[i] - x[i];
+      correction.y[i] = next_gradient[i] - gradient[i];
+    }
+    double ys = dot(correction.y, correction.s);
+    if (ys > 1e-10) {
+      correction.rho = 1.0 / ys;
+      history.push_back(correction);
+      if ((int)history.size() > history_size) {
+        history.pop_front();
+      }
+    }
+
+    /* 受理 */
+    double decrease = value - next_value;
+    x.swap(next_x);
+    gradient.swap(next_gradient);
+    value = next_value;
+    if (!objective.progress(iteration, x, value, sqrt(dot(gradient, gradient)))) {
+      return false;
+    }
+    if (decrease / std::max(1.0, fabs(value)) < epsilon) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* 2ループ再帰. direction = H*gradient (Hは近似逆ヘッセ行列). 最新の更新で初期行列の尺度を決める */
+void MELBFGS::calc_direction(const std::vector<double> &gradient, std::vector<double> &direction)
+{
+  int n = gradient.size();
+  int m = history.size();
+  std::vector<double> alpha(m);
+
+  direction = gradient;
+  for (int h_i = m-1; h_i >= 0; h_i--) {
+    alpha[h_i] = history[h_i].rho * dot(history[h_i].s, direction);
+    for (int i = 0; i < n; i++) {
+      direction[i] -= alpha[h_i] * history[h_i].y[i];
+    }
+  }
+
+  if (m > 0) {
+    double gamma = 1.0 / (history[m-1].rho * dot(history[m-1].y, history[m-1].y));
+    for (int i = 0; i < n; i++) {
+      direction[i] *= gamma;
+    }
+  }
+
+  for (int h_i = 0; h_i < m; h_i++) {
+    double beta = history[h_i].rho * dot(history[h_i].y, direction);
+    for (int i = 0; i < n; i++) {
+      direction[i] += (alpha[h_i] - beta) * history[h_i].s[i];
+    }
+  }
+}
+
+/* 内積 */
+double MELBFGS::dot(const std::vector<double> &a, const std::vector<double> &b)
+{
+  double sum = 0.0f;
+  for (int i = 0; i < (int)a.size(); i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
@@ -0,0 +1,49 @@
+#ifndef MELBFGS_H_INCLUDED
+#define MELBFGS_H_INCLUDED
+
+#include <vector>
+#include <deque>
+
+#include "MEOptimizer.hpp"
+
+/* L-BFGS法のデフォルト値 */
+const int    LBFGS_HISTORY_SIZE       = 10;    /* 近似ヘッセ行列に使う直近の更新の数 */
+const int    LBFGS_MAX_ITERATION      = 200;   /* 最大反復回数 */
+const double LBFGS_EPSILON            = 10e-5; /* 収束判定値: 目的関数の相対減少量, 勾配ノルムの相対値 */
+const int    LBFGS_MAX_LINE_SEARCH    = 40;    /* 1反復での直線探索の最大試行回数 */
+const double LBFGS_ARMIJO_COEFFICIENT = 10e-5; /* 直線探索の十分減少条件(Armijo条件)の係数 */
+
+/* 記憶制限付きBFGS法(L-BFGS). 直近history_size回の(パラメタ差, 勾配差)から
+   ヘッセ行列の逆行列を近似し(2ループ再帰), 探索方向をバックトラッキング直線探索で進める */
+class MELBFGS : public MEOptimizer {
+private:
+  int    history_size;  /* 保持する更新の数 */
+  int    max_iteration; /* 最大反復回数 */
+  double epsilon;       /* 収束判定値 */
+
+  /* 1回分の更新. s = x_{k+1}-x_k, y = g_{k+1}-g_k, rho = 1/(y・s) */
+  struct Correction {
+    std::vector<double> s, y;
+    double              rho;
+  };
+  std::deque<Correction> history; /* 直近の更新. 古い順 */
+
+public:
+  /* コンストラクタ */
+  MELBFGS(int history_size=LBFGS_HISTORY_SIZE, int max_iteration=LBFGS_MAX_ITERATION,
+          double epsilon=LBFGS_EPSILON);
+  /* デストラクタ */
+  ~MELBFGS(void);
+
+  /* xを初期値としてobjectiveを最小化する */
+  bool minimize(MEObjective &objective, std::vector<double> &x);
+
+private:
+  /* 2ループ再帰で, 勾配gradientに近似逆ヘッセ行列を掛けた探索方向(の符号反転)をdirectionにセットする */
+  void calc_direction(const std::vector<double> &gradient, std::vector<double> &direction);
+  /* 内積 */
+  static double dot(const std::vector<double> &a, const std::vector<double> &b);
+
+};
+
+#endif /* MELBFGS_H_INCLUDED */
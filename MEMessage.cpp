@@ -0,0 +1,170 @@
+#include "MEMessage.hpp"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* コンストラクタ */
+MEMessage::MEMessage(void)
+{
+  cursor   = 0;
+  is_valid = true;
+}
+
+/* デストラクタ */
+MEMessage::~MEMessage(void) { ; }
+
+/* 4byteの整数をビッグエンディアンで足す */
+void MEMessage::put_int(unsigned int value)
+{
+  char bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (char)((value >> (8 * (3 - i))) & 0xff);
+  }
+  buffer.append(bytes, 4);
+}
+
+/* 実数はIEEE754のビット列を8byteのビッグエンディアンで足す */
+void MEMessage::put_double(double value)
+{
+  unsigned long long bits;
+  char bytes[8];
+
+  memcpy(&bits, &value, sizeof(bits));
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (char)((bits >> (8 * (7 - i))) & 0xff);
+  }
+  buffer.append(bytes, 8);
+}
+
+/* 文字列は長さ + バイト列 */
+void MEMessage::put_string(const std::string &value)
+{
+  put_int(value.size());
+  buffer.append(value);
+}
+
+/* 4byteの整数を読む */
+unsigned int MEMessage::get_int(void)
+{
+  unsigned int value = 0;
+
+  if (!is_valid || buffer.size() - cursor < 4) {
+    is_valid = false;
+    return 0;
+  }
+  for (int i = 0; i < 4; i++) {
+    value = (value << 8) | (unsigned char)buffer[cursor++];
+  }
+  return value;
+}
+
+/* 実数を読む */
+double MEMessage::get_double(void)
+{
+  unsigned long long bits = 0;
+  double value;
+
+  if (!is_valid || buffer.size() - cursor < 8) {
+    is_valid = false;
+    return 0.0f;
+  }
+  for (int i = 0; i < 8; i++) {
+    bits = (bits << 8) | (unsigned char)buffer[cursor++];
+  }
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/* 文字列を読む */
+std::string MEMessage::get_string(void)
+{
+  size_t length = get_int();
+
+  if (!is_valid || buffer.size() - cursor < length) {
+    is_valid = false;
+    return std::string();
+  }
+  std::string value(buffer, cursor, length);
+  cursor += length;
+  return value;
+}
+
+/* ここまでの読み出しが本体に収まっているか */
+bool MEMessage::is_ok(void) const
+{
+  return is_valid;
+}
+
+/* 本体を空にする */
+void MEMessage::clear(void)
+{
+  buffer.clear();
+  cursor   = 0;
+  is_valid = true;
+}
+
+/* 長さと本体を書く */
+bool MEMessage::send(int fd) const
+{
+  char header[4];
+  for (int i = 0; i < 4; i++) {
+    header[i] = (char)((buffer.size() >> (8 * (3 - i))) & 0xff);
+  }
+  return write_all(fd, header, 4) && write_all(fd, buffer.data(), buffer.size());
+}
+
+/* 長さを読み, その分の本体を読む */
+bool MEMessage::receive(int fd)
+{
+  unsigned char header[4];
+  size_t length = 0;
+
+  clear();
+  if (!read_all(fd, (char *)header, 4)) {
+    return false;
+  }
+  for (int i = 0; i < 4; i++) {
+    length = (length << 8) | header[i];
+  }
+  if (length > MESSAGE_MAX_SIZE) {
+    return false;
+  }
+  buffer.resize(length);
+  return length == 0 || read_all(fd, &buffer[0], length);
+}
+
+/* sizeバイトすべて書く. 相手が閉じていてもSIGPIPEで落ちないようにsendを使う */
+bool MEMessage::write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0) {
+    ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+/* sizeバイトすべて読む. 途中で閉じられたらfalse */
+bool MEMessage::read_all(int fd, char *data, size_t size)
+{
+  while (size > 0) {
+    ssize_t num_read = ::read(fd, data, size);
+    if (num_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (num_read <= 0) {
+      return false;
+    }
+    data += num_read;
+    size -= num_read;
+  }
+  return true;
+}
@@ -0,0 +1,64 @@
+#ifndef MEMESSAGE_H_INCLUDED
+#define MEMESSAGE_H_INCLUDED
+
+#include <string>
+#include <cstddef>
+
+/* 予測サーバの要求の種類 */
+enum MERequestType {
+  REQUEST_RANKING    = 1, /* 次の単語のランキング */
+  REQUEST_COMPLETION = 2, /* ビーム探索による複数単語の補完 */
+  REQUEST_SHUTDOWN   = 3  /* サーバの停止 */
+};
+
+/* 予測サーバの応答の状態 */
+enum MEResponseStatus {
+  RESPONSE_OK    = 0, /* 成功 */
+  RESPONSE_ERROR = 1  /* 要求が壊れている/処理できない */
+};
+
+const size_t MESSAGE_MAX_SIZE = 1 << 20; /* 1メッセージの最大サイズ[byte]. これを超える長さのフレームは壊れているとみなす */
+
+/* 予測サーバとクライアントの間でやりとりするメッセージ.
+   ソケット上では 4byteの長さ(ビッグエンディアン) + 本体 のフレームで送る.
+   本体は次の値を順に並べたもの. 整数はすべて4byte, 実数は8byte(IEEE754のビット列)のビッグエンディアン,
+   文字列は4byteの長さ + バイト列.
+     要求: 種類, ランキングサイズ(または返す単語列の数), 補完の最大単語数, ビーム幅, 文脈(単語を空白で区切った文字列)
+     応答: 状態, 結果の数, 結果毎に(単語列(空白区切り), 確率) */
+class MEMessage {
+private:
+  std::string buffer;   /* 本体 */
+  size_t      cursor;   /* 次に読む位置 */
+  bool        is_valid; /* 読み出しが本体の終わりを超えていないか */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  MEMessage(void);
+  ~MEMessage(void);
+
+  /* 本体に値を足す */
+  void put_int(unsigned int value);
+  void put_double(double value);
+  void put_string(const std::string &value);
+  /* 本体から次の値を読む. 本体が足りなければ0(空文字列)を返し, 以降is_ok()はfalse */
+  unsigned int get_int(void);
+  double get_double(void);
+  std::string get_string(void);
+  /* ここまでの読み出しがすべて本体の中に収まっていればtrue */
+  bool is_ok(void) const;
+  /* 本体を空にする */
+  void clear(void);
+
+  /* フレームを1つ書く. 書けなければfalse */
+  bool send(int fd) const;
+  /* フレームを1つ読んで本体にする. 相手が閉じた/壊れたフレームならfalse */
+  bool receive(int fd);
+
+private:
+  /* fdにsizeバイトすべて書く/読む */
+  static bool write_all(int fd, const char *data, size_t size);
+  static bool read_all(int fd, char *data, size_t size);
+
+};
+
+#endif /* MEMESSAGE_H_INCLUDED */
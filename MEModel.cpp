@@ -1,4 +1,34 @@
 #include "MEModel.hpp"
+#include "METokenizer.hpp"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* モデルファイルの読み込み位置. mmapした領域を先頭から順に読む */
+struct ModelFileReader {
+  const char *cursor;   /* 次に読む位置 */
+  const char *end;      /* 領域の終端 */
+  bool        is_valid; /* 途中で終端を越えていなければtrue */
+};
+
+/* モデルファイルへの書き込み/読み込みのサブルーチン */
+static void write_int(std::ofstream &out, int value);
+static void write_long(std::ofstream &out, long long value);
+static void write_double(std::ofstream &out, double value);
+static void write_int_array(std::ofstream &out, const std::vector<int> &array);
+static void write_double_array(std::ofstream &out, const std::vector<double> &array);
+static bool read_bytes(ModelFileReader *reader, void *dst, size_t size);
+static int  read_int(ModelFileReader *reader);
+static long long read_long(ModelFileReader *reader);
+static double read_double(ModelFileReader *reader);
+static void read_int_array(ModelFileReader *reader, std::vector<int> &array);
+static void read_double_array(ModelFileReader *reader, std::vector<double> &array);
+static bool get_file_stamp(const std::string &filename, long long *mtime, long long *size); /* ファイルの更新時刻[ns]とサイズ */
+static bool is_in_range(const int *ids, int size, int limit); /* IDが全て[0, limit)に入っているか */
 
 /* コンストラクタ */
 MEModel::MEModel(int maxN_gram, int pattern_count_bias,
@@ -17,129 +47,109 @@ MEModel::MEModel(int maxN_gram, int pattern_count_bias,
   unique_word_no               = 0;
   pattern_count                = 0;
   add_feature_parameter        = 0.0f;
+  candidate_memory_size        = 0;
+  max_candidate_memory         = MAX_CANDIDATE_MEMORY;
+  corpus_counts.memory_size    = 0;
+  corpus_counts.max_memory     = MAX_CANDIDATE_MEMORY;
+  optimizer_type               = OPTIMIZER_GIS;
+  prior_variance               = PRIOR_VARIANCE;
+  l1_coefficient               = SGD_L1_COEFFICIENT;
+  sgd_trainer                  = NULL;
+  log_marginal_factor          = 0.0f;
+  thread_pool                  = new METhreadPool(1);
 }
 
-/* デストラクタ. */
-MEModel::~MEModel(void)
+/* 学習に使うスレッド数をセットする */
+void MEModel::set_num_threads(int num_threads)
 {
+  delete thread_pool;
+  thread_pool = new METhreadPool(num_threads);
 }
 
-/* 現在読み込み中のファイルから次の単語を返すサブルーチン */
-std::string MEModel::next_word(void)
+/* 学習に使う最適化手法をセットする */
+void MEModel::set_optimizer(MEOptimizerType optimizer_type)
 {
-  char ch;          /* 現在読んでいる文字 */
-  std::string ret;  /* 返り値の文字列 */
-
-  /* 改行している場合は一行読む */
-  if (line_index == -1) {
-    if (input_file && std::getline(input_file, line_buffer)) {
-      /* 注：std::getlineは改行文字をバッファに格納しない */
-      line_index = 0; /* インデックスは0にリセット */
-    } else {
-      ret += "\EOF";
-      return ret;     /* ファイルの終端に達している時はEOFだけからなる文字列を返す */
-    }
-  }
-  
-  /* とりあえず1文字目を読む */
-  ch = line_buffer[line_index];
+  this->optimizer_type = optimizer_type;
+}
 
-  /* 空白, タブ文字, その他区切り文字の読み飛ばし */
-  while (ch == ' ' || ch == '\t')
-    ch = line_buffer[++line_index];
+/* L-BFGS法で使うガウス事前分布の分散をセットする */
+void MEModel::set_prior_variance(double prior_variance)
+{
+  this->prior_variance = prior_variance;
+}
 
-  /* 行バッファの末尾（改行）に到達しているかチェック. */
-  if (ch == '\0') {
-    /* 到達していたらインデックスをリセットして, 再び呼び出す */
-    line_index = -1;
-    return next_word();
-  }
+/* ストリーミング学習のL1正則化の係数をセットする */
+void MEModel::set_l1_coefficient(double l1_coefficient)
+{
+  this->l1_coefficient = l1_coefficient;
+}
 
-  /* 次の空白/終端文字が現れるまでバッファに文字を読む */
-  while (ch != ' ' && ch != '\t' && ch != '\0') {
-    ret += ch;
-    ch = line_buffer[++line_index];
-  }
+/* 素性候補が使ってよいメモリ量をセットする */
+void MEModel::set_candidate_memory_budget(size_t budget)
+{
+  max_candidate_memory     = budget;
+  corpus_counts.max_memory = budget;
+}
 
-  return ret;
+/* デストラクタ. */
+MEModel::~MEModel(void)
+{
+  delete thread_pool;
+  delete sgd_trainer;
 }
 
-/* 引数文字列のテキストファイルをオープンし, 次を行う
-   ・単語マップ（ハッシュ）の作成/更新
-   ・素性候補の作成
-   ・素性の頻度カウント
+/* 引数文字列のテキストファイルをオープンし, シャードの局所表について次を行う
+   ・局所語彙表の作成/更新
+   ・パターン（素性候補）の作成
+   ・パターンの頻度カウント
 */
-void MEModel::read_file(std::string file_name)
+void MEModel::read_file(std::string file_name, CorpusShard &shard)
 {
-  std::string str_buf;   /* 単語バッファ */
+  METokenizer tokenizer;  /* ファイルをマップして単語に区切るトークナイザ */
+  const char *word;       /* 単語の先頭（マップした領域を指す） */
+  int word_length;        /* 単語の長さ */
   std::vector<int> Ngram_buf(maxN_gram); /* 今と直前(maxN_gram-1)個の単語列. Ngram_buf[maxN_gram-1]が今の単語, Ngram_buf[0]が(maxN_gram-1)個前の単語 */
-  std::vector<MEFeature>::iterator f_it; /* 素性のイテレータ */
   int file_top_count;                    /* ファイル先頭分の読み飛ばし. */
 
   /* ファイルのオープン */
-  input_file.open(file_name.c_str(), std::ios::in);
-  if ( !input_file ) {
+  if ( !tokenizer.open(file_name) ) {
     std::cerr << "Error : cannot open file \"" << file_name << "\"." << std::endl;
     return;
   }
   
   /* ファイルの終端まで単語を集める */
-  file_top_count = 0; line_index = -1;
-  while ( (str_buf=next_word()) != "\EOF" ) {
-    /* 今まで見たことがない（新しい）単語か判定 */
-    if (word_map.count(str_buf) == 0) {
-      /* 新しい単語ならば, マップに登録 */
-      word_map[str_buf] = unique_word_no++;
-      /* std::cout << "word \"" << str_buf << "\" assined to " << word_map[str_buf] << std::endl; */
-    } 
+  file_top_count = 0;
+  while ( tokenizer.next_word(&word, &word_length) ) {
 
     /* Ngram_bufの更新 */
     for (int n_gram=0; n_gram < (maxN_gram-1); n_gram++) {
       Ngram_buf[n_gram] = Ngram_buf[n_gram+1];
     }
-    Ngram_buf[maxN_gram-1] = word_map[str_buf];
+    /* 局所語彙表に登録して局所IDを得る. 新しい単語には次のIDが振られる */
+    Ngram_buf[maxN_gram-1] = shard.local_vocabulary.insert(word, word_length);
 
     /* 新しいパターンか判定.
        Ngram_bufの長さを変えながら見ていく. */
     for (int gram_len=0; gram_len < maxN_gram; gram_len++) {
 
-      /* x, y のパターンをベクトルで取得 */
-      int buf_y_pattern = Ngram_buf[maxN_gram-1];
-      std::vector<int> buf_x_pattern(gram_len);
-      for (int ii=0; ii < gram_len; ii++) {
-        buf_x_pattern[ii] = Ngram_buf[(maxN_gram-1)-gram_len+ii];
-      }
-
       /* ファイル先頭分の読み飛ばし. */
       if (file_top_count < gram_len) {
         file_top_count++;
         break;
       }
 
-      /* 現在の素性集合を走査し,
-         既に同じパターンの素性があるかチェック */
-      for (f_it = candidate_features.begin();
-          f_it != candidate_features.end();
-          f_it++) {
-        /* 完全一致で確かめる. 完全一致でないと短いグラムモデルにヒットしやすくなってしまう */
-        if (f_it->strict_check_pattern(buf_x_pattern,
-                                       buf_y_pattern) == true) {
-          /* 同じパターンがあったならば, 頻度カウントを更新 */
-          f_it->count++;
-          break;
-        }
-
-      }
-
-      /* 既出のパターンではなかった -> 新しく素性集合に追加 */
-      if (f_it == candidate_features.end()
-          && pattern_count < MAX_CANDIDATE_F_SIZE) {
-        /* 新しい素性を追加 */
-        candidate_features.push_back(MEFeature(gram_len+1,
-                                               buf_x_pattern,
-                                               buf_y_pattern));
-        /* パターン数の増加 */
-        pattern_count++;
+      /* 索引のキー: Ngram_bufの末尾(gram_len+1)語がそのまま(pattern_x, pattern_y)の連結になる */
+      const int *key = &Ngram_buf[(maxN_gram-1)-gram_len];
+      int p_index = shard.local_pattern_index.find(key, gram_len+1);
+
+      if (p_index != -1) {
+        /* 同じパターンがあったならば, 頻度カウントを更新 */
+        shard.local_pattern_count[p_index]++;
+      } else if (shard.memory_size < shard.max_memory) {
+        /* 既出のパターンではなかった -> 新しく局所パターンに追加 */
+        shard.local_pattern_index.insert(key, gram_len+1);
+        shard.local_pattern_count.push_back(1);
+        shard.memory_size += sizeof(int) + MEPatternIndex::memory_per_key(gram_len+1);
       }
 
     }
@@ -147,148 +157,351 @@ void MEModel::read_file(std::string file_name)
   }
 
   /* ファイルのクローズ */
-  input_file.close();
+  tokenizer.close();
+
+}
+
+/* パターン頻度countsを全体の頻度corpus_countsに足す(sign=1)/差し引く(sign=-1).
+   局所IDは出現順なので, 局所IDの昇順に全体の表へ登録すれば, 全ファイルを逐次に読んだ時と同じIDが振られる.
+   新しいパターンは足す時に, 全体の表がメモリ量の予算内の間だけ加える. 一度予算を使い切ると作り直すまで加えないので,
+   全体の表にあるパターンの頻度は, 常にそれを持つ全ファイルの頻度の和になる */
+void MEModel::add_pattern_counts(const CorpusShard &counts, int sign)
+{
+  std::vector<int> word_id_map(counts.local_vocabulary.size()); /* 局所単語ID -> 全体の表の単語ID. 無ければ-1 */
+  std::vector<int> key;                                          /* 全体の表の単語IDに付け替えたパターン */
+
+  /* 単語の付け替え. 差し引く時は全体の表に無い単語を含むパターンも無い */
+  for (int w_i = 0; w_i < counts.local_vocabulary.size(); w_i++) {
+    const char *word = counts.local_vocabulary.get_word(w_i);
+    int length       = counts.local_vocabulary.get_length(w_i);
+    word_id_map[w_i] = (sign > 0 ? corpus_counts.local_vocabulary.insert(word, length)
+                                 : corpus_counts.local_vocabulary.find(word, length));
+  }
+
+  /* パターンの付け替えと頻度の加減 */
+  for (int p_i = 0; p_i < counts.local_pattern_index.size(); p_i++) {
+    const int *local_key = counts.local_pattern_index.get_key(p_i);
+    int length           = counts.local_pattern_index.get_length(p_i);
+
+    key.resize(length);
+    for (int k_i = 0; k_i < length; k_i++) {
+      key[k_i] = word_id_map[local_key[k_i]];
+    }
+    if (std::find(key.begin(), key.end(), -1) != key.end()) {
+      continue;
+    }
+
+    int p_index = corpus_counts.local_pattern_index.find(key);
+    if (p_index != -1) {
+      corpus_counts.local_pattern_count[p_index] += sign * counts.local_pattern_count[p_i];
+    } else if (sign > 0 && corpus_counts.memory_size < corpus_counts.max_memory) {
+      corpus_counts.local_pattern_index.insert(key);
+      corpus_counts.local_pattern_count.push_back(counts.local_pattern_count[p_i]);
+      corpus_counts.memory_size += sizeof(int) + MEPatternIndex::memory_per_key(length);
+    }
+  }
+}
+
+/* ファイル毎の頻度から全体の頻度を作り直す. 頻度0になったパターンはここで消える */
+void MEModel::rebuild_corpus_counts(void)
+{
+  corpus_counts.local_vocabulary.clear();
+  corpus_counts.local_pattern_index.clear();
+  std::vector<int>().swap(corpus_counts.local_pattern_count);
+  corpus_counts.memory_size = 0;
+
+  for (std::map<std::string, CorpusShard>::iterator c_it = file_counts.begin(); c_it != file_counts.end(); c_it++) {
+    add_pattern_counts(c_it->second, 1);
+  }
+}
+
+/* 素性候補の索引を作り直す. 素性候補の削除後に呼ぶ */
+void MEModel::rebuild_candidate_index(void)
+{
+  std::vector<int> key;
+
+  candidate_index.clear();
+  candidate_index.reserve(candidate_features.size());
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    candidate_features.get_pattern_key(f_i, key);
+    candidate_index.insert(key);
+  }
+}
+
+/* 素性候補に現れる単語だけを残して単語IDを詰め直す. 元のIDの大小関係は保つ.
+   素性カウントバイアスの適用後に呼ぶ */
+void MEModel::compact_vocabulary(void)
+{
+  std::vector<int> new_word_id(vocabulary.size(), -1); /* 元の単語ID -> 新しい単語ID. 消える単語は-1 */
+  MEVocabulary     compacted;
+
+  /* 素性候補に現れる単語に印を付ける */
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    const int *pattern_x = candidate_features.get_pattern_x(f_i);
+    for (int i = 0; i < candidate_features.get_x_size(f_i); i++) {
+      new_word_id[pattern_x[i]] = 0;
+    }
+    new_word_id[candidate_features.get_pattern_y(f_i)] = 0;
+  }
+
+  /* 元のIDの昇順に詰めて登録し直す */
+  for (int w_i = 0; w_i < vocabulary.size(); w_i++) {
+    if (new_word_id[w_i] != -1) {
+      new_word_id[w_i] = compacted.insert(vocabulary.get_word(w_i), vocabulary.get_length(w_i));
+    }
+  }
+  vocabulary = compacted;
 
+  /* 素性候補のパターンの付け替え */
+  candidate_features.remap_words(new_word_id);
+
+  /* 更新モードでは学習済みのモデル素性も付け替える(パラメタは保つ) */
+  features.remap_words(new_word_id);
 }
 
 /* ファイル名の配列から学習データをセット.
-   得られた素性リストに経験確率と経験期待値をセットする */
-void MEModel::read_file_str_list(std::vector<std::string> filenames)
+   ファイル毎のパターン頻度を記録し, 得られた素性リストに経験確率と経験期待値をセットする.
+   カウントバイアスで素性候補が1つも残らなければfalseを返す */
+bool MEModel::read_file_str_list(std::vector<std::string> filenames)
+{
+  if (!update_pattern_counts(filenames, std::vector<std::string>())) {
+    return false;
+  }
+  return build_candidate_features();
+}
+
+/* read_filesを読んでファイル毎の頻度を入れ替え, removed_filesの頻度を捨てる.
+   全体の頻度には, 前の頻度を差し引いて新しい頻度を足した差分だけを反映するので, 読み直すのは変わったファイルだけで済む.
+   カウントバイアスを満たすパターンが残らなければ, 全体の頻度を元に戻してfalseを返す(ファイル毎の頻度は入れ替えない) */
+bool MEModel::update_pattern_counts(const std::vector<std::string> &read_files, const std::vector<std::string> &removed_files)
 {
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  std::vector<CorpusShard> new_counts(read_files.size()); /* 読んだファイルの頻度 */
+  std::vector<FileStamp>   new_stamps(read_files.size()); /* 読む前の更新時刻とサイズ. 得られなければ-1で, 次も読み直す */
+  size_t max_file_memory = max_candidate_memory / std::max<size_t>(1, file_counts.size() + read_files.size());
+
+  /* 読み込み中に書き換えられた変更を見落とさないよう, 時刻とサイズは読む前に得る */
+  for (int file_i = 0; file_i < (int)read_files.size(); file_i++) {
+    if (!get_file_stamp(read_files[file_i], &new_stamps[file_i].mtime, &new_stamps[file_i].size)) {
+      new_stamps[file_i].mtime = new_stamps[file_i].size = -1;
+    }
+    new_counts[file_i].memory_size = 0;
+    new_counts[file_i].max_memory  = max_file_memory;
+  }
 
-  std::vector<std::string>::iterator file_it;
-  std::vector<MEFeature>::iterator   f_it;
-  std::vector<int>::iterator x_it;
-  std::map<std::string, int>::iterator map_itr;
+  /* read_fileを全ファイルに適用. ファイル毎に別の表へ並列に読む */
+  thread_pool->parallel_for((int)read_files.size(), [&](int begin, int end, int thread_id) {
+      for (int file_i = begin; file_i < end; file_i++) {
+        read_file(read_files[file_i], new_counts[file_i]);
+      }
+    });
 
-  /* read_fileを全ファイルに適用 */
-  for (file_it = filenames.begin();
-       file_it != filenames.end();
-       file_it++) {
-    read_file(*file_it);
+  /* モデルを読んだ直後は全体の頻度を持たないので, ファイル毎の頻度から作る */
+  if (corpus_counts.local_pattern_index.size() == 0 && !file_counts.empty()) {
+    rebuild_corpus_counts();
   }
 
-  /* pattern_count_bias, カウントバイアスの適用 
-     規定の回数未満の頻度の素性は除外 */
-  f_it = candidate_features.begin();
-  while (f_it != candidate_features.end()) {
-    if (f_it->count < pattern_count_bias) {
-      /* バイアス以下の頻度の素性を削除 */
-      f_it = candidate_features.erase(f_it);
+  /* 差分の反映. 読み直したファイルと消えたファイルの前の頻度を差し引き, 読んだ頻度をファイル順に足す */
+  std::vector<const CorpusShard *> old_counts(read_files.size(), NULL);
+  std::vector<const CorpusShard *> removed_counts;
+  for (int file_i = 0; file_i < (int)removed_files.size(); file_i++) {
+    std::map<std::string, CorpusShard>::iterator c_it = file_counts.find(removed_files[file_i]);
+    if (c_it != file_counts.end()) {
+      removed_counts.push_back(&c_it->second);
+      add_pattern_counts(c_it->second, -1);
+    }
+  }
+  for (int file_i = 0; file_i < (int)read_files.size(); file_i++) {
+    std::map<std::string, CorpusShard>::iterator c_it = file_counts.find(read_files[file_i]);
+    if (c_it != file_counts.end()) {
+      old_counts[file_i] = &c_it->second;
+      add_pattern_counts(c_it->second, -1);
+    }
+    add_pattern_counts(new_counts[file_i], 1);
+  }
+
+  /* カウントバイアスを満たすパターンが残るか. 残らなければ逆の順に戻す(足したパターンは頻度0で残る) */
+  int num_kept = 0, num_zero = 0;
+  for (int p_i = 0; p_i < (int)corpus_counts.local_pattern_count.size(); p_i++) {
+    int count = corpus_counts.local_pattern_count[p_i];
+    if (count > 0 && count >= pattern_count_bias) {
+      num_kept++;
+    } else if (count == 0) {
+      num_zero++;
+    }
+  }
+  if (num_kept == 0) {
+    std::cerr << "Error : no pattern occurs at least " << pattern_count_bias << " times (count_bias) in the files." << std::endl;
+    for (int file_i = (int)read_files.size()-1; file_i >= 0; file_i--) {
+      add_pattern_counts(new_counts[file_i], -1);
+      if (old_counts[file_i] != NULL) {
+        add_pattern_counts(*old_counts[file_i], 1);
+      }
+    }
+    for (int r_i = 0; r_i < (int)removed_counts.size(); r_i++) {
+      add_pattern_counts(*removed_counts[r_i], 1);
+    }
+    return false;
+  }
+
+  /* ファイル毎の頻度と, 更新時刻/サイズの入れ替え */
+  for (int file_i = 0; file_i < (int)removed_files.size(); file_i++) {
+    file_counts.erase(removed_files[file_i]);
+    file_manifest.erase(removed_files[file_i]);
+  }
+  for (int file_i = 0; file_i < (int)read_files.size(); file_i++) {
+    file_counts[read_files[file_i]]   = new_counts[file_i];
+    file_manifest[read_files[file_i]] = new_stamps[file_i];
+  }
+
+  /* 変更が続いて頻度0のパターンが生きているパターンより多くなったら, 作り直して詰める */
+  if (num_zero > (int)corpus_counts.local_pattern_count.size() - num_zero) {
+    rebuild_corpus_counts();
+  }
+  record_phase_time("ingest", start_time);
+
+  return true;
+}
+
+/* 全体の頻度のうち, カウントバイアスを満たすパターンを素性候補にする.
+   語彙には全体の表の単語を出現順に足してから, 素性候補に現れる単語だけにIDを詰め直す.
+   語彙に元からある単語のIDの大小関係は保つので, 更新モードでもモデル素性を付け替えられる */
+bool MEModel::build_candidate_features(void)
+{
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  std::vector<int> word_id_map(corpus_counts.local_vocabulary.size()); /* 全体の表の単語ID -> 大域単語ID */
+  std::vector<int> key;
+
+  for (int w_i = 0; w_i < corpus_counts.local_vocabulary.size(); w_i++) {
+    word_id_map[w_i] = vocabulary.insert(corpus_counts.local_vocabulary.get_word(w_i),
+                                         corpus_counts.local_vocabulary.get_length(w_i));
+  }
+
+  /* pattern_count_bias, カウントバイアスの適用
+     規定の回数未満の頻度の素性は除外. 全体の表の順(出現順)に並べる */
+  candidate_features.clear();
+  candidate_memory_size = 0;
+  for (int p_i = 0; p_i < corpus_counts.local_pattern_index.size(); p_i++) {
+    int count = corpus_counts.local_pattern_count[p_i];
+    if (count <= 0 || count < pattern_count_bias) {
       continue;
-    } else {
-      f_it++;
     }
+    const int *corpus_key = corpus_counts.local_pattern_index.get_key(p_i);
+    int gram_len          = corpus_counts.local_pattern_index.get_length(p_i) - 1;
+    key.resize(gram_len+1);
+    for (int k_i = 0; k_i <= gram_len; k_i++) {
+      key[k_i] = word_id_map[corpus_key[k_i]];
+    }
+    candidate_features.push_back(key.data(), gram_len, key[gram_len], count);
+    candidate_memory_size
+      += MEFeatureStore::memory_per_feature(gram_len) + MEPatternIndex::memory_per_key(gram_len+1);
   }
 
+  /* 残った素性候補に現れる単語だけにIDを詰め直す */
+  compact_vocabulary();
+
+  /* 素性候補の索引を作る */
+  rebuild_candidate_index();
+
   /* パターン総数の確定 */
   pattern_count = candidate_features.size();
   std::cout << "There are " << pattern_count << " unique patterns." << std::endl;
 
-  /* 素性削除後のパターンX,Yの集合の作成 */
-  setX.clear(); setY.clear();
-  for (f_it = candidate_features.begin();
-       f_it != candidate_features.end();
-       f_it++) {
-         /* 新しいX,Yパターンの追加を試みる */
-        setX.insert(f_it->get_pattern_x());
-        setY.insert(f_it->get_pattern_y());
-  }
-
-  /* word_mapの縮小 : setYに含まれない単語は削除 */
-  map_itr = word_map.begin();
-  while (map_itr != word_map.end()) {
-    if(setY.count(map_itr->second) == 0) {
-      map_itr = word_map.erase(map_itr);
-      continue;
-    } else {
-      map_itr++;
-    }
+  /* 素性削除後のパターンX,Yの集合の作成. Xのパターンには密なIDを振る */
+  x_index.clear(); setY.clear();
+  candidate_x_id.resize(candidate_features.size());
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    /* 新しいX,Yパターンの追加を試みる */
+    candidate_x_id[f_i] = x_index.insert(candidate_features.get_pattern_x(f_i), candidate_features.get_x_size(f_i));
+    setY.insert(candidate_features.get_pattern_y(f_i));
   }
 
   /* 単語数の確定 */
   unique_word_no = setY.size();
   // std::cout << "There are " << unique_word_no << " unique words" << std::endl;
+  record_phase_time("prune", start_time);
 
   /* 経験確率と経験期待値をセット */
-  set_empirical_prob_E();
+  start_time = std::chrono::steady_clock::now();
+  if (!set_empirical_prob_E()) {
+    return false;
+  }
+  record_phase_time("set_empirical_prob_E", start_time);
 
+  return true;
 }
 
-/* 経験確率/経験期待値を素性にセットする */
-void MEModel::set_empirical_prob_E(void)
+/* 経験確率/経験期待値を素性にセットする. 頻度総数が0ならfalse */
+bool MEModel::set_empirical_prob_E(void)
 {
-  std::vector<MEFeature>::iterator f_it, exf_it;   /* 素性のイテレータ */
-  std::set<std::vector<int> >      find_x_pattern; /* 計算済みのXのパターン */
   int sum_count;                                   /* 出現した素性頻度総数 */
 
   /* 頻度総数のカウント. */
   sum_count = 0;
-  for (f_it = candidate_features.begin();
-       f_it != candidate_features.end();
-       f_it++) {
-    sum_count += f_it->count;
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    sum_count += candidate_features.count[f_i];
   }
 
   if (sum_count == 0) {
     std::cerr << "Error : total number of features frequency equal to 0. Maybe all of candidate feature's frequency smaller than bias(count_bias)" << std::endl;
-    exit(1);
+    return false;
   }
 
-  /* 経験確率のセット. 頻度を総数で割るだけ. */
-  for (f_it = candidate_features.begin();
-       f_it != candidate_features.end();
-       f_it++) {
-    f_it->empirical_prob
-      = (double)(f_it->count) / sum_count;
-    empirical_x_prob[f_it->get_pattern_x()] = 0.0f; /* xの周辺経験分布P~(x)の初期化 */
+  /* 経験確率のセット. 頻度を総数で割るだけ.
+     xの周辺経験分布P~(x)は, 同じパターンxを持つ素性の経験確率の和 */
+  empirical_x_prob.assign(x_index.size(), 0.0f);
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    candidate_features.empirical_prob[f_i]
+      = (double)(candidate_features.count[f_i]) / sum_count;
+    empirical_x_prob[candidate_x_id[f_i]] += candidate_features.empirical_prob[f_i];
   }
 
-  /* 経験期待値/xの周辺経験分布のセット.
+  /* 経験期待値のセット.
      注) 経験確率分布は候補素性のパターンのみで総和をとる（それで全確率） 
-         真にXとYの組み合わせを試すと異なる結果になる事に注意 */
-  for (f_it = candidate_features.begin();
-      f_it != candidate_features.end();
-      f_it++) {
-
-    f_it->empirical_E = 0.0f; /* 期待値のリセット */
-    for (exf_it = candidate_features.begin();
-        exf_it != candidate_features.end();
-        exf_it++) {
-      /* 経験期待値の計算 */
-      f_it->empirical_E 
-        += f_it->checkget_weight_emprob(exf_it->get_pattern_x(), exf_it->get_pattern_y());
-      /* 周辺経験分布P~(x)の計算:同じパターンxの経験確率を一度のみ足す. */
-      if (exf_it->get_pattern_x() == f_it->get_pattern_x()) {
-        /* Xのパターンでまだ発見されてなければ, 和を取る */
-        if (find_x_pattern.count(exf_it->get_pattern_x()) == 0) {
-          empirical_x_prob[exf_it->get_pattern_x()] 
-            += exf_it->empirical_prob;
-        }
+         真にXとYの組み合わせを試すと異なる結果になる事に注意
+     素性(N_gram, pattern_x, pattern_y)はxの末尾(N_gram-1)語がpattern_xに一致する時に限り活性化するので,
+     各候補パターン(x, y)で活性化する素性は, xの各長さの接尾辞と yを連結したキーで候補索引を引けば全て得られる.
+     候補パターン毎に高々maxN_gram回の索引引きで, 各素性を活性化する候補パターンの数を数える */
+  std::vector<int> activated_count(candidate_features.size(), 0); /* 素性 -> 活性化する候補パターンの数 */
+  std::vector<int> key;                                           /* (xの接尾辞, y)を連結した検索キー */
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    const int *pattern_x = candidate_features.get_pattern_x(f_i);
+    int x_size = candidate_features.get_x_size(f_i);
+    for (int suffix_len = 0; suffix_len <= x_size; suffix_len++) {
+      key.assign(pattern_x + (x_size - suffix_len), pattern_x + x_size);
+      key.push_back(candidate_features.get_pattern_y(f_i));
+      int f_index = candidate_index.find(key);
+      if (f_index != -1) {
+        activated_count[f_index]++;
       }
     }
-    /* 発見したXのパターンの集合に追加 */
-    find_x_pattern.insert(f_it->get_pattern_x());
   }
 
+  /* 従来の総当たりと同じ丸めになるよう, 掛け算ではなく活性化の回数だけ足し込む(総回数は候補数*maxN_gram以下) */
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    double weight_emprob = candidate_features.weight[f_i] * candidate_features.empirical_prob[f_i];
+    candidate_features.empirical_E[f_i] = 0.0f;
+    for (int a_i = 0; a_i < activated_count[f_i]; a_i++) {
+      candidate_features.empirical_E[f_i] += weight_emprob;
+    }
+  }
+
+  return true;
 }
 
 /* 周辺素性フラグのセット/更新 : ボトルネック... 
  * ヒューリスティクス:N-gramモデルを使う限り, 周辺素性はユニグラム素性に限る */
 void MEModel::set_marginal_flag(void)
 {
-  std::vector<MEFeature>::iterator f_it;            /* 素性のイテレータ */
   std::set<std::vector<int> >::iterator x_it, w_it; /* Xのパターンのイテレータ */
   std::set<int>::iterator y_it; /* Yのパターンのイテレータ */
 
   /* 計算法 : 一つのパターンx_it, y_itに対して, 他のw_itを持ってきたときに, 素性が異なる値をとった時, 素性は条件付き素性 */
-  for (f_it = features.begin();
-       f_it != features.end();
-       f_it++) {
+  for (int f_i = 0; f_i < features.size(); f_i++) {
 
     /* ヒューリスティクスを使用 */
-    if (f_it->get_N_gram() == 1) {
-      f_it->is_marginal = true;
+    if (features.get_N_gram(f_i) == 1) {
+      features.is_marginal[f_i] = true;
     }
 
     // ナイーブな計算
@@ -318,14 +531,70 @@ void MEModel::set_marginal_flag(void)
     
 }
 
-/* 引数のパターンでの, 全てのモデル素性の(パラメタ*重み)和(=エネルギー関数値)を計算して返す */
-double MEModel::get_sum_param_weight(std::vector<int> test_x, int test_y)
+/* モデル素性から活性化索引を作る.
+   素性(N_gram, pattern_x, pattern_y)はxの末尾(N_gram-1)語がpattern_xに一致した時に限り活性化するので,
+   pattern_xを接尾辞として引けば, xで活性化しうる素性はxの各長さの接尾辞の素性リストの和になる */
+void MEModel::build_activation_index(void)
+{
+  std::vector<std::pair<std::pair<int,int>, int> > entry; /* ((接尾辞ID, y), 素性インデックス) */
+
+  activation_index.clear();
+  entry.reserve(features.size());
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    int suffix_id = activation_index.insert(features.get_pattern_x(f_i), features.get_x_size(f_i));
+    entry.push_back(std::make_pair(std::make_pair(suffix_id, features.get_pattern_y(f_i)), f_i));
+  }
+
+  /* 接尾辞, yの順に並べてCSR形式に詰める */
+  std::sort(entry.begin(), entry.end());
+  activation_offset.assign(activation_index.size()+1, 0);
+  activation_y.resize(entry.size());
+  activation_feature.resize(entry.size());
+  for (int e_i = 0; e_i < (int)entry.size(); e_i++) {
+    activation_offset[entry[e_i].first.first+1]++;
+    activation_y[e_i]       = entry[e_i].first.second;
+    activation_feature[e_i] = entry[e_i].second;
+  }
+  for (int s_i = 0; s_i < activation_index.size(); s_i++) {
+    activation_offset[s_i+1] += activation_offset[s_i];
+  }
+}
+
+/* x(長さx_size)の長さmin_suffix以上の接尾辞で活性化しうる素性のインデックスをactiveに追加する */
+void MEModel::get_active_features(const int *test_x, int x_size, int min_suffix, std::vector<int> &active)
+{
+  for (int len = min_suffix; len <= x_size && len < maxN_gram; len++) {
+    int suffix_id = activation_index.find((len > 0 ? &test_x[x_size-len] : NULL), len);
+    if (suffix_id == -1) {
+      continue;
+    }
+    active.insert(active.end(),
+                  activation_feature.begin() + activation_offset[suffix_id],
+                  activation_feature.begin() + activation_offset[suffix_id+1]);
+  }
+}
+
+/* 引数のパターンでの, 全てのモデル素性の(パラメタ*重み)和(=エネルギー関数値)を計算して返す.
+   活性化索引で接尾辞毎にyの一致する素性だけを見る */
+double MEModel::get_sum_param_weight(const std::vector<int> &test_x, int test_y)
 {
-  std::vector<MEFeature>::iterator f_it;
+  int x_size = test_x.size();
   double sum = 0.0f;
 
-  for (f_it = features.begin(); f_it != features.end(); f_it++) {
-    sum += f_it->checkget_param_weight(test_x, test_y);
+  for (int len = 0; len <= x_size && len < maxN_gram; len++) {
+    int suffix_id = activation_index.find((len > 0 ? &test_x[x_size-len] : NULL), len);
+    if (suffix_id == -1) {
+      continue;
+    }
+    /* 接尾辞の素性リストはyの昇順なので, 二分探索でyの範囲を得る */
+    std::vector<int>::iterator y_begin = activation_y.begin() + activation_offset[suffix_id];
+    std::vector<int>::iterator y_end   = activation_y.begin() + activation_offset[suffix_id+1];
+    std::pair<std::vector<int>::iterator, std::vector<int>::iterator> range
+      = std::equal_range(y_begin, y_end, test_y);
+    for (std::vector<int>::iterator a_it = range.first; a_it != range.second; a_it++) {
+      int f_i = activation_feature[a_it - activation_y.begin()];
+      sum += features.parameter[f_i] * features.weight[f_i];
+    }
   }
 
   /* 追加素性のエネルギーも加算 */
@@ -334,126 +603,191 @@ double MEModel::get_sum_param_weight(std::vector<int> test_x, int test_y)
   return sum;
 }
 
-/* 正規化項の計算 */
+/* 正規化項の計算.
+   Z(x)はexpの和がオーバーフロー/アンダーフローしないよう, 最大の項で割ってから足すlog-sum-expで対数のまま求める.
+     log Z(x) = a + log( Zm/e^a + Σ_{y∈Y(x)} (e^{u(y)+e(y|x)-a} - e^{u(y)-a}) ),  a = max(log Zm, max_{y∈Y(x)} u(y)+e(y|x))
+   u(y)は周辺素性のエネルギー. 周辺素性のみの正規化項log Zmはxによらないので1度だけ求めて持っておく */
 void MEModel::calc_normalized_factor(void)
 {
-  double marginal_factor;                     /* 周辺素性の性質から計算できる項の値 */
-  std::vector<MEFeature>::iterator f_it;      /* 素性のイテレータ */
-  std::set<int>::iterator y_m, y_x;           /* 周辺素性を活性化させる要素の集合Ym, 条件付き素性を活性化させる要素の集合Y(x)のイテレータ */
-  std::set<std::vector<int> >::iterator x_it; /* Xのパターンのイテレータ */
-
-  /* 周辺素性の情報から計算できる分marginal_factorを計算 */
-  marginal_factor = setY.size() - setY_marginal.size(); /* |Y-Ym| */
-  /* Ymについての和 */
-  for (y_m = setY_marginal.begin();
-      y_m != setY_marginal.end();
-      y_m++) {
-    double energy_z_y = 0.0f; /* z(y)のexp内部の値 */
-    for (f_it = features.begin(); f_it != features.end(); f_it++) {
-      if (f_it->is_marginal && f_it->get_pattern_y() == *y_m) {
-        /* 周辺素性, かつyのパターンが一致して活性化している素性のエネルギー関数値を加算 */
-        energy_z_y += f_it->parameter * f_it->weight;
-      }
-    }
-    /* z(y_m)の値を加算 */
-    marginal_factor += exp(energy_z_y);
+  std::vector<double> energy_z_y(*setY.rbegin()+1, 0.0f);   /* 周辺素性によるz(y)のエネルギー関数値 */
+  std::vector<int> active;                    /* 周辺素性 */
+
+  /* 周辺素性のエネルギー関数値. 周辺素性(ユニグラム)は長さ0の接尾辞に索引されている */
+  get_active_features(NULL, 0, 0, active);
+  for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+    int f_i = active[a_i];
+    energy_z_y[features.get_pattern_y(f_i)] += features.parameter[f_i] * features.weight[f_i];
   }
 
-  /* 以下, 各Z(x)を計算していく */
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-    /* 周辺素性による値で初期化 */
-    norm_factor[*x_it] = marginal_factor;
+  /* 周辺素性の情報から計算できる分log Zmを計算.
+     周辺素性が活性化しないyのz(y)はexp(0)=1 (|Y-Ym|の項). Yに無いyのエネルギーは-∞(z(y)=0) */
+  marginal_energy_y.assign(energy_z_y.size(), -HUGE_VAL);
+  for (std::set<int>::iterator y_it = setY.begin(); y_it != setY.end(); y_it++) {
+    marginal_energy_y[*y_it] = energy_z_y[*y_it];
+  }
+  calc_log_marginal_factor();
+
+  /* 以下, 各log Z(x)を計算していく. xについて独立なので, Xを区間に分けて並列に計算 */
+  log_norm_factor.resize(x_index.size());
+  thread_pool->parallel_for(x_index.size(), [&](int x_begin, int x_end, int thread_id) {
+    std::vector<double> energy_z_y_x(marginal_energy_y.size(), 0.0f); /* 条件付き素性によるz(y|x)のエネルギー関数値 */
+    std::vector<int> active;                                          /* xで活性化しうる素性 */
+
+    for (int x_id = x_begin; x_id < x_end; x_id++) {
+      /* 条件付き素性(長さ1以上の接尾辞)のエネルギーをyについて集計 */
+      active.clear();
+      get_active_features(x_index.get_key(x_id), x_index.get_length(x_id), 1, active);
+      for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+        int f_i = active[a_i];
+        energy_z_y_x[features.get_pattern_y(f_i)] += features.parameter[f_i] * features.weight[f_i];
+      }
 
-    /* Y(x)についての和 */
-    for (y_x = setY_cond[*x_it].begin(); y_x != setY_cond[*x_it].end(); y_x++) {
-      double energy_z_y = 0.0f, energy_z_y_x = 0.0f; /* z(y), z(y|x)のエネルギー関数値 */
-      for (f_it = features.begin(); f_it != features.end(); f_it++) {
-        if (f_it->is_marginal) {
-          energy_z_y += f_it->checkget_param_weight(*x_it, *y_x);
-        } else {
-          energy_z_y_x += f_it->checkget_param_weight(*x_it, *y_x);
-        }
+      /* 最大の項aを求めてから, e^{-a}倍した和をとる */
+      double max_log_z = log_marginal_factor;
+      for (int c_i = setY_cond_offset[x_id]; c_i < setY_cond_offset[x_id+1]; c_i++) {
+        int y = setY_cond[c_i];
+        max_log_z = std::max(max_log_z, marginal_energy_y[y] + energy_z_y_x[y]);
       }
 
-      /* 追加素性を加味  注) 追加素性は条件付き素性 */
-      // energy_z_y_x += add_feature_parameter * get_add_feature_weight(*x_it, *y_x);
+      /* 周辺素性による値で初期化し, Y(x)についての z(y|x) - z(y) を加算 */
+      double sum_z_x = exp(log_marginal_factor - max_log_z);
+      for (int c_i = setY_cond_offset[x_id]; c_i < setY_cond_offset[x_id+1]; c_i++) {
+        int y = setY_cond[c_i];
+        /* 追加素性を加味  注) 追加素性は条件付き素性 */
+        // energy_z_y_x += add_feature_parameter * get_add_feature_weight(*x_it, *y_x);
 
-      /* z(y|x) - z(y) の加算 */
-      norm_factor[*x_it] += exp(energy_z_y) * ( exp(energy_z_y_x) - 1 );
+        sum_z_x += exp(marginal_energy_y[y] + energy_z_y_x[y] - max_log_z) - exp(marginal_energy_y[y] - max_log_z);
+        energy_z_y_x[y] = 0.0f;
+      }
+      log_norm_factor[x_id] = max_log_z + log(sum_z_x);
     }
-  }
+  });
 
   /* ナイーブな計算 for 比較 */
   /*
-  std::map<std::vector<int>, double> norm_factor_naive;
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
+  std::vector<double> norm_factor_naive(x_index.size());
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
     double sum_y = 0.0f;
     for (y_x = setY.begin(); y_x != setY.end(); y_x++) {
-      sum_y += exp(get_sum_param_weight(*x_it, *y_x));
+      sum_y += exp(get_sum_param_weight(get_x_pattern(x_id), *y_x));
     }
-    norm_factor_naive[*x_it] = sum_y;
+    norm_factor_naive[x_id] = sum_y;
   }
   */
 
   /* テスト */
   /*
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-    std::cout << "Sepalate Z(x): " << norm_factor[*x_it]
-    << " Naive Z(x): " << norm_factor_naive[*x_it] << std::endl;
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
+    std::cout << "Sepalate Z(x): " << exp(log_norm_factor[x_id])
+    << " Naive Z(x): " << norm_factor_naive[x_id] << std::endl;
   }
   */
 }
 
+/* 周辺素性のみによる正規化項の対数log Zm = log Σ_{y∈Y} exp(u(y))を, 最大のエネルギーで割ってから足して求める */
+void MEModel::calc_log_marginal_factor(void)
+{
+  double max_energy = -HUGE_VAL;
+  double sum_z      = 0.0f;
+
+  for (std::set<int>::iterator y_it = setY.begin(); y_it != setY.end(); y_it++) {
+    max_energy = std::max(max_energy, marginal_energy_y[*y_it]);
+  }
+  for (std::set<int>::iterator y_it = setY.begin(); y_it != setY.end(); y_it++) {
+    sum_z += exp(marginal_energy_y[*y_it] - max_energy);
+  }
+  log_marginal_factor = max_energy + log(sum_z);
+}
+
 /* モデルの確率分布・モデル期待値の素性へのセット */
 void MEModel::calc_model_prob(void)
 {
-  std::vector<MEFeature>::iterator      f_it; /* 素性イテレータ */
-  std::set<std::vector<int> >::iterator x_it; /* 集合Xのイテレータ */
-  std::set<int>::iterator               y_it; /* 集合Yのイテレータ */
-
   /* まず, 正規化項Z(x)の計算 */
   calc_normalized_factor();
   
-  /* モデルの条件付き確率分布の計算 */
-  double test_sum;
-  cond_prob.clear();
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-    test_sum = 0.0f;
-    for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-      /* 確率分布にセットするパターンの生成
-	 xyの順にパターンを連結 */
-      std::vector<int> pattern_xy = (*x_it);
-      pattern_xy.push_back(*y_it);
-      /* 条件付き確率のセット */
-      cond_prob[pattern_xy] = exp(get_sum_param_weight(*x_it, *y_it)) / norm_factor[*x_it];
-      test_sum += cond_prob[pattern_xy];
-    }
-    //std::cout << "test : " << test_sum << std::endl;
-  }
-
-  /* モデル期待値の素性へのセット  */
-  for (f_it = features.begin(); f_it != features.end(); f_it++) {
-    f_it->model_E = 0.0f;
-    for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-      /* yについての和 */
-      double sum_y = 0.0f;
-      for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-        sum_y += (f_it->checkget_weight(*x_it, *y_it) * get_cond_prob(*x_it, *y_it));
+  /* モデルの条件付き確率分布の計算.
+     Y(x)の外のyの確率はz(y)/Z(x) = exp(u(y) - log Z(x))なので, Y(x)上の確率のみを計算して持つ.
+     xについて独立なので, Xを区間に分けて並列に計算し, 期待値はスレッド毎に集計してから足し合わせる */
+  int num_threads = thread_pool->get_num_threads();
+  std::vector<std::vector<double> > thread_model_E(num_threads);    /* スレッド毎の素性のモデル期待値 */
+  std::vector<std::vector<double> > thread_marginal_E(num_threads); /* スレッド毎のyでのΣ_x P~(x)P(y|x)のY(x)上のずれ */
+  std::vector<double>               thread_sum_x_norm(num_threads, 0.0f); /* スレッド毎のΣ_x P~(x)Zm/Z(x) */
+  thread_pool->parallel_for(x_index.size(), [&](int x_begin, int x_end, int thread_id) {
+    std::vector<double> energy(marginal_energy_y.size(), 0.0f); /* xでのyの条件付き素性のエネルギー関数値 */
+    std::vector<int>    active;                                 /* xで活性化しうる条件付き素性 */
+    std::vector<double> &model_E    = thread_model_E[thread_id];
+    std::vector<double> &marginal_E = thread_marginal_E[thread_id];
+    double              &sum_x_norm = thread_sum_x_norm[thread_id];
+    model_E.assign(features.size(), 0.0f);
+    marginal_E.assign(marginal_energy_y.size(), 0.0f);
+
+    for (int x_id = x_begin; x_id < x_end; x_id++) {
+      double log_norm_factor_x = log_norm_factor[x_id];
+      double empirical_x   = empirical_x_prob[x_id];
+
+      /* xで活性化しうる条件付き素性のエネルギーをyについて集計 */
+      active.clear();
+      get_active_features(x_index.get_key(x_id), x_index.get_length(x_id), 1, active);
+      for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+        int f_i = active[a_i];
+        energy[features.get_pattern_y(f_i)] += features.parameter[f_i] * features.weight[f_i];
+      }
+
+      /* Y(x)上の条件付き確率のセット. 
+         周辺素性のモデル期待値は, Y(x)上でのz(y)/Z(x)からのずれだけを足しておく.
+         確率は対数のまま引き算してから指数をとるので, z(y)やZ(x)そのものは作らない */
+      sum_x_norm += empirical_x * exp(log_marginal_factor - log_norm_factor_x);
+      for (int c_i = setY_cond_offset[x_id]; c_i < setY_cond_offset[x_id+1]; c_i++) {
+        int y = setY_cond[c_i];
+        cond_prob[c_i] = exp(marginal_energy_y[y] + energy[y] - log_norm_factor_x);
+        marginal_E[y] += empirical_x * (cond_prob[c_i] - exp(marginal_energy_y[y] - log_norm_factor_x));
+      }
+
+      /* 条件付き素性のモデル期待値:
+         活性化した素性についてのみ, 条件付き確率にxの周辺経験分布を掛けて足していき, 近似 */
+      for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+        int f_i = active[a_i];
+        int y = features.get_pattern_y(f_i);
+        energy[y] = 0.0f;
+        model_E[f_i] += features.weight[f_i] * get_cond_prob(x_id, y) * empirical_x;
       }
-      /* yについての和にxの周辺経験分布を掛けて足していき, 近似 */
-      f_it->model_E += (sum_y * empirical_x_prob[*x_it]);
+    }
+  });
+
+  /* スレッド毎の集計をスレッド番号順に足し合わせる */
+  std::vector<double> marginal_model_E(marginal_energy_y.size(), 0.0f); /* yでのΣ_x P~(x)P(y|x)のY(x)上のずれ */
+  double sum_x_norm = 0.0f;                                             /* Σ_x P~(x)Zm/Z(x) */
+  features.model_E.assign(features.size(), 0.0f);
+  for (int thread_id = 0; thread_id < num_threads; thread_id++) {
+    if (thread_model_E[thread_id].empty()) {
+      continue; /* 担当区間が無かったスレッド */
+    }
+    for (int f_i = 0; f_i < features.size(); f_i++) {
+      features.model_E[f_i] += thread_model_E[thread_id][f_i];
+    }
+    for (int y = 0; y < (int)marginal_model_E.size(); y++) {
+      marginal_model_E[y] += thread_marginal_E[thread_id][y];
+    }
+    sum_x_norm += thread_sum_x_norm[thread_id];
+  }
+
+  /* 周辺素性のモデル期待値: Σ_x P~(x)P(y|x) = (z(y)/Zm)Σ_x P~(x)Zm/Z(x) + (Y(x)上でのずれ) */
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    if (features.get_N_gram(f_i) == 1) {
+      int y = features.get_pattern_y(f_i);
+      features.model_E[f_i] = features.weight[f_i] * (exp(marginal_energy_y[y] - log_marginal_factor) * sum_x_norm + marginal_model_E[y]);
     }
   }
 
   /* 追加素性のモデル期待値の計算 */
   /*
   add_feature_model_E = 0.0f;
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
     double sum_y = 0.0f;
     for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-      sum_y += (get_add_feature_weight(*x_it, *y_it) * get_cond_prob(*x_it, *y_it));
+      sum_y += (get_add_feature_weight(get_x_pattern(x_id), *y_it) * get_cond_prob(x_id, *y_it));
     }
-    add_feature_model_E += (sum_y * empirical_x_prob[*x_it]);
+    add_feature_model_E += (sum_y * empirical_x_prob[x_id]);
   }
   */
 
@@ -465,29 +799,42 @@ void MEModel::calc_model_prob(void)
 void MEModel::calc_additive_features_weight(void)
 {
   double max_sum_xy = -DBL_MAX;                           /* 最大の素性重み和を与えるパターンの, 和の値.(定数C) */
-  std::vector<MEFeature>::iterator             f_it;      /* 素性のイテレータ */
   std::map<std::vector<int>, double>::iterator add_f_it;  /* 追加素性のイテレータ */
-  std::set<std::vector<int> >::iterator        x_it;
-  std::set<int>::iterator                      y_it;
+
+  std::vector<double> sum_xy(*setY.rbegin()+1, 0.0f); /* xでのyの素性重み和 */
+  std::vector<char>   is_touched(sum_xy.size(), 0);   /* xで活性化しうる素性を持つyか */
+  std::vector<int>    touched_y;                      /* xで活性化しうる素性を持つyのリスト */
+  std::vector<int>    active;                         /* xで活性化しうる素性 */
 
   add_feature_weight.clear();
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-    for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    /* 1つのパターンについてのモデル素性重み和をとる */
-    double sum_xy = 0.0f;
-    for (f_it = features.begin(); f_it != features.end(); f_it++) {
-      sum_xy += f_it->checkget_weight(*x_it, *y_it);
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
+    /* 1つのxについて, 活性化しうる素性の重み和をyについて集計 */
+    active.clear(); touched_y.clear();
+    get_active_features(x_index.get_key(x_id), x_index.get_length(x_id), 0, active);
+    for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+      int y = features.get_pattern_y(active[a_i]);
+      if (!is_touched[y]) {
+        is_touched[y] = 1;
+        touched_y.push_back(y);
+      }
+      sum_xy[y] += features.weight[active[a_i]];
     }
     /* 最大値の更新 */
-    if (sum_xy > max_sum_xy) {
-      max_sum_xy = sum_xy;
+    for (int t_i = 0; t_i < (int)touched_y.size(); t_i++) {
+      int y = touched_y[t_i];
+      if (sum_xy[y] > max_sum_xy) {
+        max_sum_xy = sum_xy[y];
+      }
+      sum_xy[y] = 0.0f; is_touched[y] = 0;
+    }
+    /* 素性が1つも活性化しないyがあれば, その重み和は0 */
+    if (touched_y.size() < setY.size() && 0.0f > max_sum_xy) {
+      max_sum_xy = 0.0f;
     }
     /* 追加素性のパターン生成, 重み初期化 */
-//    std::vector<int> pattern_xy = (*x_it);
+//    std::vector<int> pattern_xy = get_x_pattern(x_id);
 //    pattern_xy.push_back(*y_it);
 //    add_feature_weight[pattern_xy] = -sum_xy; /* (後で最大値max_sum_xyを加算) */
-
-    }
   }
 
   /* 定数Cのセット */
@@ -505,9 +852,12 @@ void MEModel::calc_additive_features_weight(void)
   /* 追加素性の経験期待値計算 : 全てのパターンに現れるとする(妥当性が不明) */
   /*
   add_feature_empirical_E = 0.0f;
-  for (f_it = candidate_features.begin(); f_it != candidate_features.end(); f_it++) {
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
     add_feature_empirical_E 
-      += (f_it->empirical_prob * get_add_feature_weight(f_it->get_pattern_x(), f_it->get_pattern_y()));
+      += (candidate_features.empirical_prob[f_i]
+          * get_add_feature_weight(std::vector<int>(candidate_features.get_pattern_x(f_i),
+                                                    candidate_features.get_pattern_x(f_i) + candidate_features.get_x_size(f_i)),
+                                   candidate_features.get_pattern_y(f_i)));
   }
   */
 
@@ -529,51 +879,36 @@ double MEModel::get_add_feature_weight(std::vector<int> pattern_x, int pattern_y
    条件付き素性を活性化させるyの集合Y(x)をセットする. */
 void MEModel::sepalate_setY(void)
 {
-  std::vector<MEFeature>::iterator f_it;
-  std::set<std::vector<int> >::iterator x_it;
-  std::set<int>::iterator y_it;
-
-  /* Ymのセット : Y（単語）の要素を走査し, 周辺素性が活性化される要素を集める */
+  /* Ymのセット : 周辺素性を走査し, 活性化させるY（単語）の要素を集める */
   //setY_marginal = setY; // (下のループは実は不要)
   setY_marginal.clear();
-  for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    for (f_it = features.begin();
-        f_it != features.end();
-        f_it++) {
-      if (f_it->is_marginal && f_it->get_pattern_y() == *y_it) {
-        /* 周辺素性を活性化させているYの要素（単語）を発見 
-           -> 集合に追加. breakして次の単語のチェックに */
-        setY_marginal.insert(*y_it);
-        break;
-      }
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    if (features.is_marginal[f_i]) {
+      setY_marginal.insert(features.get_pattern_y(f_i));
     }
   }
 
-  /* Y(x)のセット : 一番外側でXの要素（パターン）を走査, その中で条件付き素性が活性化される要素を集める */
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
+  /* Y(x)のセット : Xの要素（パターン）を走査し, 長さ1以上の接尾辞で活性化しうる条件付き素性のyを集める.
+     x毎にyを昇順に並べてCSR形式に詰める */
+  std::vector<int> active, setY_x;
+  setY_cond_offset.assign(x_index.size()+1, 0);
+  setY_cond.clear();
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
     // （ヒューリスティクス）追加素性は条件付き素性なので, 全てのYが条件付き素性を活性化させられる
     // setY_cond[*x_it] = setY; // (下のループは実は不要)
-    setY_cond[*x_it].clear();
-    for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-      for (f_it = features.begin();
-          f_it != features.end();
-          f_it++) {
-        if (!f_it->is_marginal
-            && f_it->check_pattern(*x_it, *y_it)) {
-          /* 条件付き素性かつ,
-             その素性を活性化させる組み合わせを発見
-             -> 集合に追加し, breakして次のYの要素（単語）へ */
-          setY_cond[*x_it].insert(*y_it);
-          break;
-        }
-      }
-      /*
-      if (get_add_feature_weight(*x_it, *y_it) != 0) {
-          setY_cond[*x_it].insert(*y_it);
+    active.clear(); setY_x.clear();
+    get_active_features(x_index.get_key(x_id), x_index.get_length(x_id), 1, active);
+    for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+      if (!features.is_marginal[active[a_i]]) {
+        setY_x.push_back(features.get_pattern_y(active[a_i]));
       }
-      */
     }
+    std::sort(setY_x.begin(), setY_x.end());
+    setY_x.erase(std::unique(setY_x.begin(), setY_x.end()), setY_x.end());
+    setY_cond.insert(setY_cond.end(), setY_x.begin(), setY_x.end());
+    setY_cond_offset[x_id+1] = setY_cond.size();
   }
+  cond_prob.assign(setY_cond.size(), 0.0f);
 
 }
 
@@ -582,18 +917,41 @@ void MEModel::setup_learning(void)
 {
   /* 周辺素性のフラグをセット */
   set_marginal_flag();
+  /* 活性化索引の作成 */
+  build_activation_index();
   /* Yの分割 */
   sepalate_setY();
   /* 追加素性f_[n+1]の重みを計算 */
   calc_additive_features_weight();
 }  
 
-/* 学習:一般化反復スケーリング法(GIS)による */
-void MEModel::learning(void)
+/* 学習: 選んだ最適化手法で素性パラメタを学習する.
+   warm_startなら今のパラメタから始める */
+void MEModel::learning(bool warm_start)
+{
+  /* 学習のセットアップ */
+  setup_learning();
+
+  /* パラメタ初期化 */
+  if (!warm_start) {
+    features.parameter.assign(features.size(), 0.0f);
+  }
+
+  if (optimizer_type == OPTIMIZER_LBFGS) {
+    learning_lbfgs();
+  } else {
+    learning_gis();
+  }
+
+  /* 予測器を学習後のパラメタで作り直す */
+  rebuild_predictor();
+}
+
+/* 一般化反復スケーリング法(GIS)によるパラメタ学習 */
+void MEModel::learning_gis(void)
 {
   int    iteration_count   = 0;                 /* 学習繰り返しカウント */
   double change_amount     = DBL_MAX;           /* 変化量=パラメタ変化のRMS（二乗平均平方根） */
-  std::vector<MEFeature>::iterator f_it;        /* 素性イテレータ */
   std::vector<double> delta(features.size());   /* パラメタ変化量 */
   // double add_delta = 0.0f;
   double pre_likelihood = -DBL_MAX;
@@ -605,22 +963,18 @@ void MEModel::learning(void)
   double sum_empirical_E, sum_model_E;          // 正規化の為の和 
   */
 
-  /* 学習のセットアップ */
-  setup_learning();
-
-  /* パラメタ初期化 */
+  /* 変化量の初期化 */
   // sum_empirical_E = 0.0f;
-  for (int i = 0; i < (int)features.size(); i++) {
-    features[i].parameter = 0.0f;
+  for (int i = 0; i < features.size(); i++) {
     delta[i] = 0.0f;
-    //sum_empirical_E += pow(features[i].empirical_E,2);
+    //sum_empirical_E += pow(features.empirical_E[i],2);
   }
   //sum_empirical_E = sqrt(sum_empirical_E);
 
   /* 経験期待値の正規化 : 二乗和を1に. TODO:果たしてこれで...? */
   /*
-  for (int i = 0; i < (int)features.size(); i++) {
-    norm_empirical_E[i] = features[i].empirical_E / sum_empirical_E;
+  for (int i = 0; i < features.size(); i++) {
+    norm_empirical_E[i] = features.empirical_E[i] / sum_empirical_E;
   }
   */
 
@@ -632,36 +986,36 @@ void MEModel::learning(void)
   while (iteration_count < max_iteration_learn 
       && (change_amount > epsilon_learn) 
       && ((likelihood - pre_likelihood) > epsilon_learn)) {
+    std::chrono::steady_clock::time_point iteration_start_time = std::chrono::steady_clock::now();
     change_amount  = 0.0f;
 
     /* モデル期待値の正規化定数の算出 */
     /*
     sum_model_E = 0.0f;
-    for (int i = 0; i < (int)features.size(); i++) {
-      sum_model_E += pow(features[i].model_E, 2);
+    for (int i = 0; i < features.size(); i++) {
+      sum_model_E += pow(features.model_E[i], 2);
     }
     sum_model_E = sqrt(sum_model_E);
     */
 
-    /* 変化量deltaの計算, パラメタ更新, 全体の変化量への加算 */
-    for (int i = 0; i < (int)features.size(); i++) {
+    /* 変化量deltaの計算, 全体の変化量への加算 */
+    for (int i = 0; i < features.size(); i++) {
       /*
       sum_model_E = sqrt(sum_model_E);
-      norm_model_E[i] = features[i].model_E / sum_model_E;
+      norm_model_E[i] = features.model_E[i] / sum_model_E;
       */
       // delta[i] = log((norm_empirical_E[i]/norm_model_E[i]) * (sum_model_E/sum_empirical_E))/max_sum_feature_weight;
-      delta[i] = log(features[i].empirical_E/features[i].model_E)/max_sum_feature_weight;
-      features[i].parameter += delta[i];
+      delta[i] = log(features.empirical_E[i]/features.model_E[i])/max_sum_feature_weight;
       change_amount += pow(delta[i],2);
       /*
       std::cout
-        << features[i].get_N_gram() << "-gram"
-        << " E[f_{" << i << "}]: " << features[i].model_E
-        << " E~[f_{" << i << "}]: " << features[i].empirical_E 
+        << features.get_N_gram(i) << "-gram"
+        << " E[f_{" << i << "}]: " << features.model_E[i]
+        << " E~[f_{" << i << "}]: " << features.empirical_E[i] 
         << " normE~[f_{" << i << "}]: " << norm_empirical_E[i]
         << " normE[f_{" << i << "}]: " << norm_model_E[i]
         << " delta[" << i << "]: " << delta[i]
-        << " parameter[" << i << "]: " << features[i].parameter << std::endl;
+        << " parameter[" << i << "]: " << features.parameter[i] << std::endl;
         */
     }
 
@@ -672,10 +1026,17 @@ void MEModel::learning(void)
        change_amount += pow(add_delta,2);
        */
 
-    /* 変化量が非数nanだったり無限infに飛んでしまったら, エラー終了 */
-    if (isnan(change_amount) || isinf(change_amount)) {
-      std::cerr << "Learning Error : some of change amount gone to nan/inf." << std::endl;
-      exit(1);
+    /* 変化量が非数nanだったり無限infに飛んでしまったら, パラメタを更新せずにそこで学習を打ち切る.
+       それまでの学習結果は残るので, プロセスごと止めることはしない */
+    if (std::isnan(change_amount) || std::isinf(change_amount)) {
+      std::cerr << "Warning : some of change amount gone to nan/inf. Learning stopped at iteration " << iteration_count << "." << std::endl;
+      break;
+    }
+    /* パラメタは連続した配列なので, 更新はそのままベクトル化できる */
+    double       *parameter   = features.parameter.data();
+    const double *delta_array = delta.data();
+    for (int i = 0; i < features.size(); i++) {
+      parameter[i] += delta_array[i];
     }
 
     /* 確率分布の再計算/尤度計算 */
@@ -683,10 +1044,21 @@ void MEModel::learning(void)
     pre_likelihood = likelihood;
     calc_likelihood();
 
+    /* 尤度が非数/無限になったら, パラメタを書き戻して直前の分布を計算し直し, そこで学習を打ち切る */
+    if (std::isnan(likelihood) || std::isinf(likelihood)) {
+      std::cerr << "Warning : likelihood gone to nan/inf. Learning stopped at iteration " << iteration_count << "." << std::endl;
+      for (int i = 0; i < features.size(); i++) {
+        parameter[i] -= delta_array[i];
+      }
+      calc_model_prob();
+      calc_likelihood();
+      break;
+    }
+
     /* 尤度が減少していたら, パラメタを書き戻す */
     if (likelihood - pre_likelihood < epsilon_learn) {
-      for (int i = 0; i < (int)features.size(); i++) {
-        features[i].parameter -= delta[i]; 
+      for (int i = 0; i < features.size(); i++) {
+        parameter[i] -= delta_array[i]; 
       }
     }
 
@@ -694,167 +1066,350 @@ void MEModel::learning(void)
     change_amount = sqrt(change_amount/(delta.size()+1));
     std::cout << "[" << iteration_count << "] : " << "RMS Change Amount : " << change_amount << " Likelihood : " << likelihood << " Diff. Likelihood : " << (likelihood - pre_likelihood) << " KLdivergence : " << KLdivergence << std::endl;
     iteration_count++;
+    record_phase_time("learning iteration", iteration_start_time);
   }
 } 
 
-/* 内部表現のパターンから条件付き確率を得る. 未知のXパターンに対処 */
-double MEModel::get_cond_prob(std::vector<int> pattern_x, int pattern_y)
+/* L-BFGS法によるパラメタ学習.
+   目的関数は学習データ全体(パターン総数N)の条件付き対数尤度からガウス事前分布(分散σ^2)の対数を引いたものをNで割ったもの
+     L(λ) = Σ_{x,y} P~(x,y) log P(y|x) - Σ_i λ_i^2/(2σ^2 N)
+   で, その勾配は ∂L/∂λ_i = E~[f_i] - E[f_i] - λ_i/(σ^2 N). 最適化手法は最小化するので符号を反転して渡す.
+   モデル期待値E[f_i]はGISと同じcalc_model_probで求める */
+void MEModel::learning_lbfgs(void)
 {
-  std::vector<int> pattern_xy = pattern_x;
-  pattern_xy.push_back(pattern_y);
+  LearningObjective objective(this);
+  MELBFGS optimizer(LBFGS_HISTORY_SIZE, max_iteration_learn);
+  std::vector<double> parameter = features.parameter; /* 初期値は今のパラメタ(通常はlearningで0にしてある) */
+  double sum_count = 0.0f;  /* パターン総数N */
 
-  if (norm_factor.count(pattern_x) == 1) {
-    /* 既知のXパターンの時 */
-    return cond_prob[pattern_xy];
-  } else {
-    /* 未知のXパターンの時:その場で確率値を計算 */
-    double norm_factor_x    = 0.0f; /* 分母Z(x) */
-    double numerator        = 1.0f; /* 分子のエネルギー関数値 */
-    std::vector<MEFeature>::iterator f_it;
-
-    /* 追加素性のエネルギー */
-    //double add_energy_factor = add_feature_parameter * get_add_feature_weight(pattern_x, pattern_y);
-
-    /* パターンyでユニグラムが活性化しない時の分子の値 */
-    //numerator = exp(add_energy_factor);
-
-    /* ユニグラム(=周辺素性)のみが活性化するエネルギー関数和がZ(x) */
-    for (f_it = features.begin();
-         f_it != features.end();
-         f_it++) {
-      //double norm_factor_energy = add_feature_parameter * get_add_feature_weight(f_it->get_pattern_x(), f_it->get_pattern_y());
-      double norm_factor_energy = 0.0f;
-      if (f_it->get_N_gram() == 1) {
-        norm_factor_energy += (f_it->parameter * f_it->weight);
-        /* パターンyでユニグラムが活性化すれば, 分子の値がそれのみで定まる */
-        if (f_it->get_pattern_y() == pattern_y) {
-          numerator = exp(f_it->parameter * f_it->weight);
-        }
+  /* 勾配に使う経験期待値 */
+  calc_feature_empirical_E(objective.empirical_E);
+
+  /* 事前分布の係数 1/(σ^2 N). 分散が0以下なら事前分布を使わない */
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    sum_count += candidate_features.count[f_i];
+  }
+  objective.prior_scale = (prior_variance > 0.0f) ? 1.0 / (prior_variance * sum_count) : 0.0f;
+
+  if (!optimizer.minimize(objective, parameter)) {
+    std::cerr << "Warning : L-BFGS stopped before convergence." << std::endl;
+  }
+
+  /* 最後に受理したパラメタで確率分布を計算し直す(直線探索で試した点の分布が残っているため) */
+  features.parameter = parameter;
+  calc_model_prob();
+  calc_likelihood();
+}
+
+/* モデル素性の経験期待値 E~[f_i] = Σ_{x,y} P~(x,y) f_i(x,y) を求める.
+   各素性候補のパターン(x, y)について, xの各長さの接尾辞の活性化索引からyの一致する素性を引いて足し込む */
+void MEModel::calc_feature_empirical_E(std::vector<double> &empirical_E)
+{
+  empirical_E.assign(features.size(), 0.0f);
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    const int *test_x = x_index.get_key(candidate_x_id[f_i]);
+    int x_size = x_index.get_length(candidate_x_id[f_i]);
+    int test_y = candidate_features.get_pattern_y(f_i);
+    double event_prob = candidate_features.empirical_prob[f_i];
+
+    for (int len = 0; len <= x_size && len < maxN_gram; len++) {
+      int suffix_id = activation_index.find((len > 0 ? &test_x[x_size-len] : NULL), len);
+      if (suffix_id == -1) {
+        continue;
+      }
+      std::vector<int>::iterator y_begin = activation_y.begin() + activation_offset[suffix_id];
+      std::vector<int>::iterator y_end   = activation_y.begin() + activation_offset[suffix_id+1];
+      std::pair<std::vector<int>::iterator, std::vector<int>::iterator> range
+        = std::equal_range(y_begin, y_end, test_y);
+      for (std::vector<int>::iterator a_it = range.first; a_it != range.second; a_it++) {
+        int feature_index = activation_feature[a_it - activation_y.begin()];
+        empirical_E[feature_index] += features.weight[feature_index] * event_prob;
       }
-      norm_factor_x += exp(norm_factor_energy);
     }
+  }
+}
 
-    /* (分子/Z(x))が確率値となる */
-    return (numerator / norm_factor_x);
+/* L-BFGS法の目的関数のコンストラクタ */
+MEModel::LearningObjective::LearningObjective(MEModel *model)
+{
+  this->model     = model;
+  prior_scale     = 0.0f;
+  iteration_start = std::chrono::steady_clock::now();
+}
+
+/* パラメタxでの目的関数 -(L(λ)) と勾配 -(∂L/∂λ) */
+double MEModel::LearningObjective::evaluate(const std::vector<double> &x, std::vector<double> &gradient)
+{
+  MEFeatureStore &features = model->features;
+  double prior = 0.0f;                          /* 事前分布の項 Σ_i λ_i^2/(2σ^2 N) */
 
+  features.parameter = x;
+  model->calc_model_prob();
+  model->calc_likelihood();
+
+  for (int i = 0; i < features.size(); i++) {
+    gradient[i] = features.model_E[i] - empirical_E[i] + prior_scale * x[i];
+    prior      += 0.5f * prior_scale * x[i] * x[i];
   }
 
+  return -(model->likelihood - prior);
 }
 
-/* 引数の文字列パターンの条件付き確率P(y|x)を計算して返す */
-double MEModel::get_cond_prob_from_str(std::vector<std::string> pattern_x, std::string pattern_y)
+/* 反復毎の経過の印字と所要時間の記録 */
+bool MEModel::LearningObjective::progress(int iteration, const std::vector<double> &x, double value, double gradient_norm)
 {
-  std::vector<int> coded_x;
+  std::cout << "[" << iteration << "] : " << "Objective : " << -value << " Gradient Norm : " << gradient_norm
+            << " Likelihood : " << model->likelihood << " KLdivergence : " << model->KLdivergence << std::endl;
+  model->record_phase_time("learning iteration", iteration_start);
+  iteration_start = std::chrono::steady_clock::now();
+  return true;
+}
+
+/* ファイルの単語列を流し込んでミニバッチSGDで学習し, 学習器の素性をモデル素性にする.
+   素性候補/Xパターンは作らないので, 素性選択や他の最適化手法とは併用しない */
+void MEModel::stream_learning(std::vector<std::string> filenames)
+{
+  if (sgd_trainer == NULL) {
+    sgd_trainer = new MESGDTrainer(maxN_gram, max_candidate_memory / MESGDTrainer::memory_per_feature(maxN_gram),
+                                   SGD_BATCH_SIZE, SGD_LEARNING_RATE, l1_coefficient);
+  }
 
-  /* 文字列を内部表現（整数列）に直す */
-  /* 文字列xパターンを, 最長maxN_gramのパターンに変換
-     pattern_x.size() < maxN_gram-1 の場合は長さはpattern_x.size()に合わせる */
-  for (int i = 0; i < (int)pattern_x.size(); i++) {
-    if (i < (int)pattern_x.size()-(maxN_gram-1)) {
+  for (int file_i = 0; file_i < (int)filenames.size(); file_i++) {
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    if (!sgd_trainer->read_file(filenames[file_i])) {
+      std::cerr << "Error : cannot open file \"" << filenames[file_i] << "\"." << std::endl;
       continue;
     }
-    coded_x.push_back(word_map[pattern_x[i]]);
+    record_phase_time("stream file", start_time);
+  }
+  sgd_trainer->flush();
+
+  /* 学習器の素性と語彙をモデルへ. 確率はすべて予測器で計算するので, 学習データ上の分布は持たない */
+  sgd_trainer->export_model(features, vocabulary, setY);
+  unique_word_no = setY.size();
+  candidate_features.clear(); candidate_index.clear(); candidate_x_id.clear();
+  x_index.clear(); empirical_x_prob.clear(); log_norm_factor.clear();
+  setY_cond_offset.assign(1, 0); setY_cond.clear(); cond_prob.clear();
+  marginal_energy_y.assign(setY.empty() ? 0 : *setY.rbegin()+1, -HUGE_VAL);
+  setY_marginal.clear();
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    if (features.is_marginal[f_i]) {
+      setY_marginal.insert(features.get_pattern_y(f_i));
+      marginal_energy_y[features.get_pattern_y(f_i)] = features.parameter[f_i] * features.weight[f_i];
+    }
   }
+  calc_log_marginal_factor();
+  std::cout << "Streamed events : " << sgd_trainer->get_num_events()
+            << " Conditional features in trainer : " << sgd_trainer->get_num_features()
+            << " Model features : " << features.size() << std::endl;
 
-  /* 確率値を取得して返す */
-  return get_cond_prob(coded_x, word_map[pattern_y]);
+  build_activation_index();
+  rebuild_predictor();
 }
- 
-/* 引数のxの文字列パターンから, 最も確率の高い単語yを予測して返す */ 
-std::string MEModel::predict_y(std::vector<std::string> pattern_x) 
+
+/* 更新モード: 読み込んだモデルに, 前回から追加/変更/削除されたファイルを反映して学習し直す.
+   ・ファイル一覧(パス, 更新時刻, サイズ)と比べて, 新しいファイル, 時刻/サイズの変わったファイル, 消えたファイルを見分ける
+   ・読み直すのは新しいファイルと変わったファイルだけ. 変わったファイルと消えたファイルは,
+     ファイル毎に持つ前回の頻度(カウントバイアス適用前)を全体の頻度から差し引く
+   ・全体の頻度から素性候補を作り直す(語彙はモデル素性の単語IDを保つため残す)
+   ・素性選択はやり直さず, 今のモデル素性の経験確率/経験期待値を更新して, 今のパラメタから学習する.
+     学習データに現れなくなったモデル素性は捨てる
+   ・反映した結果カウントバイアスを満たすパターンが無ければ, 頻度を元に戻してfalseを返す.
+     予測器は学習し終えるまで差し替えないので, サーバは前のスナップショットで答え続ける */
+bool MEModel::update_model(std::vector<std::string> filenames)
 {
-  double              max_prob;                 /* 最大の確率値 */
-  int                 max_prob_index;           /* 最大の確率値を与えるインデックス */
-  std::vector<int>    coded_x;                  /* パターン */
-  std::map<std::string, int>::iterator map_itr; /* キーに対応する文字列を探索するイテレータ */
-  std::set<int>::iterator       y_it;           /* yのパターンイテレータ */
+  std::vector<std::string> changed_files;
+  std::vector<std::string> removed_files;
+  std::set<std::string>    current_files(filenames.begin(), filenames.end());
 
-  /* pattern_xを内部表現に直す */
-  for (int i = 0; i < (int)pattern_x.size(); i++) {
-    if (i < (int)pattern_x.size()-(maxN_gram-1)) {
-      continue;
+  if (file_counts.empty()) {
+    std::cerr << "Error : the model has no pattern counts to update (it was trained by streaming)." << std::endl;
+    return false;
+  }
+
+  /* 変わったファイルの選別 */
+  for (std::set<std::string>::iterator f_it = current_files.begin(); f_it != current_files.end(); f_it++) {
+    FileStamp stamp;
+    std::map<std::string, FileStamp>::iterator m_it = file_manifest.find(*f_it);
+    if (!get_file_stamp(*f_it, &stamp.mtime, &stamp.size)
+        || m_it == file_manifest.end()
+        || m_it->second.mtime != stamp.mtime || m_it->second.size != stamp.size) {
+      changed_files.push_back(*f_it);
     }
-    coded_x.push_back(word_map[pattern_x[i]]);
   }
-  
-  /* 最大確率値を与えるyの探索 */
-  max_prob = 0.0f;
-  max_prob_index = -1;
-  for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    /* 最大確率の更新 */
-    if (get_cond_prob(coded_x, *y_it) > max_prob) {
-      max_prob       = get_cond_prob(coded_x, *y_it);
-      max_prob_index = *y_it;
+  /* 消えたファイルの選別 */
+  for (std::map<std::string, FileStamp>::iterator m_it = file_manifest.begin(); m_it != file_manifest.end(); m_it++) {
+    if (current_files.find(m_it->first) == current_files.end()) {
+      removed_files.push_back(m_it->first);
+    }
+  }
+  std::cout << "Changed files : " << changed_files.size() << " / " << current_files.size()
+            << " Removed files : " << removed_files.size() << std::endl;
+  if (changed_files.empty() && removed_files.empty()) {
+    return true;
+  }
+  if (current_files.empty()) {
+    std::cerr << "Error : no files to update the model from." << std::endl;
+    return false;
+  }
+
+  /* 差分の読み込み. 失敗した時は頻度もファイル一覧も変わらない */
+  if (!update_pattern_counts(changed_files, removed_files) || !build_candidate_features()) {
+    return false;
+  }
+
+  /* モデル素性の経験確率/経験期待値を素性候補から写す.
+     素性候補に無くなった(学習データに現れない/頻度がカウントバイアス未満になった)モデル素性は捨てる */
+  std::vector<int>  key;
+  std::vector<char> is_kept(features.size());
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    features.get_pattern_key(f_i, key);
+    int c_index = candidate_index.find(key);
+    is_kept[f_i] = (c_index != -1);
+    if (c_index != -1) {
+      features.count[f_i]          = candidate_features.count[c_index];
+      features.empirical_prob[f_i] = candidate_features.empirical_prob[c_index];
+      features.empirical_E[f_i]    = candidate_features.empirical_E[c_index];
     }
   }
+  features.compact(is_kept);
+
+  /* 今のパラメタから学習 */
+  learning(true);
+  return true;
+}
+
+/* 現在のパラメタから予測器を作り直し, 新しいスナップショットとして差し替える.
+   古いスナップショットは, それを持っている読み手が全て手放した時に解放される */
+void MEModel::rebuild_predictor(void)
+{
+  std::shared_ptr<const MEPredictor> snapshot(new MEPredictor(*this));
+  std::atomic_store(&predictor, snapshot);
+}
+
+/* start_timeから今までの時間を段階nameの所要時間として記録する */
+void MEModel::record_phase_time(const std::string &name, std::chrono::steady_clock::time_point start_time)
+{
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+  phase_times.push_back(std::make_pair(name, elapsed.count()));
+}
+
+/* 学習の各段階の所要時間を得る */
+const std::vector<std::pair<std::string, double> > &MEModel::get_phase_times(void)
+{
+  return phase_times;
+}
+
+/* xのIDから条件付き確率を得る.
+   Y(x)の中のyは計算済みの確率を二分探索で引き, それ以外のyは周辺素性のみで決まる z(y)/Z(x) */
+double MEModel::get_cond_prob(int x_id, int pattern_y)
+{
+  std::vector<int>::iterator y_begin = setY_cond.begin() + setY_cond_offset[x_id];
+  std::vector<int>::iterator y_end   = setY_cond.begin() + setY_cond_offset[x_id+1];
+  std::vector<int>::iterator y_it    = std::lower_bound(y_begin, y_end, pattern_y);
+
+  if (y_it != y_end && *y_it == pattern_y) {
+    return cond_prob[y_it - setY_cond.begin()];
+  }
+
+  /* 学習データに現れないyの確率は0 */
+  if (pattern_y < 0 || pattern_y >= (int)marginal_energy_y.size()) {
+    return 0.0f;
+  }
+  return exp(marginal_energy_y[pattern_y] - log_norm_factor[x_id]);
+}
+
+/* xのIDからXパターンを得る */
+std::vector<int> MEModel::get_x_pattern(int x_id)
+{
+  const int *key = x_index.get_key(x_id);
+  return std::vector<int>(key, key + x_index.get_length(x_id));
+}
+
+/* 引数の文字列パターンの条件付き確率P(y|x)を計算して返す */
+double MEModel::get_cond_prob_from_str(std::vector<std::string> pattern_x, std::string pattern_y)
+{
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot == NULL) {
+    std::cerr << "Error : model is not learned yet." << std::endl;
+    return 0.0f;
+  }
+
+  /* 確率値を取得して返す. 未知の単語yの確率は0 */
+  int coded_y = snapshot->encode_word(pattern_y);
+  if (coded_y == -1) {
+    return 0.0f;
+  }
+  return snapshot->get_cond_prob(snapshot->encode_pattern_x(pattern_x), coded_y);
+}
+ 
+/* 引数のxの文字列パターンから, 最も確率の高い単語yを予測して返す */ 
+std::string MEModel::predict_y(std::vector<std::string> pattern_x) 
+{
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot == NULL) {
+    std::cerr << "Error : model is not learned yet." << std::endl;
+    return "\0";
+  }
 
   /* 内部表現（整数）から文字列に変換して返す */
-  return convert_pattern_to_string(max_prob_index);
+  return snapshot->decode_word(snapshot->predict_y(snapshot->encode_pattern_x(pattern_x)));
 }
 
-/* 上位ranking_sizeの確率のyを返す */
-std::vector<std::string> MEModel::get_ranking(std::vector<std::string> pattern_x, int ranking_size)
+/* 上位ranking_sizeの確率のyを(単語ID, 確率)の組で返す */
+std::vector<std::pair<int, double> > MEModel::get_ranking(std::vector<std::string> pattern_x, int ranking_size)
 {
-  /* ランキングのサイズ */
-  int size = ranking_size;
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot == NULL) {
+    std::cerr << "Error : model is not learned yet." << std::endl;
+    return std::vector<std::pair<int, double> >();
+  }
 
   /* ランキングサイズが大きすぎる時は, 単語数に合わせる */
-  if (ranking_size > unique_word_no) {
+  if (ranking_size > snapshot->get_label_size()) {
     std::cerr << "Warning : ranking size exceeds number of dataset unique words!" << std::endl;
-    size = unique_word_no;
+    ranking_size = snapshot->get_label_size();
   }
 
-  std::vector<std::string>             ranking(ranking_size);             /* ランキング */
-  std::map<int, double>                prob_list;                         /* 各単語の確率値 */
-  std::vector<double>                  sorted_prob_list(unique_word_no);  /* ソートした確率リスト */
-  std::vector<int>                     coded_x;                           /* Xパターン */
-  std::map<std::string, int>::iterator map_itr;                           /* キーに対応する文字列を探索するイテレータ */
-  std::vector<double>::iterator        rank_itr;                          /* ランキングのイテレータ */
-  std::set<int>::iterator              y_it;                              /* yパターンイテレータ */
+  return snapshot->get_ranking(snapshot->encode_pattern_x(pattern_x), ranking_size);
+}
 
-  /* pattern_xを内部表現に直す */
-  for (int i = 0; i < (int)pattern_x.size(); i++) {
-    if (i < (int)pattern_x.size()-(maxN_gram-1)) {
-      continue;
-    }
-    coded_x.push_back(word_map[pattern_x[i]]);
-  }
+/* ビーム探索による複数単語の補完. 語彙に無い終端語は無視する */
+std::vector<std::pair<std::vector<std::string>, double> >
+MEModel::get_completions(std::vector<std::string> pattern_x, int max_length, int beam_width,
+                         int num_results, const std::set<std::string> &stop_words)
+{
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+  std::vector<std::pair<std::vector<std::string>, double> > completions;
+  std::vector<int> coded_stop_words;
 
-  /* 確率リストの作成 */
-  int list_index = 0;
-  for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    /* 確率の取得 */
-    prob_list[*y_it] 
-      = sorted_prob_list[list_index++] 
-      = get_cond_prob(coded_x, *y_it);
+  if (snapshot == NULL) {
+    std::cerr << "Error : model is not learned yet." << std::endl;
+    return completions;
   }
 
-  /* ソートした確率リストの生成 */
-  std::sort(sorted_prob_list.begin(), sorted_prob_list.end(), 
-	    std::greater<double>());
-
-  /* ランキングの作成 */
-  bool is_find;
-  std::set<int> finded_y; /* 発見済みのy. (同じ確率だと, 何度も同じyが選ばれる) */
-  for (int rank = 0; rank < size; rank++) {
-    is_find = false;
-    for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-      /* rank番目の確率値を与える内部表現を見つけ,
-	 見つけた内部表現から文字列を探し, ランキングにセット */
-      if (fabs(sorted_prob_list[rank] - prob_list[*y_it]) < DBL_EPSILON
-          && finded_y.count(*y_it) == 0) {	
-        finded_y.insert(*y_it);
-        ranking[rank] = convert_pattern_to_string(*y_it);
-        is_find = true;
-      }
-      if (is_find) break;
+  for (std::set<std::string>::const_iterator w_it = stop_words.begin(); w_it != stop_words.end(); w_it++) {
+    int word_id = snapshot->encode_word(*w_it);
+    if (word_id != -1) {
+      coded_stop_words.push_back(word_id);
     }
-    std::cout << "Rank " << rank+1 << " : " << ranking[rank];    
-    std::cout << " Prob. : " << sorted_prob_list[rank] << std::endl;
+  }
+  std::sort(coded_stop_words.begin(), coded_stop_words.end());
+
+  std::vector<std::pair<std::vector<int>, double> > sequences
+    = snapshot->beam_search(snapshot->encode_pattern_x(pattern_x), max_length, beam_width, num_results, coded_stop_words);
+  for (int s_i = 0; s_i < (int)sequences.size(); s_i++) {
+    std::vector<std::string> words;
+    for (int t = 0; t < (int)sequences[s_i].first.size(); t++) {
+      words.push_back(snapshot->decode_word(sequences[s_i].first[t]));
+    }
+    completions.push_back(std::make_pair(words, exp(sequences[s_i].second)));
   }
 
-  return ranking;
-
+  return completions;
 }
 
 /* 対数尤度（経験対数尤度）の計算とメンバへのセット */
@@ -862,17 +1417,16 @@ void MEModel::calc_likelihood(void)
 {
   double like_sum, KL_sum;
   //double entropy_sum;
-  std::vector<MEFeature>::iterator f_it;
 
   /* モデルの結合分布は厳密には計算出来ないので, 
      P(x,y) ~= P~(x)P(y|x)とする. */
   like_sum = 0.0f; KL_sum = 0.0f; //entropy_sum = 0.0f;
-  for (f_it = candidate_features.begin();
-       f_it != candidate_features.end();
-       f_it++) {
-    double p_x_y = empirical_x_prob[f_it->get_pattern_x()] * get_cond_prob(f_it->get_pattern_x(), f_it->get_pattern_y());
-    like_sum += f_it->empirical_prob * log(p_x_y);
-    KL_sum += f_it->empirical_prob * log(f_it->empirical_prob/p_x_y);
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    double empirical_prob = candidate_features.empirical_prob[f_i];
+    int x_id = candidate_x_id[f_i];
+    double p_x_y = empirical_x_prob[x_id] * get_cond_prob(x_id, candidate_features.get_pattern_y(f_i));
+    like_sum += empirical_prob * log(p_x_y);
+    KL_sum += empirical_prob * log(empirical_prob/p_x_y);
     //entropy_sum -= p_x_y * log(p_x_y);
   }
 
@@ -881,63 +1435,92 @@ void MEModel::calc_likelihood(void)
   //std::cout << "H(P): " << entropy_sum << std::endl;
 }
 
-/* ゲイン計算で用いるQ(feature^(pow)|pattern_x)の計算 */
-double MEModel::calc_alpha_cond_E(int power, MEFeature *feature, std::vector<int> pattern_x, double alpha)
+/* Xの接尾辞索引を作る: 接尾辞 -> その接尾辞を持つxのIDのリスト.
+   素性(N_gram, pattern_x, y)が活性化するxは, pattern_xを接尾辞に持つxに限られる */
+void MEModel::build_x_suffix_index(void)
 {
-  double ret_sum;
-  std::set<int>::iterator y_it;
+  std::vector<std::pair<int,int> > entry; /* (接尾辞ID, xのID) */
+
+  x_suffix_index.clear();
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
+    const int *pattern_x = x_index.get_key(x_id);
+    int x_size = x_index.get_length(x_id);
+    for (int len = 0; len <= x_size; len++) {
+      int suffix_id = x_suffix_index.insert(pattern_x + (x_size-len), len);
+      entry.push_back(std::make_pair(suffix_id, x_id));
+    }
+  }
 
-  ret_sum = 0.0f;
-  double f_weight;
-  for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    f_weight = feature->checkget_weight(pattern_x, *y_it);
-    ret_sum += get_cond_prob(pattern_x, *y_it) * exp(alpha * f_weight) * pow(f_weight, power);
+  /* 接尾辞毎にCSR形式に詰める */
+  std::sort(entry.begin(), entry.end());
+  x_suffix_offset.assign(x_suffix_index.size()+1, 0);
+  x_suffix_list.resize(entry.size());
+  for (int e_i = 0; e_i < (int)entry.size(); e_i++) {
+    x_suffix_offset[entry[e_i].first+1]++;
+    x_suffix_list[e_i] = entry[e_i].second;
+  }
+  for (int s_i = 0; s_i < x_suffix_index.size(); s_i++) {
+    x_suffix_offset[s_i+1] += x_suffix_offset[s_i];
   }
 
-  return (ret_sum / calc_alpha_norm_factor(feature, pattern_x, alpha));
+  /* 素性候補毎に, 活性化するxのリストの位置(接尾辞ID)を持っておく */
+  candidate_suffix_id.resize(candidate_features.size());
+  for (int f_i = 0; f_i < candidate_features.size(); f_i++) {
+    candidate_suffix_id[f_i] = x_suffix_index.find(candidate_features.get_pattern_x(f_i), candidate_features.get_x_size(f_i));
+  }
 }
 
-/* ゲイン計算で用いる正規化項を計算 */
-double MEModel::calc_alpha_norm_factor(MEFeature *feature, std::vector<int> pattern_x, double alpha)
+/* ゲイン計算で用いるQ(feature^(pow)|pattern_x)の計算.
+   素性が活性化するxでのみ呼ぶ. 素性はy=pattern_yでのみ値weightを取るので, 
+   Q(f^pow|x) = P(pattern_y|x) weight^pow exp(alpha weight) / Z_alpha(x) */
+double MEModel::calc_alpha_cond_E(int power, double weight, double cond_prob_y, double alpha)
 {
-  double Z_alpha_x;
-  std::set<int>::iterator y_it;
-
-  Z_alpha_x = 0.0f;
-  for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-    Z_alpha_x += get_cond_prob(pattern_x, *y_it) * exp(alpha * feature->checkget_weight(pattern_x, *y_it));
-  }
+  return (cond_prob_y * exp(alpha * weight) * pow(weight, power)) / calc_alpha_norm_factor(weight, cond_prob_y, alpha);
+}
 
-  return Z_alpha_x;
+/* ゲイン計算で用いる正規化項を計算.
+   Σ_y P(y|x) = 1 より, Z_alpha(x) = 1 + P(pattern_y|x)(exp(alpha weight) - 1).
+   (素性が活性化しないxでは1) */
+double MEModel::calc_alpha_norm_factor(double weight, double cond_prob_y, double alpha)
+{
+  return 1.0f + cond_prob_y * (exp(alpha * weight) - 1.0f);
 }
 
-/* 引数の素性を加えた時のゲイン（対数尤度増分近似）を計算する 
+/* 引数の素性候補を加えた時のゲイン（対数尤度増分近似）を計算する.
+ * 素性が活性化しないxはG'(alpha), G''(alpha), ゲインのどれにも寄与しないので,
+ * 活性化するxでの現在のモデルの確率P(pattern_y|x)だけを最初に集めておき, ニュートン法はその上で回す.
  * BUG? FIXME:ゲイン値が負の値を取る時がある... そんなはずは無いのだが... -> 追加素性を外すとうまくいく(???) */
-double MEModel::calc_f_gain(MEFeature *feature)
+double MEModel::calc_f_gain(int f_index)
 {
   int fgain_iteration = 0;                    /* ニュートン法の更新回数 */
   double newton_sign_extern, newton_sign_inner;  /* ニュートン法の符号係数 */
   double alpha_n, alpha_change;               /* nステップのalphaとその変化量 */
   double g_pri, g_pripri;                     /* ゲインのalphaによる一階微分/二階微分 G'(alpha), G''(alpha) */
   double f_gain;                              /* ゲイン値 */
-  /* 素性, X, Yのイテレータ */
-  std::vector<MEFeature>::iterator      f_it;
-  std::set<std::vector<int> >::iterator x_it;
-  std::set<int>::iterator               y_it;
-  double empirical_E_f = feature->empirical_E;
+  double empirical_E_f = candidate_features.empirical_E[f_index];
+  double weight        = candidate_features.weight[f_index];
   double model_E_f;
+  std::vector<double> active_empirical_x; /* 素性が活性化するxの周辺経験分布P~(x) */
+  std::vector<double> active_cond_prob;   /* 素性が活性化するxでの現在のモデルの確率P(pattern_y|x) */
+
+  /* 素性が活性化するxと, そこでの現在のモデルの値を集める */
+  int suffix_id = candidate_suffix_id[f_index];
+  if (suffix_id != -1) {
+    int pattern_y = candidate_features.get_pattern_y(f_index);
+    for (int s_i = x_suffix_offset[suffix_id]; s_i < x_suffix_offset[suffix_id+1]; s_i++) {
+      int x_id = x_suffix_list[s_i];
+      active_empirical_x.push_back(empirical_x_prob[x_id]);
+      active_cond_prob.push_back(get_cond_prob(x_id, pattern_y));
+    }
+  }
+  int num_active = active_cond_prob.size();
 
   /* モデル期待値E[f]の計算 */
   model_E_f = 0.0f;
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-    double sum_y = 0.0f;
-    for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
-      sum_y
-        += get_cond_prob(*x_it, *y_it) * feature->checkget_weight(*x_it, *y_it);
-    }
-    model_E_f += sum_y * empirical_x_prob[*x_it];
+  for (int a_i = 0; a_i < num_active; a_i++) {
+    model_E_f += active_empirical_x[a_i] * active_cond_prob[a_i] * weight;
   }
-  // std::cout << "E[f] : " << model_E_f << " E~[f] : " << feature->empirical_E << std::endl;
+  // std::cout << "E[f] : " << model_E_f << " E~[f] : " << empirical_E_f << std::endl;
 
   /* 更新方向の決定 : E~[f] - E[f]の符号で決定 */
   if (empirical_E_f > model_E_f) {
@@ -952,9 +1535,10 @@ double MEModel::calc_f_gain(MEFeature *feature)
     /* G'(alpha), G''(alpha)の計算 */
     g_pri = empirical_E_f;
     g_pripri = 0.0f;
-    for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
-      g_pri    -= (empirical_x_prob[*x_it] * calc_alpha_cond_E(1, feature, *x_it, alpha_n));
-      g_pripri -= (empirical_x_prob[*x_it] * (calc_alpha_cond_E(2, feature, *x_it, alpha_n) - pow(calc_alpha_cond_E(1, feature, *x_it, alpha_n), 2)));
+    for (int a_i = 0; a_i < num_active; a_i++) {
+      double cond_E_1 = calc_alpha_cond_E(1, weight, active_cond_prob[a_i], alpha_n);
+      g_pri    -= (active_empirical_x[a_i] * cond_E_1);
+      g_pripri -= (active_empirical_x[a_i] * (calc_alpha_cond_E(2, weight, active_cond_prob[a_i], alpha_n) - pow(cond_E_1, 2)));
     }
     alpha_change = newton_sign_extern * log(1 + newton_sign_inner * (g_pri/g_pripri));
     /*
@@ -974,9 +1558,9 @@ double MEModel::calc_f_gain(MEFeature *feature)
 
   /* ゲイン計算 */
   f_gain = alpha_n * empirical_E_f;
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
+  for (int a_i = 0; a_i < num_active; a_i++) {
     f_gain
-      -= empirical_x_prob[*x_it] * log(calc_alpha_norm_factor(feature, *x_it, alpha_n));
+      -= active_empirical_x[a_i] * log(calc_alpha_norm_factor(weight, active_cond_prob[a_i], alpha_n));
   }
 
   return f_gain;
@@ -990,8 +1574,6 @@ void MEModel::feature_selection(void)
   std::set<int> is_added;                                      /* 素性が追加済みかどうかのフラグ */
   std::vector<double> f_gain(pattern_count);       /* 素性のゲイン（対数尤度近似増分） */
   std::vector<double> sorted_f_gain(pattern_count); /* 昇順に並べた素性ゲイン */
-  std::vector<MEFeature>::iterator       f_it;
-  std::set<std::vector<int> >::iterator  x_it;
   std::set<int>::iterator                y_it;
   std::vector<double> sorted_emE_list(pattern_count);
   double max_fgain;
@@ -1000,20 +1582,20 @@ void MEModel::feature_selection(void)
   /* モデル素性を一旦クリア */
   features.clear();
 
+  /* ゲイン計算用に, 素性候補が活性化するxを引けるようにしておく */
+  build_x_suffix_index();
+
   /* 候補素性が少なければ, 全ての候補素性をモデル素性とする */
   if (pattern_count < max_iteration_f_select/10) {
     std::cout << "All candidate features copy to model features. Because num. of candidate features too small." << std::endl;
-    features.reserve(pattern_count);
-    std::copy(candidate_features.begin(),
-              candidate_features.end(),
-              back_inserter(features));
+    features = candidate_features;
     learning();
     return;
   }
 
   /* 最初は経験期待値を頼りに, 候補素性の1割を追加 */
   for (int f_i = 0; f_i < pattern_count; f_i++) {
-    sorted_emE_list[f_i] = candidate_features[f_i].empirical_E;
+    sorted_emE_list[f_i] = candidate_features.empirical_E[f_i];
   }
   std::sort(sorted_emE_list.begin(), sorted_emE_list.end(), std::greater<double>());
   for (int top_i = 0; top_i < add_size; top_i++) {
@@ -1021,8 +1603,8 @@ void MEModel::feature_selection(void)
       if (is_added.count(f_i) == 1) 
         continue;
 
-      if (fabs(candidate_features[f_i].empirical_E - sorted_emE_list[top_i]) < DBL_EPSILON) {
-        features.push_back(candidate_features[f_i]);
+      if (fabs(candidate_features.empirical_E[f_i] - sorted_emE_list[top_i]) < DBL_EPSILON) {
+        features.push_back(candidate_features, f_i);
         is_added.insert(f_i);
         fsize_iteration++;
         break;
@@ -1034,27 +1616,32 @@ void MEModel::feature_selection(void)
   max_fgain = DBL_MAX;
   while (fsize_iteration < max_iteration_f_select 
       && max_fgain > epsilon_f_select) {
+    std::chrono::steady_clock::time_point round_start_time = std::chrono::steady_clock::now();
+
     /* まず, 現在の素性で学習 */
     learning();
 
-    /* 最大ゲイン（対数尤度増分近似）を与える素性を選ぶ */
-    max_fgain = 0.0f;
-    for (int f_index = 0; f_index < pattern_count; f_index++) {
+    /* 各候補素性のゲインを計算. ゲインは現在のモデルの下で互いに独立なので並列に計算する.
+       ニュートン法の収束の速さで候補毎の計算量が大きく違うので, ワークスティーリングで配る.
+       結果は候補のインデックスの位置に書くので, スレッド数によらず同じになる */
+    thread_pool->parallel_for_dynamic(pattern_count, [&](int f_index, int thread_id) {
       /* 既に加えられた素性ならば飛ばす */
       if (is_added.count(f_index) == 1) {
         f_gain[f_index] = sorted_f_gain[f_index] = 0.0f;
-        continue;
+        return;
       }
 
       /* ニュートン法によるゲイン計算/リストにセット */
-      f_gain[f_index] = sorted_f_gain[f_index] = calc_f_gain(&(candidate_features[f_index]));
+      f_gain[f_index] = sorted_f_gain[f_index] = calc_f_gain(f_index);
       //std::cout << "gain[" << f_index << "] : " << f_gain[f_index] << std::endl;
+    });
 
-      /* 最大ゲイン/インデックスの更新 */
+    /* 最大ゲイン（対数尤度増分近似）の取得 */
+    max_fgain = 0.0f;
+    for (int f_index = 0; f_index < pattern_count; f_index++) {
       if (f_gain[f_index] > max_fgain) {
         max_fgain = f_gain[f_index];
       }
-
     }
 
     /* 素性ゲインのソート. ゲイン上位add_sizeの素性を追加 */
@@ -1066,7 +1653,7 @@ void MEModel::feature_selection(void)
 
         /* 上位ゲインランキングに一致した素性をモデルに追加 */
         if (fabs(f_gain[fgain_inx] - sorted_f_gain[top_i]) < DBL_EPSILON) {
-          features.push_back(candidate_features[fgain_inx]);
+          features.push_back(candidate_features, fgain_inx);
           is_added.insert(fgain_inx);
           fsize_iteration++;
           break;
@@ -1076,6 +1663,7 @@ void MEModel::feature_selection(void)
     }
 
     std::cout << "Max gain : " << max_fgain << " Num. of features : " << features.size() << std::endl;
+    record_phase_time("feature_selection round", round_start_time);
 
   }
 
@@ -1084,31 +1672,417 @@ void MEModel::feature_selection(void)
 
 }
 
-/* 内部表現の整数から文字列に変換して返す
+/* 複数の文脈の上位ranking_sizeのyをまとめて求める. 文字列の符号化は文脈毎に1度だけ行う */
+void MEModel::get_ranking_batch(const std::vector<std::vector<std::string> > &contexts, int ranking_size,
+                                std::vector<int> &ranking_ids, std::vector<double> &ranking_probs,
+                                const std::vector<std::string> *targets, std::vector<double> *target_probs)
+{
+  std::vector<std::vector<int> > coded_contexts(contexts.size());
+  std::vector<int>               coded_targets;
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot == NULL) {
+    std::cerr << "Error : model is not learned yet." << std::endl;
+    ranking_ids.clear(); ranking_probs.clear();
+    return;
+  }
+
+  for (int c_i = 0; c_i < (int)contexts.size(); c_i++) {
+    coded_contexts[c_i] = snapshot->encode_pattern_x(contexts[c_i]);
+  }
+  if (targets != NULL) {
+    coded_targets.resize(targets->size());
+    for (int t_i = 0; t_i < (int)targets->size(); t_i++) {
+      coded_targets[t_i] = snapshot->encode_word((*targets)[t_i]);
+    }
+  }
+
+  snapshot->predict_batch(coded_contexts, ranking_size, ranking_ids, ranking_probs,
+                          (targets != NULL ? &coded_targets : NULL), target_probs,
+                          (thread_pool->get_num_threads() > 1 ? thread_pool : NULL));
+}
+
+/* 予測器の今のスナップショットを得る */
+std::shared_ptr<const MEPredictor> MEModel::get_predictor(void)
+{
+  return std::atomic_load(&predictor);
+}
+
+/* 予測の文脈キャッシュのヒット数, ミス数を取得する */
+void MEModel::get_cache_statistics(unsigned long *hits, unsigned long *misses)
+{
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot == NULL) {
+    *hits = *misses = 0;
+    return;
+  }
+  snapshot->get_cache_statistics(hits, misses);
+}
+
+/* 予測の文脈キャッシュを空にする */
+void MEModel::clear_cache(void)
+{
+  std::shared_ptr<const MEPredictor> snapshot = get_predictor();
+
+  if (snapshot != NULL) {
+    snapshot->clear_cache();
+  }
+}
+
+/* 内部表現の整数から文字列に変換して返す. 語彙表を定数時間で引く
  * 整数が見つからなかった場合はナル文字だけからなる文字列を返す */
 std::string MEModel::convert_pattern_to_string(int pattern)
 {
-  std::map<std::string, int>::iterator map_itr;
+  /* 語彙に無いID */
+  if (pattern < 0 || pattern >= vocabulary.size()) {
+    return "\0";
+  }
+
+  return vocabulary.get_string(pattern);
+
+}
+
+/* 学習済みのモデルをバイナリ形式でファイルに保存する.
+   形式（数値は全て実行環境のバイト順）:
+     識別子(8byte) 版数(int) maxN_gram(int) pattern_count_bias(int)
+     単語数(int) { ID(int) 長さ(int) 文字列 } ...
+     Yの要素数(int) { y(int) } ...
+     素性数(int) { N_gram(int) pattern_x(int * N_gram-1) pattern_y(int) count(int) is_marginal(int)
+                   weight parameter empirical_prob empirical_E model_E (double) } ...
+     Xの要素数(int) { 長さ(int) パターン(int * 長さ) } ...
+     P~(x)(double配列) Z(x)(double配列) Y(x)の先頭位置(int配列) Y(x)(int配列) P(y|x)(double配列) z(y)(double配列)
+     ファイル数(int) { パスの長さ(int) パス 更新時刻[ns](int64) サイズ(int64)
+                       単語数(int) { 長さ(int) 文字列 } ... パターン数(int) { 長さ(int) 局所単語ID(int * 長さ) 頻度(int) } ... } ...
+   配列は要素数(int)の後に要素を並べる.
+   最後は更新モード(update_model)用で, 読んだファイルの一覧とファイル毎のパターン頻度(カウントバイアス適用前).
+   素性候補と全ファイル分の頻度はこれから作り直せるので保存しない.
+   一時ファイル(filename + ".tmp")に書き切ってからrenameで置き換えるので, 途中で失敗しても元のファイルは残る */
+bool MEModel::save_model(std::string filename)
+{
+  std::string   temp_filename = filename + ".tmp";
+  std::ofstream out(temp_filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
 
-  /* パターンの値を持つ文字列(キー)を探す */
-	for (map_itr = word_map.begin();
-	     map_itr != word_map.end();
-	     map_itr++) {
-	  if (map_itr->second == pattern) {
-      return map_itr->first;
-	  }
-	}
+  if (!out) {
+    std::cerr << "Error : cannot open model file \"" << temp_filename << "\" for writing." << std::endl;
+    return false;
+  }
 
-  /* 発見されなかった */
-  return "\0";
+  /* ヘッダ */
+  out.write(MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+  write_int(out, MODEL_FILE_VERSION);
+  write_int(out, maxN_gram);
+  write_int(out, pattern_count_bias);
+
+  /* 語彙. IDの昇順に書く */
+  write_int(out, vocabulary.size());
+  for (int w_i = 0; w_i < vocabulary.size(); w_i++) {
+    write_int(out, w_i);
+    write_int(out, vocabulary.get_length(w_i));
+    out.write(vocabulary.get_word(w_i), vocabulary.get_length(w_i));
+  }
+  write_int_array(out, std::vector<int>(setY.begin(), setY.end()));
+
+  /* モデル素性 */
+  write_int(out, features.size());
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    const int *pattern_x = features.get_pattern_x(f_i);
+    write_int(out, features.get_N_gram(f_i));
+    for (int i = 0; i < features.get_x_size(f_i); i++) {
+      write_int(out, pattern_x[i]);
+    }
+    write_int(out, features.get_pattern_y(f_i));
+    write_int(out, features.count[f_i]);
+    write_int(out, features.is_marginal[f_i] ? 1 : 0);
+    write_double(out, features.weight[f_i]);
+    write_double(out, features.parameter[f_i]);
+    write_double(out, features.empirical_prob[f_i]);
+    write_double(out, features.empirical_E[f_i]);
+    write_double(out, features.model_E[f_i]);
+  }
 
+  /* Xパターンと, 計算済みの正規化項/条件付き確率/周辺素性の項 */
+  write_int(out, x_index.size());
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
+    write_int(out, x_index.get_length(x_id));
+    for (int i = 0; i < x_index.get_length(x_id); i++) {
+      write_int(out, x_index.get_key(x_id)[i]);
+    }
+  }
+  write_double_array(out, empirical_x_prob);
+  write_double_array(out, log_norm_factor);
+  write_int_array(out, setY_cond_offset);
+  write_int_array(out, setY_cond);
+  write_double_array(out, cond_prob);
+  write_double_array(out, marginal_energy_y);
+  write_double(out, log_marginal_factor);
+
+  /* 更新モード用: 読んだファイルの一覧とファイル毎のパターン頻度 */
+  write_int(out, file_manifest.size());
+  for (std::map<std::string, FileStamp>::iterator m_it = file_manifest.begin();
+       m_it != file_manifest.end();
+       m_it++) {
+    const CorpusShard &counts = file_counts[m_it->first];
+    write_int(out, m_it->first.size());
+    out.write(m_it->first.data(), m_it->first.size());
+    write_long(out, m_it->second.mtime);
+    write_long(out, m_it->second.size);
+    write_int(out, counts.local_vocabulary.size());
+    for (int w_i = 0; w_i < counts.local_vocabulary.size(); w_i++) {
+      write_int(out, counts.local_vocabulary.get_length(w_i));
+      out.write(counts.local_vocabulary.get_word(w_i), counts.local_vocabulary.get_length(w_i));
+    }
+    write_int(out, counts.local_pattern_index.size());
+    for (int p_i = 0; p_i < counts.local_pattern_index.size(); p_i++) {
+      write_int(out, counts.local_pattern_index.get_length(p_i));
+      for (int k_i = 0; k_i < counts.local_pattern_index.get_length(p_i); k_i++) {
+        write_int(out, counts.local_pattern_index.get_key(p_i)[k_i]);
+      }
+      write_int(out, counts.local_pattern_count[p_i]);
+    }
+  }
+
+  out.close();
+  if (!out) {
+    std::cerr << "Error : failed to write model file \"" << temp_filename << "\"." << std::endl;
+    unlink(temp_filename.c_str());
+    return false;
+  }
+  if (rename(temp_filename.c_str(), filename.c_str()) == -1) {
+    std::cerr << "Error : cannot replace model file \"" << filename << "\" : " << strerror(errno) << std::endl;
+    unlink(temp_filename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+/* 保存したモデルをファイルから読み込む.
+   ファイルをmmapし, 配列は領域からまとめてコピーする */
+bool MEModel::load_model(std::string filename)
+{
+  int fd;
+  struct stat file_stat;
+  void *map_addr;
+  ModelFileReader reader;
+  char magic[sizeof(MODEL_FILE_MAGIC)];
+
+  /* ファイルのマップ */
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+    std::cerr << "Error : cannot open model file \"" << filename << "\"." << std::endl;
+    if (fd != -1) close(fd);
+    return false;
+  }
+  map_addr = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map_addr == MAP_FAILED) {
+    std::cerr << "Error : cannot map model file \"" << filename << "\"." << std::endl;
+    return false;
+  }
+  reader.cursor   = (const char *)map_addr;
+  reader.end      = reader.cursor + file_stat.st_size;
+  reader.is_valid = true;
+
+  /* ヘッダの確認 */
+  read_bytes(&reader, magic, sizeof(magic));
+  if (!reader.is_valid || memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) != 0
+      || read_int(&reader) != (int)MODEL_FILE_VERSION) {
+    std::cerr << "Error : \"" << filename << "\" is not a model file of this version." << std::endl;
+    munmap(map_addr, file_stat.st_size);
+    return false;
+  }
+  /* Nグラム数とカウントバイアスはファイルのものを使う. 更新モードで同じ条件で素性候補を数え続けるため */
+  int file_maxN_gram  = read_int(&reader);
+  int file_count_bias = read_int(&reader);
+  if (!reader.is_valid || file_maxN_gram < 1) {
+    std::cerr << "Error : model file \"" << filename << "\" is broken." << std::endl;
+    munmap(map_addr, file_stat.st_size);
+    return false;
+  }
+  if (file_maxN_gram != maxN_gram || file_count_bias != pattern_count_bias) {
+    std::cout << "N_gram : " << file_maxN_gram << " Bias : " << file_count_bias << " (from \"" << filename << "\")" << std::endl;
+  }
+  maxN_gram          = file_maxN_gram;
+  pattern_count_bias = file_count_bias;
+
+  /* 語彙 */
+  int num_words = read_int(&reader);
+  vocabulary.clear();
+  for (int w_i = 0; w_i < num_words && reader.is_valid; w_i++) {
+    int word_id = read_int(&reader);
+    int length  = read_int(&reader);
+    if (length < 0 || length > reader.end - reader.cursor) {
+      reader.is_valid = false;
+      break;
+    }
+    /* IDは0から詰めて昇順に並んでいるはず */
+    if (vocabulary.insert(reader.cursor, length) != word_id) {
+      reader.is_valid = false;
+      break;
+    }
+    reader.cursor += length;
+  }
+  std::vector<int> y_list;
+  read_int_array(&reader, y_list);
+  setY = std::set<int>(y_list.begin(), y_list.end());
+  unique_word_no = setY.size();
+
+  /* モデル素性 */
+  int num_features = read_int(&reader);
+  features.clear();
+  for (int f_i = 0; f_i < num_features && reader.is_valid; f_i++) {
+    int N_gram = read_int(&reader);
+    if (N_gram < 1 || N_gram > maxN_gram) {
+      reader.is_valid = false;
+      break;
+    }
+    std::vector<int> pattern_x(N_gram-1);
+    for (int i = 0; i < N_gram-1; i++) {
+      pattern_x[i] = read_int(&reader);
+    }
+    int pattern_y = read_int(&reader);
+    int count     = read_int(&reader);
+    int f_index   = features.push_back(pattern_x.data(), N_gram-1, pattern_y, count);
+    features.is_marginal[f_index]    = (read_int(&reader) != 0);
+    features.weight[f_index]         = read_double(&reader);
+    features.parameter[f_index]      = read_double(&reader);
+    features.empirical_prob[f_index] = read_double(&reader);
+    features.empirical_E[f_index]    = read_double(&reader);
+    features.model_E[f_index]        = read_double(&reader);
+  }
+
+  /* Xパターンと計算済みの分布 */
+  int num_x = read_int(&reader);
+  x_index.clear();
+  std::vector<int> pattern_x;
+  for (int x_i = 0; x_i < num_x && reader.is_valid; x_i++) {
+    int length = read_int(&reader);
+    if (length < 0 || length >= maxN_gram) {
+      reader.is_valid = false;
+      break;
+    }
+    pattern_x.resize(length);
+    for (int i = 0; i < length; i++) {
+      pattern_x[i] = read_int(&reader);
+    }
+    x_index.insert(pattern_x);
+  }
+  read_double_array(&reader, empirical_x_prob);
+  read_double_array(&reader, log_norm_factor);
+  read_int_array(&reader, setY_cond_offset);
+  read_int_array(&reader, setY_cond);
+  read_double_array(&reader, cond_prob);
+  read_double_array(&reader, marginal_energy_y);
+  log_marginal_factor = read_double(&reader);
+
+  /* 更新モード用のファイル一覧とファイル毎のパターン頻度. 全体の頻度と素性候補は更新する時に作る */
+  int num_files = read_int(&reader);
+  file_manifest.clear();
+  file_counts.clear();
+  for (int file_i = 0; file_i < num_files && reader.is_valid; file_i++) {
+    int length = read_int(&reader);
+    if (length < 0 || length > reader.end - reader.cursor) {
+      reader.is_valid = false;
+      break;
+    }
+    std::string path(reader.cursor, length);
+    reader.cursor += length;
+    FileStamp stamp;
+    stamp.mtime = read_long(&reader);
+    stamp.size  = read_long(&reader);
+    file_manifest[path] = stamp;
+
+    CorpusShard &counts = file_counts[path];
+    counts.memory_size = 0;
+    int num_file_words = read_int(&reader);
+    for (int w_i = 0; w_i < num_file_words && reader.is_valid; w_i++) {
+      int word_length = read_int(&reader);
+      if (word_length < 0 || word_length > reader.end - reader.cursor
+          || counts.local_vocabulary.insert(reader.cursor, word_length) != w_i) {
+        reader.is_valid = false;
+        break;
+      }
+      reader.cursor += word_length;
+    }
+    int num_patterns = read_int(&reader);
+    std::vector<int> key;
+    for (int p_i = 0; p_i < num_patterns && reader.is_valid; p_i++) {
+      int key_length = read_int(&reader);
+      if (key_length < 1 || key_length > maxN_gram) {
+        reader.is_valid = false;
+        break;
+      }
+      key.resize(key_length);
+      for (int k_i = 0; k_i < key_length; k_i++) {
+        key[k_i] = read_int(&reader);
+      }
+      if (!is_in_range(key.data(), key_length, counts.local_vocabulary.size())
+          || counts.local_pattern_index.insert(key) != p_i) {
+        reader.is_valid = false;
+        break;
+      }
+      counts.local_pattern_count.push_back(read_int(&reader));
+      counts.memory_size += sizeof(int) + MEPatternIndex::memory_per_key(key_length);
+    }
+    counts.max_memory = counts.memory_size;
+  }
+  corpus_counts.local_vocabulary.clear();
+  corpus_counts.local_pattern_index.clear();
+  std::vector<int>().swap(corpus_counts.local_pattern_count);
+  corpus_counts.memory_size = 0;
+  candidate_features.clear();
+  candidate_index.clear();
+  candidate_memory_size = 0;
+  pattern_count         = 0;
+
+  munmap(map_addr, file_stat.st_size);
+
+  /* 表の大きさとIDの範囲の確認. 壊れたファイルで配列の外を引かないよう, 予測器を作る前に弾く */
+  int num_y = marginal_energy_y.size();
+  bool is_broken = !reader.is_valid
+    || (int)empirical_x_prob.size() != x_index.size()
+    || (int)log_norm_factor.size() != x_index.size()
+    || (int)setY_cond_offset.size() != x_index.size()+1
+    || setY_cond.size() != cond_prob.size()
+    || num_y > vocabulary.size()
+    || !is_in_range(y_list.data(), y_list.size(), num_y)
+    || !is_in_range(setY_cond.data(), setY_cond.size(), num_y);
+  if (!is_broken) {
+    /* setY_cond_offsetは0から単調に増えてsetY_condの末尾で終わる */
+    is_broken = (setY_cond_offset[0] != 0 || setY_cond_offset[x_index.size()] != (int)setY_cond.size());
+    for (int x_id = 0; x_id < x_index.size() && !is_broken; x_id++) {
+      is_broken = (setY_cond_offset[x_id] > setY_cond_offset[x_id+1]);
+    }
+  }
+  for (int x_id = 0; x_id < x_index.size() && !is_broken; x_id++) {
+    is_broken = !is_in_range(x_index.get_key(x_id), x_index.get_length(x_id), vocabulary.size());
+  }
+  for (int f_i = 0; f_i < features.size() && !is_broken; f_i++) {
+    is_broken = !is_in_range(features.get_pattern_x(f_i), features.get_x_size(f_i), vocabulary.size())
+      || features.get_pattern_y(f_i) < 0 || features.get_pattern_y(f_i) >= num_y;
+  }
+  if (is_broken) {
+    std::cerr << "Error : model file \"" << filename << "\" is broken." << std::endl;
+    return false;
+  }
+
+  /* 予測に使う索引を作り直す */
+  setY_marginal.clear();
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    if (features.is_marginal[f_i]) {
+      setY_marginal.insert(features.get_pattern_y(f_i));
+    }
+  }
+  build_activation_index();
+  rebuild_predictor();
+
+  return true;
 }
 
 /* 候補素性情報の印字 */
 void MEModel::print_candidate_features_info(void)
 {
-  std::vector<MEFeature>::iterator f_it;     /* 素性のイテレータ */  
-
   std::cout << "******** Candidate Feature's info ********" << std::endl;
   print_features_info(&candidate_features);
   std::cout << "There are " << candidate_features.size() << " candidate features." << std::endl;
@@ -1117,8 +2091,6 @@ void MEModel::print_candidate_features_info(void)
 /* モデル素性情報の印字 */
 void MEModel::print_model_features_info(void)
 {
-  std::vector<MEFeature>::iterator f_it;     /* 素性のイテレータ */  
-
   std::cout << "******** Model Feature's info ********" << std::endl;
   print_features_info(&features);
   std::cout << "There are " << features.size() << " model features." << std::endl;
@@ -1126,15 +2098,11 @@ void MEModel::print_model_features_info(void)
 }  
 
 /* 素性情報の印字(パターンを文字列で印字) */
-void MEModel::print_features_info(std::vector<MEFeature> *feature_list)
+void MEModel::print_features_info(const MEFeatureStore *feature_list)
 {
-  std::vector<MEFeature>::iterator f_it; /* 素性イテレータ */
-
-  for (f_it = (*feature_list).begin();
-       f_it != (*feature_list).end();
-       f_it++) {
-    int n_gram = f_it->get_N_gram();
-    std::vector<int> pattern_x = f_it->get_pattern_x();
+  for (int f_i = 0; f_i < feature_list->size(); f_i++) {
+    int n_gram = feature_list->get_N_gram(f_i);
+    const int *pattern_x = feature_list->get_pattern_x(f_i);
     std::cout << n_gram << "-gram model feature" << std::endl;
     std::cout << "Pattern X: ";
     if (n_gram > 1) {
@@ -1149,16 +2117,16 @@ void MEModel::print_features_info(std::vector<MEFeature> *feature_list)
     std::cout << std::endl;
 
     std::cout << "Pattern Y: " 
-      << convert_pattern_to_string(f_it->get_pattern_y())
+      << convert_pattern_to_string(feature_list->get_pattern_y(f_i))
       << std::endl;
-    std::cout << "Parameter: " << f_it->parameter << std::endl;
-    std::cout << "Weight: " << f_it->weight << std::endl;
-    std::cout << "Frequency count: " << f_it->count << std::endl;
-    std::cout << "Empirical prob.: " << f_it->empirical_prob << std::endl;
-    std::cout << "Empirical avg.: " << f_it->empirical_E << std::endl;
-    std::cout << "Model avg.: " << f_it->model_E << std::endl;
+    std::cout << "Parameter: " << feature_list->parameter[f_i] << std::endl;
+    std::cout << "Weight: " << feature_list->weight[f_i] << std::endl;
+    std::cout << "Frequency count: " << feature_list->count[f_i] << std::endl;
+    std::cout << "Empirical prob.: " << feature_list->empirical_prob[f_i] << std::endl;
+    std::cout << "Empirical avg.: " << feature_list->empirical_E[f_i] << std::endl;
+    std::cout << "Model avg.: " << feature_list->model_E[f_i] << std::endl;
     std::cout << "Marginal feature?: ";
-    if (f_it->is_marginal) {
+    if (feature_list->is_marginal[f_i]) {
       std::cout << "Yes" << std::endl;
     } else {
       std::cout << "No" << std::endl;
@@ -1172,20 +2140,20 @@ void MEModel::print_features_info(std::vector<MEFeature> *feature_list)
 /* モデルの条件付き確率分布を表示 */
 void MEModel::print_model_cond_prob(void)
 {
-  std::set<std::vector<int> >::iterator x_it;
-  std::set<int>::iterator               y_it;
+  std::set<int>::iterator y_it;
 
-  for (x_it = setX.begin(); x_it != setX.end(); x_it++) {
+  for (int x_id = 0; x_id < x_index.size(); x_id++) {
+    const int *pattern_x = x_index.get_key(x_id);
     for (y_it = setY.begin(); y_it != setY.end(); y_it++) {
       std::cout << "P(<";
       std::cout << convert_pattern_to_string(*y_it);
       std::cout << ">|";
-      for (int i = 0; i < (*x_it).size(); i++) {
+      for (int i = 0; i < x_index.get_length(x_id); i++) {
         std::cout << "<";
-        std::cout << convert_pattern_to_string((*x_it)[i]);
+        std::cout << convert_pattern_to_string(pattern_x[i]);
         std::cout << ">";
       }
-      std::cout << "): " << get_cond_prob(*x_it, *y_it) << std::endl;
+      std::cout << "): " << get_cond_prob(x_id, *y_it) << std::endl;
     }
   }
 }
@@ -1193,8 +2161,132 @@ void MEModel::print_model_cond_prob(void)
 /* (テスト用;for debug)候補素性をモデル素性にコピーする */
 void MEModel::copy_candidate_features_to_model_features(void)
 {
-  features.resize(candidate_features.size());
-  std::copy(candidate_features.begin(), candidate_features.end(),
-            features.begin());
+  features = candidate_features;
+}
+
+
+/* モデルファイルへ整数を書く */
+static void write_int(std::ofstream &out, int value)
+{
+  out.write((const char *)&value, sizeof(int));
+}
+
+/* モデルファイルへ64bit整数を書く */
+static void write_long(std::ofstream &out, long long value)
+{
+  out.write((const char *)&value, sizeof(long long));
+}
+
+/* モデルファイルへ実数を書く */
+static void write_double(std::ofstream &out, double value)
+{
+  out.write((const char *)&value, sizeof(double));
+}
+
+/* モデルファイルへ整数配列を書く: 要素数の後に要素を並べる */
+static void write_int_array(std::ofstream &out, const std::vector<int> &array)
+{
+  write_int(out, array.size());
+  if (!array.empty()) {
+    out.write((const char *)&array[0], array.size() * sizeof(int));
+  }
+}
+
+/* モデルファイルへ実数配列を書く */
+static void write_double_array(std::ofstream &out, const std::vector<double> &array)
+{
+  write_int(out, array.size());
+  if (!array.empty()) {
+    out.write((const char *)&array[0], array.size() * sizeof(double));
+  }
+}
+
+/* 読み込み位置からsizeバイトをdstにコピーして進める. 終端を越える時はis_validを落とす */
+static bool read_bytes(ModelFileReader *reader, void *dst, size_t size)
+{
+  if (!reader->is_valid || (size_t)(reader->end - reader->cursor) < size) {
+    reader->is_valid = false;
+    return false;
+  }
+  memcpy(dst, reader->cursor, size);
+  reader->cursor += size;
+  return true;
+}
+
+/* 整数を読む. 失敗時は0 */
+static int read_int(ModelFileReader *reader)
+{
+  int value = 0;
+  read_bytes(reader, &value, sizeof(int));
+  return value;
+}
+
+/* 64bit整数を読む. 失敗時は0 */
+static long long read_long(ModelFileReader *reader)
+{
+  long long value = 0;
+  read_bytes(reader, &value, sizeof(long long));
+  return value;
+}
+
+/* 実数を読む. 失敗時は0 */
+static double read_double(ModelFileReader *reader)
+{
+  double value = 0.0f;
+  read_bytes(reader, &value, sizeof(double));
+  return value;
+}
+
+/* 整数配列を読む */
+static void read_int_array(ModelFileReader *reader, std::vector<int> &array)
+{
+  int size = read_int(reader);
+  if (size < 0 || (size_t)(reader->end - reader->cursor) < size * sizeof(int)) {
+    reader->is_valid = false;
+    array.clear();
+    return;
+  }
+  array.resize(size);
+  if (size > 0) {
+    read_bytes(reader, &array[0], size * sizeof(int));
+  }
+}
+
+/* 実数配列を読む */
+static void read_double_array(ModelFileReader *reader, std::vector<double> &array)
+{
+  int size = read_int(reader);
+  if (size < 0 || (size_t)(reader->end - reader->cursor) < size * sizeof(double)) {
+    reader->is_valid = false;
+    array.clear();
+    return;
+  }
+  array.resize(size);
+  if (size > 0) {
+    read_bytes(reader, &array[0], size * sizeof(double));
+  }
+}
+
+/* ファイルの更新時刻[ns]とサイズを得る. 得られなければfalse */
+static bool get_file_stamp(const std::string &filename, long long *mtime, long long *size)
+{
+  struct stat file_stat;
+
+  if (stat(filename.c_str(), &file_stat) == -1) {
+    return false;
+  }
+  *mtime = (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+  *size  = (long long)file_stat.st_size;
+  return true;
 }
 
+/* IDの列idsが全て[0, limit)に入っていればtrue */
+static bool is_in_range(const int *ids, int size, int limit)
+{
+  for (int i = 0; i < size; i++) {
+    if (ids[i] < 0 || ids[i] >= limit) {
+      return false;
+    }
+  }
+  return true;
+}
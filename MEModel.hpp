@@ -11,8 +11,21 @@
 #include <set>
 #include <cstdlib>
 #include <algorithm>
+#include <chrono>
+#include <memory>
 
-#include "MEFeature.hpp"
+#include "MEFeatureStore.hpp"
+#include "MEPatternIndex.hpp"
+#include "METhreadPool.hpp"
+#include "MEVocabulary.hpp"
+#include "MEPredictor.hpp"
+#include "MEOptimizer.hpp"
+#include "MELBFGS.hpp"
+#include "MESGDTrainer.hpp"
+
+/* モデルファイルの識別子と版数 */
+const char         MODEL_FILE_MAGIC[8]  = {'M','E','M','O','D','E','L','\0'};
+const unsigned int MODEL_FILE_VERSION   = 6;
 
 /* 学習繰り返し回数・収束判定定数のデフォルト値 */
 const int    MAX_ITERATION_LEARN  = 1000;    /* 学習の最大繰り返し回数 */
@@ -21,30 +34,77 @@ const int    MAX_F_SIZE           = 2000;  /* 最大のモデル素性の数 */
 const double EPSILON_F_SELECTION  = 10e-4; /* 素性選択の収束判定値 */
 const int    MAX_ITERATION_FGAIN  = 100;   /* 素性の最大ゲイン（対数尤度近似）を求めるニュートン法の最大繰り返し回数 */
 const double EPSILON_FGAIN        = 10e-4; /* 素性の最大ゲインを求めるニュートン法の収束判定値 */
-const int    MAX_CANDIDATE_F_SIZE = 10000;  /* 学習データから得られる候補素性の最大数 */
+const size_t MAX_CANDIDATE_MEMORY = 512UL * 1024 * 1024; /* 学習データから得られる候補素性が使ってよいメモリ量[byte] */
+const double PRIOR_VARIANCE       = 1.0;   /* L-BFGS法で使うガウス事前分布の分散σ^2. 0以下なら事前分布を使わない */
 
 /* Maximum Entropy Model（最大エントロピーモデル）のモデルを表現するクラス */
 class MEModel {
+  friend class MEPredictor; /* 予測器は学習済みの素性と語彙から作る */
 private:
-  std::ifstream                              input_file;             /* 現在読み込み中のファイル */
-  std::string                                line_buffer;            /* 読み込みファイルの行文字列バッファ */
-  int                                        line_index;             /* 読み込みファイルの行文字列のインデックス. -1は改行時 */
+  /* L-BFGS法で最小化する目的関数: 事前分布付き(近似)条件付き対数尤度の符号反転 */
+  class LearningObjective : public MEObjective {
+  public:
+    std::vector<double>                   empirical_E;     /* モデル素性の経験期待値 E~[f_i] */
+    double                                prior_scale;     /* 事前分布の係数 1/(σ^2 N). 0なら事前分布なし */
+  private:
+    MEModel                              *model;           /* パラメタを書き込み, 期待値を計算するモデル */
+    std::chrono::steady_clock::time_point iteration_start; /* 現在の反復の開始時刻 */
+  public:
+    LearningObjective(MEModel *model);
+    double evaluate(const std::vector<double> &x, std::vector<double> &gradient);
+    bool progress(int iteration, const std::vector<double> &x, double value, double gradient_norm);
+  };
+
+  /* 読んだファイルの更新時刻とサイズ. 更新モードで変わったファイルを見分ける */
+  struct FileStamp {
+    long long mtime; /* 更新時刻[ns] */
+    long long size;  /* サイズ[byte] */
+  };
+
+  /* 学習データのパターン頻度(カウントバイアス適用前)の局所表. 1ファイル分(ファイル毎の頻度)か, 全ファイル分(頻度の和)を持つ.
+     単語とパターンには出現順に局所IDを振る. ファイルは別々の表に並列に読み, ファイル順に全ファイル分の表へ足す */
+  struct CorpusShard {
+    MEVocabulary     local_vocabulary;     /* 局所語彙表: 単語 -> 局所単語ID */
+    MEPatternIndex   local_pattern_index;  /* 局所パターン索引: 局所単語IDの(pattern_x, pattern_y) -> 局所パターンID */
+    std::vector<int> local_pattern_count;  /* 局所パターンID -> 頻度 */
+    size_t           memory_size;          /* 局所パターンが使用しているメモリ量（概算） */
+    size_t           max_memory;           /* 局所パターンが使ってよいメモリ量 */
+  };
+
   int                                        maxN_gram;              /* 最大Nグラムのサイズ */
-  std::vector<MEFeature>                     features;               /* モデルを構成する素性 */
-  std::vector<MEFeature>                     candidate_features;     /* 学習データから得られた素性候補 */
+  MEFeatureStore                             features;               /* モデルを構成する素性 */
+  MEPatternIndex                             activation_index;       /* 活性化索引: xの接尾辞(長さ0..maxN_gram-1) -> 接尾辞ID */
+  std::vector<int>                           activation_offset;      /* 接尾辞ID -> activation_y/activation_featureの先頭位置(CSR形式) */
+  std::vector<int>                           activation_y;           /* 接尾辞で活性化する素性のyパターン. 接尾辞毎にyの昇順 */
+  std::vector<int>                           activation_feature;     /* 接尾辞で活性化する素性のインデックス(features中の位置) */
+  MEFeatureStore                             candidate_features;     /* 学習データから得られた素性候補. corpus_countsのうちカウントバイアスを満たすパターン */
+  MEPatternIndex                             candidate_index;        /* 素性候補の索引. キーは(pattern_x, pattern_y)を連結したパターン(長さがN_gram) */
+  size_t                                     candidate_memory_size;  /* 素性候補が使用しているメモリ量（概算） */
+  size_t                                     max_candidate_memory;   /* パターン頻度が使ってよいメモリ量. 全体の頻度とファイル毎の頻度の合計はそれぞれこれ以内 */
   // std::map<std::vector<int>, double>         joint_prob;             /* 結合確率分布P(x,y)を表す配列. パターンはyを末尾にする. */
-  std::map<std::vector<int>, double>         cond_prob;              /* 条件付き確率分布P(y|x)を表す配列. こちらもパターンはyを末尾にする. */
-  std::map<std::vector<int>, double>         empirical_x_prob;       /* xの周辺経験分布P~(x) */
+  MEPatternIndex                             x_index;                /* 学習データに現れたXパターンの集合. パターンを密なID(xのID)に対応付ける */
+  std::vector<int>                           candidate_x_id;         /* 素性候補のpattern_xのID */
+  std::vector<double>                        empirical_x_prob;       /* xのID -> xの周辺経験分布P~(x) */
   /* 経験確率は素性から入手する */
-  std::map<std::string, int>                 word_map;               /* 単語と整数の対応をとる連想配列（ハッシュ） */
+  MEVocabulary                               vocabulary;             /* 単語と整数の対応をとる語彙表. 単語->ID はハッシュで, ID->単語は連結文字配列から定数時間で引く.
+                                                                        素性削除後はIDを0..unique_word_no-1に詰め直す */
   int                                        unique_word_no;         /* ユニークな単語の数(パターンYのサイズ) */
-  std::map<std::vector<int>, double>         norm_factor;            /* 正規化項Z(x). パターンを突っ込むと正規化項の値が得られるマップ */
+  std::vector<double>                        log_norm_factor;        /* xのID -> 正規化項の対数log Z(x) */
   double                                     joint_norm_factor;      /* 結合分布の正規化項Z */
-  std::set<std::vector<int> >                setX;                   /* 学習データに現れたXパターンの集合 */
   std::set<int>                              setY;
             /* 学習データに現れた単語（Yパターン）の集合 */
   std::set<int>                              setY_marginal;          /* 周辺素性を活性化させるyの集合Ym */
-  std::map<std::vector<int>, std::set<int> > setY_cond;              /* 条件付き素性を活性化させるyの集合Y(x) */
+  std::vector<double>                        marginal_energy_y;      /* y -> 周辺素性のエネルギーu(y) (z(y)=exp(u(y))). Yに無いyは-∞ */
+  double                                     log_marginal_factor;    /* 周辺素性のみによる正規化項の対数log Zm = log Σ_y z(y). xによらないので1度だけ求める */
+  /* 条件付き素性を活性化させるyの集合Y(x)と, その上の条件付き確率分布P(y|x)をCSR形式で持つ.
+     Y(x)に無いyの確率はexp(marginal_energy_y[y] - log_norm_factor[x])で得られる */
+  std::vector<int>                           setY_cond_offset;       /* xのID -> setY_cond/cond_probの先頭位置 */
+  std::vector<int>                           setY_cond;              /* 条件付き素性を活性化させるyの集合Y(x). x毎にyの昇順 */
+  std::vector<double>                        cond_prob;              /* Y(x)上の条件付き確率分布P(y|x) */
+  MEPatternIndex                             x_suffix_index;         /* Xの接尾辞索引: Xパターンの接尾辞 -> 接尾辞ID */
+  std::vector<int>                           x_suffix_offset;        /* 接尾辞ID -> x_suffix_listの先頭位置(CSR形式) */
+  std::vector<int>                           x_suffix_list;          /* 接尾辞を持つxのIDのリスト */
+  std::vector<int>                           candidate_suffix_id;    /* 素性候補のpattern_xの接尾辞ID. 素性候補が活性化するxのリストを指す */
   int                                        pattern_count;          /* 学習データに表れたパターン総数 */
   int                                        pattern_count_bias;     /* 1素性パターンのカウント閾値（これ以下の素性パターンは切り捨て） */
   double                                     epsilon_learn;          /* 学習収束判定用の小さな値 */
@@ -60,6 +120,18 @@ private:
   double                                     add_feature_model_E;     /* 追加素性のモデル期待値 */
   double                                     likelihood;             /* モデルの(近似)対数尤度 */ 
   double                                     KLdivergence;           /* 経験確率分布とモデル確率分布のKLダイバージェンス */
+  MEOptimizerType                            optimizer_type;         /* 学習に使う最適化手法 */
+  double                                     prior_variance;         /* L-BFGS法のガウス事前分布の分散σ^2. 0以下なら使わない */
+  std::map<std::string, FileStamp>           file_manifest;          /* 読んだファイル -> 読んだ時の更新時刻とサイズ */
+  std::map<std::string, CorpusShard>         file_counts;            /* 読んだファイル -> そのファイルのパターン頻度. 変わったファイルの前の分を差し引くのに使う */
+  CorpusShard                                corpus_counts;          /* 全ファイルのパターン頻度の和. 頻度0になったパターンも作り直すまで残る.
+                                                                        モデルファイルには保存せず, 読んだ後はfile_countsから作る */
+  double                                     l1_coefficient;         /* ストリーミング学習のL1正則化の係数 */
+  MESGDTrainer                              *sgd_trainer;            /* ストリーミング学習器. 最初のstream_learningで作り, 以降は続きから学習する */
+  METhreadPool                              *thread_pool;            /* 学習の並列化に使うスレッドプール */
+  std::vector<std::pair<std::string, double> > phase_times;         /* 学習の各段階の(名前, 所要時間[秒]). 段階の終わる順 */
+  std::shared_ptr<const MEPredictor>         predictor;              /* 予測器のスナップショット. 学習後/モデル読み込み後に作る. それまではNULL.
+                                                                        作った後は変更せず, std::atomic_load/atomic_storeでだけ読み書きする */
   /* 追加素性にパラメタはいるのか...? 経験確率/期待値は0なのは確実... */
 public:   
   /* コンストラクタ. maxN_gram以外はデフォルト値を付けておきたい */
@@ -72,36 +144,111 @@ public:
 
   /* 以下, メソッド */
 public:
-  /* ファイル名の配列を受け取り, 一気に読み込ませる. 経験確率/経験期待値をセット/更新する */
-  void read_file_str_list(std::vector<std::string> filenames);
-  /* 拡張反復スケーリング法で素性パラメタの学習を行う */
-  void learning(void);
+  /* ファイル名の配列を受け取り, 一気に読み込ませる. ファイル毎のパターン頻度を記録し, 経験確率/経験期待値をセット/更新する.
+     カウントバイアスを満たす素性パターンが1つも無ければfalse */
+  bool read_file_str_list(std::vector<std::string> filenames);
+  /* パターン頻度(素性候補の元)が使ってよいメモリ量[byte]をセットする */
+  void set_candidate_memory_budget(size_t budget);
+  /* 学習に使うスレッド数をセットする */
+  void set_num_threads(int num_threads);
+  /* 学習に使う最適化手法(GIS, L-BFGS)をセットする. デフォルトはGIS */
+  void set_optimizer(MEOptimizerType optimizer_type);
+  /* L-BFGS法で使うガウス事前分布の分散σ^2をセットする. 0以下なら事前分布を使わない */
+  void set_prior_variance(double prior_variance);
+  /* ストリーミング学習のL1正則化の係数をセットする */
+  void set_l1_coefficient(double l1_coefficient);
+  /* 選んだ最適化手法で素性パラメタの学習を行う. warm_startなら今のパラメタから始める(0に戻さない) */
+  void learning(bool warm_start=false);
+  /* 更新モード. 読み込んだモデルに, 前回から追加/変更されたファイルだけを読み直して反映し, 今のパラメタから学習し直す.
+     変更/削除されたファイルは, ファイル毎に持つ前回の頻度を差し引く.
+     更新できないモデル(ファイル毎の頻度を持たない)か, 反映して素性パターンが残らなければfalse.
+     falseの時は予測器を差し替えず, 読む前の状態のまま */
+  bool update_model(std::vector<std::string> filenames);
+  /* ファイルの単語列を流し込み, ミニバッチSGD(累積L1正則化)で学習する.
+     素性候補を作らず, 素性数は素性候補のメモリ量の予算で打ち切る. 続けて呼ぶと前回の続きから学習する */
+  void stream_learning(std::vector<std::string> filenames);
   /* 素性選択を行う */
   void feature_selection(void);
   /* 引数の文字列パターンの条件付き確率P(y|x)を計算する */
   double get_cond_prob_from_str(std::vector<std::string> pattern_x, std::string pattern_y);
   /* 引数のxの文字列パターンから, 最も確率の高いyを予測として返す */
   std::string predict_y(std::vector<std::string> pattern_x);
-  /* 上位ranking_sizeの確率のyを返す */
-  std::vector<std::string> get_ranking(std::vector<std::string> pattern_x, int ranking_size);
+  /* 上位ranking_sizeの確率のyを, (単語ID, 確率)の組で確率の降順に返す. 同じ確率の時はIDの小さい順.
+     単語IDはconvert_pattern_to_stringで文字列に直せる. 予測はxで活性化する条件付き素性のyだけを計算する */
+  std::vector<std::pair<int, double> > get_ranking(std::vector<std::string> pattern_x, int ranking_size);
+  /* 文脈(xの文字列パターン)を最大max_length語まで伸ばす単語列を幅beam_widthのビーム探索で求め,
+     上位num_results個を(単語列, 確率)の組で確率の降順に返す. 単語列はstop_wordsの単語を出した所で終わる */
+  std::vector<std::pair<std::vector<std::string>, double> >
+    get_completions(std::vector<std::string> pattern_x, int max_length, int beam_width=COMPLETION_BEAM_WIDTH,
+                    int num_results=COMPLETION_RESULTS, const std::set<std::string> &stop_words=std::set<std::string>());
+  /* 複数の文脈(xの文字列パターン)の上位ranking_sizeのyをまとめて求める. 文脈は学習に使うスレッド数で並列に計算する.
+     i番目の文脈の第r位の単語IDと確率を(ranking_ids, ranking_probs)[i*ranking_size + r]に書く(足りなければIDは-1).
+     targetsを与えると, target_probs[i]に正解targets[i]の条件付き確率を書く.
+     targetsはcontextsと同じ長さで, target_probsも与えること(満たさなければエラーを出して結果を空にする) */
+  void get_ranking_batch(const std::vector<std::vector<std::string> > &contexts, int ranking_size,
+                         std::vector<int> &ranking_ids, std::vector<double> &ranking_probs,
+                         const std::vector<std::string> *targets=NULL, std::vector<double> *target_probs=NULL);
+  /* 内部表現の整数から文字列に変換して返す */
+  std::string convert_pattern_to_string(int pattern);
+  /* 予測器の今のスナップショットを得る. 学習前ならNULL. 学習し直すと新しいスナップショットに差し替わるが,
+     得たスナップショットは持っている間は変わらず有効. 学習中に別のスレッドから呼んでもよい */
+  std::shared_ptr<const MEPredictor> get_predictor(void);
+  /* 予測の文脈キャッシュのヒット数, ミス数を取得する. パラメタが変わるとキャッシュと共に0に戻る */
+  void get_cache_statistics(unsigned long *hits, unsigned long *misses);
+  /* 予測の文脈キャッシュを空にし, ヒット数, ミス数も0に戻す. キャッシュに載っていない問い合わせの遅延を測る時に使う */
+  void clear_cache(void);
+  /* 学習済みのモデルをバイナリ形式でファイルに保存する. 成功すればtrue. 失敗しても元のファイルは壊さない */
+  bool save_model(std::string filename);
+  /* 保存したモデルをファイルから読み込む(mmapで読む). 成功すればtrue.
+     Nグラム数とカウントバイアスはコンストラクタで与えた値ではなくファイルの値になる */
+  bool load_model(std::string filename);
+  /* 学習の各段階の(名前, 所要時間[秒])を得る. 同じ名前の段階(素性選択の各回, 学習の各反復)は複数回現れる */
+  const std::vector<std::pair<std::string, double> > &get_phase_times(void);
   /* 候補素性情報の印字 */
   void print_candidate_features_info(void);
   /* モデル素性情報の印字 */
   void print_model_features_info(void);
  
 private:
-  /* 現在読み込み中のファイルから次の単語を返すサブルーチン */
-  std::string next_word(void);
-  /* ファイルから単語列を読み取り, 素性候補, 素性カウント, 単語マップを更新する. */
-  void read_file(std::string filename);
-  /* 内部表現のパターンから条件付き確率を得る. 未知のXパターンに対処 */
-  double get_cond_prob(std::vector<int> pattern_x, int pattern_y);
-  /* 経験確率と経験期待値を素性にセット/更新する */
-  void set_empirical_prob_E(void);
+  /* ファイルから単語列を読み取り, 局所表の語彙とパターンの頻度を更新する. */
+  void read_file(std::string filename, CorpusShard &shard);
+  /* パターン頻度countsを全体の頻度corpus_countsに足す(sign=1)/差し引く(sign=-1). ファイル順に足せば逐次に読んだ場合と同じIDになる */
+  void add_pattern_counts(const CorpusShard &counts, int sign);
+  /* ファイル毎の頻度から全体の頻度を作り直す */
+  void rebuild_corpus_counts(void);
+  /* read_filesを読んでファイル毎の頻度を入れ替え, removed_filesの頻度を捨て, 全体の頻度に差分を反映する.
+     カウントバイアスを満たすパターンが残らなければ元に戻してfalse */
+  bool update_pattern_counts(const std::vector<std::string> &read_files, const std::vector<std::string> &removed_files);
+  /* 全体の頻度のうちカウントバイアスを満たすパターンを素性候補にし, 経験確率/経験期待値をセットする */
+  bool build_candidate_features(void);
+  /* 素性候補の索引を作り直す */
+  void rebuild_candidate_index(void);
+  /* 素性候補に現れる単語だけを残して単語IDを詰め直し, 素性候補のパターンを付け替える */
+  void compact_vocabulary(void);
+  /* 現在のパラメタから予測器を作り直し, スナップショットを差し替える */
+  void rebuild_predictor(void);
+  /* start_timeから今までの時間を段階nameの所要時間として記録する */
+  void record_phase_time(const std::string &name, std::chrono::steady_clock::time_point start_time);
+  /* xのIDから条件付き確率を得る */
+  double get_cond_prob(int x_id, int pattern_y);
+  /* xのIDからXパターンを得る */
+  std::vector<int> get_x_pattern(int x_id);
+  /* 経験確率と経験期待値を素性にセット/更新する. 頻度総数が0ならfalse */
+  bool set_empirical_prob_E(void);
   /* モデルの確率分布の計算. 正規化項と素性の期待値の計算も同時に行う. */
   void calc_model_prob(void);
+  /* 一般化反復スケーリング法(GIS)によるパラメタ学習 */
+  void learning_gis(void);
+  /* L-BFGS法によるパラメタ学習 */
+  void learning_lbfgs(void);
+  /* モデル素性の経験期待値 Σ_{x,y} P~(x,y) f_i(x,y) を求める */
+  void calc_feature_empirical_E(std::vector<double> &empirical_E);
   /* 学習のセットアップ. 周辺素性のフラグ立てやYの分割 */
   void setup_learning(void);
+  /* モデル素性から活性化索引を作る */
+  void build_activation_index(void);
+  /* x(長さx_size)の長さmin_suffix以上の接尾辞で活性化しうる素性のインデックスをactiveに追加する */
+  void get_active_features(const int *test_x, int x_size, int min_suffix, std::vector<int> &active);
   /* 周辺素性フラグのセット/更新 */
   void set_marginal_flag(void);
   /* 周辺素性を活性化させる要素の集合Ym, 条件付き素性を活性化させる集合Y(x)のセット */
@@ -109,25 +256,25 @@ private:
   /* 追加素性の重みを引数パターンから得る */
   double get_add_feature_weight(std::vector<int> pattern_x, int pattern_y);
   /* 引数のパターンでの, 全てのモデル素性の(パラメタ*重み)和を計算して返す */
-  double get_sum_param_weight(std::vector<int> test_x, int test_y);
-  /* 正規化項を計算してmapに結果をセットする */
+  double get_sum_param_weight(const std::vector<int> &test_x, int test_y);
+  /* 正規化項の対数log Z(x)を計算してlog_norm_factorにセットする */
   void calc_normalized_factor(void);
+  /* 周辺素性のエネルギーから正規化項の対数log Zmを計算してlog_marginal_factorにセットする */
+  void calc_log_marginal_factor(void);
   /* 素性重みの総和を定数にする追加素性f_[n+1]の追加 */
   void calc_additive_features_weight(void);
+  /* Xの接尾辞索引の作成 */
+  void build_x_suffix_index(void);
   /* ゲイン計算で用いるQ(feature^(pow)|pattern_x)を計算するサブルーチン */
-  double calc_alpha_cond_E(int pow, MEFeature *feature, std::vector<int> pattern_x, double alpha);
+  double calc_alpha_cond_E(int pow, double weight, double cond_prob_y, double alpha);
   /* ゲイン計算で用いる正規化項を計算するサブルーチン */
-  double calc_alpha_norm_factor(MEFeature *feature, std::vector<int> pattern_x, double alpha);
-  /* 引数の素性を加えた時のゲイン（対数尤度増分近似）を計算する */
-  double calc_f_gain(MEFeature *feature);
+  double calc_alpha_norm_factor(double weight, double cond_prob_y, double alpha);
+  /* 素性候補(インデックス)を加えた時のゲイン（対数尤度増分近似）を計算する */
+  double calc_f_gain(int f_index);
   /* 対数尤度の計算, セット */
   void calc_likelihood(void);
-  /* ゲイン計算で用いる素性追加時の素性の期待値を計算するサブルーチン */
-  double calc_alpha_E(MEFeature feature, double alpha);
-  /* 内部表現の整数から文字列に変換して返す */
-  std::string convert_pattern_to_string(int pattern);
   /* 素性情報の印字(パターンを文字列で) */
-  void print_features_info(std::vector<MEFeature> *feature_list);
+  void print_features_info(const MEFeatureStore *feature_list);
   /* モデルの確率分布を表示 */
   void print_model_cond_prob(void);
   /* (テスト用)候補素性をモデル素性にコピーする */
@@ -0,0 +1,35 @@
+#ifndef MEOPTIMIZER_H_INCLUDED
+#define MEOPTIMIZER_H_INCLUDED
+
+#include <vector>
+
+/* 学習に使う最適化手法 */
+enum MEOptimizerType {
+  OPTIMIZER_GIS,   /* 一般化反復スケーリング法 */
+  OPTIMIZER_LBFGS  /* 記憶制限付きBFGS法 */
+};
+
+/* 最適化する目的関数. 最適化手法はパラメタ列xでの値と勾配だけを使う */
+class MEObjective {
+public:
+  virtual ~MEObjective(void) {}
+
+  /* xでの目的関数の値を返し, 勾配をgradientにセットする(gradientはxと同じ長さに揃えてある) */
+  virtual double evaluate(const std::vector<double> &x, std::vector<double> &gradient) = 0;
+  /* 最適化の1反復が終わる度に, 受理したxと値, 勾配のノルムを受け取る. falseを返すと最適化を打ち切る */
+  virtual bool progress(int iteration, const std::vector<double> &x, double value, double gradient_norm)
+  {
+    return true;
+  }
+};
+
+/* 勾配を使う最適化手法のインタフェース. 目的関数を最小化する */
+class MEOptimizer {
+public:
+  virtual ~MEOptimizer(void) {}
+
+  /* xを初期値としてobjectiveを最小化し, 最後に受理したxを返す. 収束判定を満たして終わればtrue */
+  virtual bool minimize(MEObjective &objective, std::vector<double> &x) = 0;
+};
+
+#endif /* MEOPTIMIZER_H_INCLUDED */
@@ -0,0 +1,183 @@
+#include "MEPatternIndex.hpp"
+
+/* 初期スロット数（2の冪） */
+static const unsigned int INITIAL_NUM_SLOTS = 16;
+
+/* コンストラクタ */
+MEPatternIndex::MEPatternIndex(void)
+{
+  clear();
+}
+
+/* デストラクタ */
+MEPatternIndex::~MEPatternIndex(void) { ; }
+
+/* キーのハッシュ値. 要素毎に混ぜ合わせ, 最後に長さも混ぜる（長さ違いの同じ並びを区別する） */
+unsigned int MEPatternIndex::hash(const int *key, int length)
+{
+  unsigned int h = 2166136261u;
+
+  for (int i = 0; i < length; i++) {
+    unsigned int k = (unsigned int)key[i];
+    k *= 0xcc9e2d51u; k = (k << 15) | (k >> 17); k *= 0x1b873593u;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    h = h * 5 + 0xe6546b64u;
+  }
+
+  /* 最終的な撹拌 */
+  h ^= (unsigned int)length;
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* IDのキーと引数のキーが一致するか */
+bool MEPatternIndex::equal_key(int id, const int *key, int length) const
+{
+  if (key_offset[id+1] - key_offset[id] != length) {
+    return false;
+  }
+
+  const int *id_key = &key_pool[0] + key_offset[id];
+  for (int i = 0; i < length; i++) {
+    if (id_key[i] != key[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* キーを探し, IDを返す. 見つからなければ-1 */
+int MEPatternIndex::find(const int *key, int length) const
+{
+  unsigned int h    = hash(key, length);
+  unsigned int slot = h & table_mask;
+
+  /* 空きスロットに当たるまで線形探査 */
+  while (table[slot] != -1) {
+    int id = table[slot];
+    if (key_hash[id] == h && equal_key(id, key, length)) {
+      return id;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+
+  return -1;
+}
+
+int MEPatternIndex::find(const std::vector<int> &key) const
+{
+  return find(key.empty() ? NULL : &key[0], (int)key.size());
+}
+
+/* キーを登録してIDを返す */
+int MEPatternIndex::insert(const int *key, int length)
+{
+  unsigned int h    = hash(key, length);
+  unsigned int slot = h & table_mask;
+
+  /* 既に登録されていないか探査 */
+  while (table[slot] != -1) {
+    int id = table[slot];
+    if (key_hash[id] == h && equal_key(id, key, length)) {
+      return id;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+
+  /* 新しいIDを割り当て, キーを連結配列の末尾に追加 */
+  int new_id = size();
+  key_pool.insert(key_pool.end(), key, key + length);
+  key_offset.push_back((int)key_pool.size());
+  key_hash.push_back(h);
+  table[slot] = new_id;
+
+  /* 負荷率が1/2を超えたらスロット数を倍にする */
+  if ((unsigned int)size() * 2 > table_mask + 1) {
+    rehash((table_mask + 1) * 2);
+  }
+
+  return new_id;
+}
+
+int MEPatternIndex::insert(const std::vector<int> &key)
+{
+  return insert(key.empty() ? NULL : &key[0], (int)key.size());
+}
+
+/* 登録されているキーの数 */
+int MEPatternIndex::size(void) const
+{
+  return (int)key_hash.size();
+}
+
+/* IDからキーの先頭を取得 */
+const int *MEPatternIndex::get_key(int id) const
+{
+  return (key_pool.empty() ? NULL : &key_pool[0] + key_offset[id]);
+}
+
+/* IDからキーの長さを取得 */
+int MEPatternIndex::get_length(int id) const
+{
+  return key_offset[id+1] - key_offset[id];
+}
+
+/* 全てのキーを削除 */
+void MEPatternIndex::clear(void)
+{
+  key_pool.clear();
+  key_offset.assign(1, 0);
+  key_hash.clear();
+  table.assign(INITIAL_NUM_SLOTS, -1);
+  table_mask = INITIAL_NUM_SLOTS - 1;
+}
+
+/* num_keys個のキーを再ハッシュ無しで登録できるようにする */
+void MEPatternIndex::reserve(int num_keys)
+{
+  unsigned int num_slots = table_mask + 1;
+
+  while (num_slots < (unsigned int)num_keys * 2 + 2) {
+    num_slots *= 2;
+  }
+  if (num_slots != table_mask + 1) {
+    rehash(num_slots);
+  }
+  key_offset.reserve(num_keys + 1);
+  key_hash.reserve(num_keys);
+}
+
+/* スロット数を変えて全キーを再配置 */
+void MEPatternIndex::rehash(unsigned int num_slots)
+{
+  table.assign(num_slots, -1);
+  table_mask = num_slots - 1;
+
+  for (int id = 0; id < size(); id++) {
+    unsigned int slot = key_hash[id] & table_mask;
+    while (table[slot] != -1) {
+      slot = (slot + 1) & table_mask;
+    }
+    table[slot] = id;
+  }
+}
+
+/* 使用しているメモリ量（概算） */
+size_t MEPatternIndex::memory_size(void) const
+{
+  return key_pool.capacity() * sizeof(int)
+    + key_offset.capacity() * sizeof(int)
+    + key_hash.capacity() * sizeof(unsigned int)
+    + table.capacity() * sizeof(int);
+}
+
+/* キー1つあたりのメモリ量（概算）. スロットは負荷率1/2以下なので最大4つ分を見込む */
+size_t MEPatternIndex::memory_per_key(int length)
+{
+  return length * sizeof(int) + sizeof(int) + sizeof(unsigned int) + 4 * sizeof(int);
+}
@@ -0,0 +1,53 @@
+#ifndef MEPATTERNINDEX_H_INCLUDED
+#define MEPATTERNINDEX_H_INCLUDED
+
+#include <vector>
+#include <cstddef>
+
+/* 整数列のパターン（単語IDのNグラム等）を, 密な整数ID(0,1,2,...)に対応付けるハッシュ表.
+   オープンアドレス法（線形探査）で, キーは1本の配列に連結して格納する（キー毎のヒープ確保をしない）.
+   IDは挿入順に振られ, 削除はできない（必要ならclearして作り直す） */
+class MEPatternIndex {
+private:
+  std::vector<int>          key_pool;   /* 全キーを連結した配列 */
+  std::vector<int>          key_offset; /* ID -> key_pool中のキーの先頭位置. 末尾に番兵を持つ(size()+1要素) */
+  std::vector<unsigned int> key_hash;   /* ID -> キーのハッシュ値. 再ハッシュと比較の高速化用 */
+  std::vector<int>          table;      /* スロット -> ID. 空きスロットは-1 */
+  unsigned int              table_mask; /* スロット数-1 (スロット数は2の冪) */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  MEPatternIndex(void);
+  ~MEPatternIndex(void);
+
+  /* キーを探し, IDを返す. 登録されていなければ-1を返す */
+  int find(const int *key, int length) const;
+  int find(const std::vector<int> &key) const;
+  /* キーを登録してIDを返す. 既に登録されていれば既存のIDを返す */
+  int insert(const int *key, int length);
+  int insert(const std::vector<int> &key);
+  /* 登録されているキーの数 */
+  int size(void) const;
+  /* IDからキーを取得する */
+  const int *get_key(int id) const;
+  int get_length(int id) const;
+  /* 全てのキーを削除 */
+  void clear(void);
+  /* 少なくともnum_keys個のキーを再ハッシュ無しで登録できるように領域を確保 */
+  void reserve(int num_keys);
+  /* 使用しているメモリ量[byte]（概算） */
+  size_t memory_size(void) const;
+  /* キー1つあたりに必要なメモリ量[byte]（概算. メモリ予算の見積もり用） */
+  static size_t memory_per_key(int length);
+
+private:
+  /* キーのハッシュ値 */
+  static unsigned int hash(const int *key, int length);
+  /* IDのキーと引数のキーが一致するか */
+  bool equal_key(int id, const int *key, int length) const;
+  /* スロット数を変えて全キーを再配置 */
+  void rehash(unsigned int num_slots);
+
+};
+
+#endif /* MEPATTERNINDEX_H_INCLUDED */
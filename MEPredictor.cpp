@@ -0,0 +1,508 @@
+#include "MEPredictor.hpp"
+#include "MEModel.hpp"
+
+/* ランキングの順序: 確率の降順. 同じ確率ならIDの小さい順 */
+static bool ranking_order(const std::pair<int, double> &a, const std::pair<int, double> &b)
+{
+  if (a.second != b.second) {
+    return a.second > b.second;
+  }
+  return a.first < b.first;
+}
+
+/* yの昇順 */
+static bool y_order(const std::pair<int, double> &a, const std::pair<int, double> &b)
+{
+  return a.first < b.first;
+}
+
+/* コンストラクタ */
+MEPredictor::MEPredictor(const MEModel &model, size_t cache_size)
+  : context_cache(cache_size)
+{
+  std::vector<std::pair<std::pair<int, int>, double> > entry; /* ((接尾辞ID, y), エネルギー) */
+  std::set<int>::const_iterator y_it;
+
+  maxN_gram  = model.maxN_gram;
+  vocabulary = model.vocabulary;
+
+  /* 周辺素性のエネルギーと, 条件付き素性の接尾辞毎のエネルギー */
+  int y_size = model.setY.empty() ? 0 : *model.setY.rbegin()+1;
+  std::vector<double> energy_z_y(y_size, 0.0f);
+  const MEFeatureStore &features = model.features;
+  for (int f_i = 0; f_i < features.size(); f_i++) {
+    double energy = features.parameter[f_i] * features.weight[f_i];
+    if (features.get_N_gram(f_i) == 1) {
+      energy_z_y[features.get_pattern_y(f_i)] += energy;
+    } else {
+      int suffix_id = suffix_index.insert(features.get_pattern_x(f_i), features.get_x_size(f_i));
+      entry.push_back(std::make_pair(std::make_pair(suffix_id, features.get_pattern_y(f_i)),
+                                     energy));
+    }
+  }
+
+  /* u(y)とlog Zm. 周辺素性が活性化しないyのu(y)は0, 学習データに無いyは-∞.
+     log Zmは最大のエネルギーで割ってから足して求める */
+  marginal_energy_y.assign(y_size, -HUGE_VAL);
+  double max_energy = -HUGE_VAL;
+  for (y_it = model.setY.begin(); y_it != model.setY.end(); y_it++) {
+    marginal_energy_y[*y_it] = energy_z_y[*y_it];
+    max_energy = std::max(max_energy, energy_z_y[*y_it]);
+  }
+  double sum_z = 0.0f;
+  for (y_it = model.setY.begin(); y_it != model.setY.end(); y_it++) {
+    sum_z += exp(marginal_energy_y[*y_it] - max_energy);
+  }
+  log_marginal_factor = max_energy + log(sum_z);
+
+  /* z(y)の降順リスト */
+  std::vector<std::pair<int, double> > marginal_list;
+  for (y_it = model.setY.begin(); y_it != model.setY.end(); y_it++) {
+    marginal_list.push_back(std::make_pair(*y_it, exp(marginal_energy_y[*y_it] - log_marginal_factor)));
+  }
+  std::sort(marginal_list.begin(), marginal_list.end(), ranking_order);
+  marginal_ranking.resize(marginal_list.size());
+  for (int r_i = 0; r_i < (int)marginal_list.size(); r_i++) {
+    marginal_ranking[r_i] = marginal_list[r_i].first;
+  }
+
+  /* 接尾辞, yの順に並べてCSR形式に詰める */
+  std::sort(entry.begin(), entry.end());
+  suffix_offset.assign(suffix_index.size()+1, 0);
+  suffix_y.resize(entry.size());
+  suffix_energy.resize(entry.size());
+  for (int e_i = 0; e_i < (int)entry.size(); e_i++) {
+    suffix_offset[entry[e_i].first.first+1]++;
+    suffix_y[e_i]      = entry[e_i].first.second;
+    suffix_energy[e_i] = entry[e_i].second;
+  }
+  for (int s_i = 0; s_i < suffix_index.size(); s_i++) {
+    suffix_offset[s_i+1] += suffix_offset[s_i];
+  }
+}
+
+/* デストラクタ */
+MEPredictor::~MEPredictor(void) { ; }
+
+/* 文字列のxパターンを内部表現（整数列）に直す.
+   最長(maxN_gram-1)語のパターンに変換し, pattern_x.size() < maxN_gram-1 の場合は長さはpattern_x.size()に合わせる.
+   語彙に無い単語は-1にする（どの素性も活性化させない） */
+std::vector<int> MEPredictor::encode_pattern_x(const std::vector<std::string> &pattern_x) const
+{
+  std::vector<int> coded_x;
+
+  for (int i = 0; i < (int)pattern_x.size(); i++) {
+    if (i < (int)pattern_x.size()-(maxN_gram-1)) {
+      continue;
+    }
+    coded_x.push_back(vocabulary.find(pattern_x[i]));
+  }
+
+  return coded_x;
+}
+
+/* 単語の内部表現を返す */
+int MEPredictor::encode_word(const std::string &word) const
+{
+  return vocabulary.find(word);
+}
+
+/* 内部表現の整数から文字列に変換して返す */
+std::string MEPredictor::decode_word(int word_id) const
+{
+  if (word_id < 0 || word_id >= vocabulary.size()) {
+    return "\0";
+  }
+  return vocabulary.get_string(word_id);
+}
+
+/* 語彙の単語数 */
+int MEPredictor::get_vocabulary_size(void) const
+{
+  return vocabulary.size();
+}
+
+/* 最大Nグラムのサイズ */
+int MEPredictor::get_maxN_gram(void) const
+{
+  return maxN_gram;
+}
+
+/* yの値域の大きさ */
+int MEPredictor::get_label_size(void) const
+{
+  return marginal_energy_y.size();
+}
+
+/* xで活性化する条件付き素性をyについて集計する.
+   接尾辞の短い順に足し合わせるので, 学習時のlog Z(x), P(y|x)と同じ順序の計算になる */
+void MEPredictor::score_conditional(const std::vector<int> &coded_x,
+                                    std::vector<std::pair<int, double> > &cond_scores, double *log_norm_factor) const
+{
+  int x_size = coded_x.size();
+
+  /* 長さ1以上の接尾辞毎に, 活性化する素性の(y, エネルギー)を集める */
+  cond_scores.clear();
+  for (int len = 1; len <= x_size && len < maxN_gram; len++) {
+    int suffix_id = suffix_index.find(&coded_x[x_size-len], len);
+    if (suffix_id == -1) {
+      continue;
+    }
+    for (int e_i = suffix_offset[suffix_id]; e_i < suffix_offset[suffix_id+1]; e_i++) {
+      cond_scores.push_back(std::make_pair(suffix_y[e_i], suffix_energy[e_i]));
+    }
+  }
+
+  /* yの昇順に並べ, 同じyのエネルギーをまとめる */
+  std::stable_sort(cond_scores.begin(), cond_scores.end(), y_order);
+  int num_y = 0;
+  for (int c_i = 0; c_i < (int)cond_scores.size(); c_i++) {
+    if (num_y > 0 && cond_scores[num_y-1].first == cond_scores[c_i].first) {
+      cond_scores[num_y-1].second += cond_scores[c_i].second;
+    } else {
+      cond_scores[num_y++] = cond_scores[c_i];
+    }
+  }
+  cond_scores.resize(num_y);
+
+  /* Y(x)の対数得点u(y)+e(y|x)とlog Z(x). 最大の項aで割ってから足す(log-sum-exp) */
+  double max_log_z = log_marginal_factor;
+  for (int c_i = 0; c_i < num_y; c_i++) {
+    cond_scores[c_i].second += marginal_energy_y[cond_scores[c_i].first];
+    max_log_z = std::max(max_log_z, cond_scores[c_i].second);
+  }
+  double sum_z = exp(log_marginal_factor - max_log_z);
+  for (int c_i = 0; c_i < num_y; c_i++) {
+    sum_z += exp(cond_scores[c_i].second - max_log_z) - exp(marginal_energy_y[cond_scores[c_i].first] - max_log_z);
+  }
+  *log_norm_factor = max_log_z + log(sum_z);
+}
+
+/* 予測に効くxの接尾辞を返す.
+   未知の単語(-1)を含む接尾辞はどの素性も活性化させないので, 最後の未知の単語より後ろの部分だけでよい */
+std::vector<int> MEPredictor::context_key(const std::vector<int> &coded_x)
+{
+  int key_begin = coded_x.size();
+  while (key_begin > 0 && coded_x[key_begin-1] != -1) {
+    key_begin--;
+  }
+  return std::vector<int>(coded_x.begin() + key_begin, coded_x.end());
+}
+
+/* xについての計算結果をキャッシュから得る. キーはcontext_keyの接尾辞 */
+void MEPredictor::get_context(const std::vector<int> &coded_x, MEContextCache::Entry &entry) const
+{
+  entry.key = context_key(coded_x);
+
+  if (context_cache.lookup(entry.key, entry)) {
+    return;
+  }
+
+  /* キャッシュに無ければ計算して登録. ランキングは求められた時に計算する */
+  score_conditional(entry.key, entry.cond_scores, &entry.log_norm_factor);
+  entry.ranking.clear();
+  entry.ranking_size = -1;
+  context_cache.store(entry);
+}
+
+/* 条件付き確率P(y|x)を返す */
+double MEPredictor::get_cond_prob(const std::vector<int> &coded_x, int pattern_y) const
+{
+  MEContextCache::Entry entry;
+
+  /* 学習データに現れないyの確率は0 */
+  if (pattern_y < 0 || pattern_y >= (int)marginal_energy_y.size()) {
+    return 0.0f;
+  }
+
+  get_context(coded_x, entry);
+
+  std::vector<std::pair<int, double> >::iterator c_it
+    = std::lower_bound(entry.cond_scores.begin(), entry.cond_scores.end(), std::make_pair(pattern_y, 0.0), y_order);
+  if (c_it != entry.cond_scores.end() && c_it->first == pattern_y) {
+    return exp(c_it->second - entry.log_norm_factor);
+  }
+  return exp(marginal_energy_y[pattern_y] - entry.log_norm_factor);
+}
+
+/* 全てのyの対数条件付き確率log P(y|x). Y(x)の外は周辺素性のエネルギーから, Y(x)の中はキャッシュした得点から */
+void MEPredictor::get_log_probs(const std::vector<int> &coded_x, std::vector<double> &log_probs) const
+{
+  MEContextCache::Entry entry;
+
+  get_context(coded_x, entry);
+
+  log_probs.resize(marginal_energy_y.size());
+  for (int y = 0; y < (int)marginal_energy_y.size(); y++) {
+    log_probs[y] = marginal_energy_y[y] - entry.log_norm_factor;
+  }
+  for (int c_i = 0; c_i < (int)entry.cond_scores.size(); c_i++) {
+    log_probs[entry.cond_scores[c_i].first] = entry.cond_scores[c_i].second - entry.log_norm_factor;
+  }
+}
+
+/* 周辺素性のみによるエネルギーu(y) */
+void MEPredictor::get_marginal_energy(std::vector<double> &energy) const
+{
+  energy = marginal_energy_y;
+}
+
+/* 前計算したz(y)の降順リストとY(x)の得点を併合して上位ranking_size個を返す.
+   Y(x)以外のyの順位はz(y)の順位のままなので, 降順リストを先頭からY(x)を飛ばして読めばよい */
+void MEPredictor::merge_ranking(const std::vector<std::pair<int, double> > &cond_scores, double log_norm_factor,
+                                int ranking_size, std::vector<std::pair<int, double> > &ranking) const
+{
+  std::vector<std::pair<int, double> > cond_ranking(cond_scores); /* Y(x)の(y, 確率)を確率の降順に */
+  int c_i = 0, m_i = 0;
+
+  for (int r_i = 0; r_i < (int)cond_ranking.size(); r_i++) {
+    cond_ranking[r_i].second = exp(cond_ranking[r_i].second - log_norm_factor);
+  }
+  std::sort(cond_ranking.begin(), cond_ranking.end(), ranking_order);
+
+  ranking.clear();
+  while ((int)ranking.size() < ranking_size) {
+    /* 降順リストの次のyを探す. Y(x)のyは飛ばす */
+    while (m_i < (int)marginal_ranking.size()
+           && std::binary_search(cond_scores.begin(), cond_scores.end(),
+                                 std::make_pair(marginal_ranking[m_i], 0.0), y_order)) {
+      m_i++;
+    }
+
+    bool has_cond     = (c_i < (int)cond_ranking.size());
+    bool has_marginal = (m_i < (int)marginal_ranking.size());
+    if (!has_cond && !has_marginal) {
+      break;
+    }
+
+    if (has_marginal) {
+      std::pair<int, double> marginal_entry(marginal_ranking[m_i],
+                                            exp(marginal_energy_y[marginal_ranking[m_i]] - log_norm_factor));
+      if (!has_cond || ranking_order(marginal_entry, cond_ranking[c_i])) {
+        ranking.push_back(marginal_entry);
+        m_i++;
+        continue;
+      }
+    }
+    ranking.push_back(cond_ranking[c_i++]);
+  }
+}
+
+/* 上位ranking_sizeの確率のyを(単語ID, 確率)の組で返す.
+   キャッシュにranking_size以上のランキングがあれば, その先頭を返す */
+std::vector<std::pair<int, double> > MEPredictor::get_ranking(const std::vector<int> &coded_x, int ranking_size) const
+{
+  MEContextCache::Entry entry;
+
+  get_context(coded_x, entry);
+
+  if (entry.ranking_size >= ranking_size) {
+    if ((int)entry.ranking.size() > ranking_size) {
+      entry.ranking.resize(ranking_size);
+    }
+    return entry.ranking;
+  }
+
+  merge_ranking(entry.cond_scores, entry.log_norm_factor, ranking_size, entry.ranking);
+  entry.ranking_size = ranking_size;
+  context_cache.store(entry);
+
+  return entry.ranking;
+}
+
+/* 最も確率の高いyを返す */
+int MEPredictor::predict_y(const std::vector<int> &coded_x) const
+{
+  std::vector<std::pair<int, double> > ranking = get_ranking(coded_x, 1);
+
+  return (ranking.empty() ? -1 : ranking[0].first);
+}
+
+/* ビーム探索.
+   各段で仮説をxの接尾辞(キー)で整列してグループにまとめ, グループ毎に上位beam_width個の次の単語を1度だけ求める.
+   最後の(maxN_gram-1)語が同じ仮説はZ(x)とY(x)の得点を共有し, 計算結果は文脈キャッシュを通すので前の段や前の問い合わせとも共有する.
+   対数確率は単語を足すほど減るので, 終わった仮説の上位num_results個が残りの仮説の最良より良ければ, 以降で順位は変わらない */
+std::vector<std::pair<std::vector<int>, double> >
+MEPredictor::beam_search(const std::vector<int> &coded_x, int max_length, int beam_width, int num_results,
+                         const std::vector<int> &stop_words) const
+{
+  std::vector<std::pair<std::vector<int>, double> > beam;     /* 終わっていない仮説の(単語列, 対数確率) */
+  std::vector<std::pair<std::vector<int>, double> > finished; /* 終わった仮説 */
+  std::vector<std::pair<double, std::pair<int, int> > > candidates; /* (対数確率, (仮説, 次の単語)) */
+
+  if (max_length <= 0 || beam_width <= 0 || num_results <= 0) {
+    return finished;
+  }
+
+  beam.push_back(std::make_pair(std::vector<int>(), 0.0));
+  for (int step = 0; step < max_length && !beam.empty(); step++) {
+    int num_hypotheses = beam.size();
+    std::vector<std::vector<int> > keys(num_hypotheses); /* 仮説 -> キー */
+    std::vector<int>               order(num_hypotheses); /* キーの順に並べた仮説 */
+
+    /* 仮説の文脈: 元の文脈に仮説の単語列を続けた末尾(maxN_gram-1)語 */
+    for (int h_i = 0; h_i < num_hypotheses; h_i++) {
+      std::vector<int> context(coded_x);
+      context.insert(context.end(), beam[h_i].first.begin(), beam[h_i].first.end());
+      if ((int)context.size() > maxN_gram-1) {
+        context.erase(context.begin(), context.end() - (maxN_gram-1));
+      }
+      keys[h_i]  = context_key(context);
+      order[h_i] = h_i;
+    }
+    std::sort(order.begin(), order.end(), [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+    /* キーのグループ毎に次の単語の上位を求め, 仮説を伸ばす候補にする */
+    candidates.clear();
+    std::vector<std::pair<int, double> > ranking;
+    for (int o_i = 0; o_i < num_hypotheses; o_i++) {
+      int h_i = order[o_i];
+      if (o_i == 0 || keys[h_i] != keys[order[o_i-1]]) {
+        ranking = get_ranking(keys[h_i], beam_width);
+      }
+      for (int r_i = 0; r_i < (int)ranking.size(); r_i++) {
+        candidates.push_back(std::make_pair(beam[h_i].second + log(ranking[r_i].second),
+                                            std::make_pair(h_i, ranking[r_i].first)));
+      }
+    }
+
+    /* 上位beam_width個を残す. 同じ対数確率なら仮説, 単語の順 */
+    int num_keep = std::min((int)candidates.size(), beam_width);
+    std::partial_sort(candidates.begin(), candidates.begin() + num_keep, candidates.end(),
+                      [](const std::pair<double, std::pair<int, int> > &a, const std::pair<double, std::pair<int, int> > &b) {
+                        if (a.first != b.first) {
+                          return a.first > b.first;
+                        }
+                        return a.second < b.second;
+                      });
+    std::vector<std::pair<std::vector<int>, double> > next_beam;
+    for (int c_i = 0; c_i < num_keep; c_i++) {
+      std::vector<int> labels(beam[candidates[c_i].second.first].first);
+      int y = candidates[c_i].second.second;
+      labels.push_back(y);
+      if (std::binary_search(stop_words.begin(), stop_words.end(), y) || step == max_length-1) {
+        finished.push_back(std::make_pair(labels, candidates[c_i].first));
+      } else {
+        next_beam.push_back(std::make_pair(labels, candidates[c_i].first));
+      }
+    }
+    beam.swap(next_beam);
+
+    /* 打ち切り判定. next_beamは対数確率の降順なので先頭が最良 */
+    std::stable_sort(finished.begin(), finished.end(),
+                     [](const std::pair<std::vector<int>, double> &a, const std::pair<std::vector<int>, double> &b) {
+                       return a.second > b.second;
+                     });
+    if ((int)finished.size() >= num_results
+        && (beam.empty() || beam[0].second <= finished[num_results-1].second)) {
+      break;
+    }
+  }
+
+  if ((int)finished.size() > num_results) {
+    finished.resize(num_results);
+  }
+  return finished;
+}
+
+/* 複数の文脈xをまとめて予測する.
+   文脈を接尾辞(キー)で整列してグループにまとめ, グループ毎にZ(x)とランキングを1度だけ計算して全員に書く.
+   バッチは1回きりの評価に使うことが多いので, 文脈キャッシュは通さない */
+void MEPredictor::predict_batch(const std::vector<std::vector<int> > &contexts, int ranking_size,
+                                std::vector<int> &ranking_ids, std::vector<double> &ranking_probs,
+                                const std::vector<int> *targets, std::vector<double> *target_probs,
+                                METhreadPool *thread_pool) const
+{
+  int num_contexts = contexts.size();
+  std::vector<std::vector<int> > keys(num_contexts); /* 文脈 -> キー */
+  std::vector<int>               order(num_contexts); /* キーの順に並べた文脈のインデックス */
+  std::vector<int>               group_offset;        /* グループ -> orderの先頭位置 */
+
+  /* 正解を与えるなら, 文脈と同じ数だけと, 書き込み先が要る */
+  if (targets != NULL && (target_probs == NULL || (int)targets->size() != num_contexts)) {
+    std::cerr << "Error : predict_batch needs one target per context and a target_probs buffer." << std::endl;
+    ranking_ids.clear();
+    ranking_probs.clear();
+    if (target_probs != NULL) {
+      target_probs->clear();
+    }
+    return;
+  }
+
+  if (ranking_size < 0) {
+    ranking_size = 0;
+  }
+  ranking_ids.assign((size_t)num_contexts * ranking_size, -1);
+  ranking_probs.assign((size_t)num_contexts * ranking_size, 0.0f);
+  if (targets != NULL) {
+    target_probs->assign(num_contexts, 0.0f);
+  }
+
+  /* キーで整列し, 同じキーの文脈をグループにまとめる */
+  for (int c_i = 0; c_i < num_contexts; c_i++) {
+    keys[c_i]  = context_key(contexts[c_i]);
+    order[c_i] = c_i;
+  }
+  std::sort(order.begin(), order.end(), [&keys](int a, int b) { return keys[a] < keys[b]; });
+  for (int o_i = 0; o_i < num_contexts; o_i++) {
+    if (o_i == 0 || keys[order[o_i]] != keys[order[o_i-1]]) {
+      group_offset.push_back(o_i);
+    }
+  }
+  group_offset.push_back(num_contexts);
+  int num_groups = group_offset.size() - 1;
+
+  /* グループ毎の計算. 書き込む先は文脈毎に別なので排他制御は要らない */
+  std::function<void(int, int, int)> predict_groups = [&](int g_begin, int g_end, int thread_id) {
+    std::vector<std::pair<int, double> > cond_scores, ranking;
+    double log_norm_factor;
+
+    for (int g_i = g_begin; g_i < g_end; g_i++) {
+      const std::vector<int> &key = keys[order[group_offset[g_i]]];
+      score_conditional(key, cond_scores, &log_norm_factor);
+      merge_ranking(cond_scores, log_norm_factor, ranking_size, ranking);
+
+      for (int o_i = group_offset[g_i]; o_i < group_offset[g_i+1]; o_i++) {
+        int c_i = order[o_i];
+        for (int r_i = 0; r_i < (int)ranking.size(); r_i++) {
+          ranking_ids[(size_t)c_i * ranking_size + r_i]   = ranking[r_i].first;
+          ranking_probs[(size_t)c_i * ranking_size + r_i] = ranking[r_i].second;
+        }
+
+        /* 正解yの確率 */
+        if (targets != NULL) {
+          int y = (*targets)[c_i];
+          double prob = 0.0f;
+          if (y >= 0 && y < (int)marginal_energy_y.size()) {
+            std::vector<std::pair<int, double> >::iterator c_it
+              = std::lower_bound(cond_scores.begin(), cond_scores.end(), std::make_pair(y, 0.0), y_order);
+            if (c_it != cond_scores.end() && c_it->first == y) {
+              prob = exp(c_it->second - log_norm_factor);
+            } else {
+              prob = exp(marginal_energy_y[y] - log_norm_factor);
+            }
+          }
+          (*target_probs)[c_i] = prob;
+        }
+      }
+    }
+  };
+
+  if (thread_pool != NULL) {
+    thread_pool->parallel_for(num_groups, predict_groups);
+  } else {
+    predict_groups(0, num_groups, 0);
+  }
+}
+
+/* 文脈キャッシュのヒット数, ミス数を取得する */
+void MEPredictor::get_cache_statistics(unsigned long *hits, unsigned long *misses) const
+{
+  context_cache.get_statistics(hits, misses);
+}
+
+/* 文脈キャッシュを空にする */
+void MEPredictor::clear_cache(void) const
+{
+  context_cache.clear();
+}
@@ -0,0 +1,105 @@
+#ifndef MEPREDICTOR_H_INCLUDED
+#define MEPREDICTOR_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <utility>
+
+#include "MEPatternIndex.hpp"
+#include "MEVocabulary.hpp"
+#include "MEContextCache.hpp"
+#include "METhreadPool.hpp"
+
+class MEModel;
+
+/* 複数単語の補完(ビーム探索)のデフォルト値 */
+const int COMPLETION_BEAM_WIDTH = 4; /* ビーム幅 */
+const int COMPLETION_RESULTS    = 3; /* 返す単語列の数 */
+
+/* 学習済みモデルから作る予測器. 作成後は変更しないので, 複数スレッドから同時に引いてよい.
+   周辺素性のみによるエネルギーu(y)(z(y)=exp(u(y)))と, その正規化項の対数log Zm, z(y)の降順に並べた単語リストを前計算しておき,
+   問い合わせ毎にはxの接尾辞で活性化する条件付き素性のy(=Y(x))だけを計算する.
+     Z(x)   = Zm + Σ_{y∈Y(x)} z(y)(exp(e(y|x)) - 1)
+     P(y|x) = z(y)exp(e(y|x))/Z(x)  (y∈Y(x)),  z(y)/Z(x)  (それ以外)
+   e(y|x)はxの長さ1以上の接尾辞で活性化する条件付き素性の(パラメタ*重み)和.
+   エネルギーが大きくてもオーバーフローしないよう, 得点とZ(x)は対数で持ち, 確率は対数の差の指数で求める.
+   入力補完では同じ文脈が繰り返し来るので, xについての計算結果(log Z(x), Y(x)の得点, 上位ランキング)はLRUキャッシュに持つ.
+   予測器はパラメタが変わる度に作り直すので, キャッシュもそこで捨てられる */
+class MEPredictor {
+private:
+  int                      maxN_gram;           /* 最大Nグラムのサイズ */
+  MEVocabulary             vocabulary;          /* 単語と整数の対応をとる語彙表 */
+  std::vector<double>      marginal_energy_y;   /* y -> 周辺素性のみによるエネルギーu(y). 学習データに無いyは-∞ */
+  double                   log_marginal_factor; /* log Zm = log Σ_y z(y) */
+  std::vector<int>         marginal_ranking;    /* z(y)の降順(同じ値ならIDの昇順)に並べたyのリスト */
+  MEPatternIndex           suffix_index;        /* 条件付き素性のpattern_x(xの接尾辞, 長さ1以上) -> 接尾辞ID */
+  std::vector<int>         suffix_offset;       /* 接尾辞ID -> suffix_y/suffix_energyの先頭位置(CSR形式) */
+  std::vector<int>         suffix_y;            /* 接尾辞で活性化する条件付き素性のy. 接尾辞毎にyの昇順 */
+  std::vector<double>      suffix_energy;       /* 接尾辞で活性化する条件付き素性の(パラメタ*重み) */
+  mutable MEContextCache   context_cache;       /* 文脈xについての計算結果のキャッシュ. 内部で排他制御する */
+
+public:
+  /* コンストラクタ. 学習済み（または読み込んだ）モデルから予測に使う表を作る */
+  MEPredictor(const MEModel &model, size_t cache_size=CONTEXT_CACHE_SIZE);
+  /* デストラクタ */
+  ~MEPredictor(void);
+
+  /* 文字列のxパターンを末尾(maxN_gram-1)語の内部表現に直す. 未知の単語は-1 */
+  std::vector<int> encode_pattern_x(const std::vector<std::string> &pattern_x) const;
+  /* 単語の内部表現を返す. 未知の単語は-1 */
+  int encode_word(const std::string &word) const;
+  /* 内部表現の整数から文字列に変換して返す. 語彙に無ければナル文字だけからなる文字列 */
+  std::string decode_word(int word_id) const;
+  /* 語彙の単語数 */
+  int get_vocabulary_size(void) const;
+  /* 最大Nグラムのサイズ. 予測に使うxは末尾(maxN_gram-1)語 */
+  int get_maxN_gram(void) const;
+  /* yの値域の大きさ. yは0..get_label_size()-1 */
+  int get_label_size(void) const;
+  /* 条件付き確率P(y|x)を返す */
+  double get_cond_prob(const std::vector<int> &coded_x, int pattern_y) const;
+  /* 全てのyの対数条件付き確率log P(y|x)をyの順にlog_probsにセットする. 学習データに無いyは-∞ */
+  void get_log_probs(const std::vector<int> &coded_x, std::vector<double> &log_probs) const;
+  /* 周辺素性のみによるエネルギーu(y)をyの順にenergyにセットする. 学習データに無いyは-∞ */
+  void get_marginal_energy(std::vector<double> &energy) const;
+  /* xで活性化する条件付き素性をyについて集計し, Y(x)の各yの(y, u(y)+e(y|x))をyの昇順でcond_scoresに,
+     log Z(x)をlog_norm_factorにセットする. キャッシュを通さないので, 学習のように文脈が繰り返さない大量の問い合わせに使う */
+  void score_conditional(const std::vector<int> &coded_x,
+                         std::vector<std::pair<int, double> > &cond_scores, double *log_norm_factor) const;
+  /* 上位ranking_sizeの確率のyを, (単語ID, 確率)の組で確率の降順に返す. 同じ確率の時はIDの小さい順 */
+  std::vector<std::pair<int, double> > get_ranking(const std::vector<int> &coded_x, int ranking_size) const;
+  /* 最も確率の高いyを返す. 語彙が空なら-1 */
+  int predict_y(const std::vector<int> &coded_x) const;
+  /* 文脈xを最大max_length語まで伸ばす単語列を, 幅beam_widthのビーム探索で求める.
+     単語列はstop_wordsの単語(yの昇順)を出した所かmax_length語で終わり, 上位num_results個を
+     (単語列, 対数確率Σ_t log P(y_t|x, y_1..y_{t-1}))の組で対数確率の降順に返す.
+     上位num_results個が決まった時点で, 残りの仮説がそれを上回れなければ打ち切る */
+  std::vector<std::pair<std::vector<int>, double> >
+    beam_search(const std::vector<int> &coded_x, int max_length, int beam_width, int num_results,
+                const std::vector<int> &stop_words) const;
+  /* 複数の文脈xをまとめて予測する. 同じ接尾辞を持つ文脈は1度だけ計算する.
+     i番目の文脈の第r位を(ranking_ids, ranking_probs)[i*ranking_size + r]に書く(候補が足りなければIDは-1, 確率は0).
+     targetsがNULLでなければ, target_probs[i]にP(targets[i]|contexts[i])を書く.
+     その時targetsはcontextsと同じ長さで, target_probsはNULLでないこと. 満たさなければエラーを出し, 何もせず結果を空にする.
+     thread_poolがNULLでなければ, 文脈のグループを並列に計算する */
+  void predict_batch(const std::vector<std::vector<int> > &contexts, int ranking_size,
+                     std::vector<int> &ranking_ids, std::vector<double> &ranking_probs,
+                     const std::vector<int> *targets, std::vector<double> *target_probs,
+                     METhreadPool *thread_pool) const;
+  /* 文脈キャッシュのヒット数, ミス数を取得する */
+  void get_cache_statistics(unsigned long *hits, unsigned long *misses) const;
+  /* 文脈キャッシュを空にし, ヒット数, ミス数も0に戻す（キャッシュに載っていない時の遅延を測る用） */
+  void clear_cache(void) const;
+
+private:
+  /* 予測に効くxの接尾辞(最後の未知の単語より後ろの部分)を返す */
+  static std::vector<int> context_key(const std::vector<int> &coded_x);
+  /* xについての計算結果をキャッシュから得る. 無ければ計算してキャッシュに登録する */
+  void get_context(const std::vector<int> &coded_x, MEContextCache::Entry &entry) const;
+  /* 前計算したz(y)の降順リストとY(x)の得点を併合して上位ranking_size個を返す */
+  void merge_ranking(const std::vector<std::pair<int, double> > &cond_scores, double log_norm_factor,
+                     int ranking_size, std::vector<std::pair<int, double> > &ranking) const;
+
+};
+
+#endif /* MEPREDICTOR_H_INCLUDED */
@@ -0,0 +1,299 @@
+#include "MESGDTrainer.hpp"
+#include "METokenizer.hpp"
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+/* コンストラクタ */
+MESGDTrainer::MESGDTrainer(int maxN_gram, size_t max_features,
+                           int batch_size, double learning_rate, double l1_coefficient)
+{
+  this->maxN_gram      = maxN_gram;
+  this->max_features   = max_features;
+  this->batch_size     = batch_size;
+  this->learning_rate  = learning_rate;
+  this->l1_coefficient = l1_coefficient;
+  total_count          = 0;
+  cumulative_penalty   = 0.0f;
+  num_batches          = 0;
+  num_events           = 0;
+  last_compaction      = 0;
+}
+
+/* デストラクタ */
+MESGDTrainer::~MESGDTrainer(void)
+{
+}
+
+/* ファイルの単語列を流し込んで学習する.
+   各単語をyとし, 同じファイル内の直前(maxN_gram-1)語をxとする事象をミニバッチに加えていく */
+bool MESGDTrainer::read_file(const std::string &filename)
+{
+  METokenizer tokenizer;
+  const char *word;
+  int word_length;
+  std::vector<int> history(std::max(maxN_gram-1, 0), -1); /* 直前の単語ID. 足りない先頭は-1 */
+
+  if (!tokenizer.open(filename)) {
+    return false;
+  }
+
+  while (tokenizer.next_word(&word, &word_length)) {
+    int word_id = vocabulary.insert(word, word_length);
+    if (word_id == (int)word_count.size()) {
+      word_count.push_back(0);
+    }
+    word_count[word_id]++;
+    total_count++;
+
+    add_event(history.empty() ? NULL : &history[0], word_id);
+    if (batch_y.size() >= (size_t)batch_size) {
+      update_batch();
+    }
+
+    /* 履歴を1語ずらす */
+    if (!history.empty()) {
+      std::copy(history.begin()+1, history.end(), history.begin());
+      history.back() = word_id;
+    }
+  }
+
+  return true;
+}
+
+/* 溜まっている事象でミニバッチを更新する */
+void MESGDTrainer::flush(void)
+{
+  if (!batch_y.empty()) {
+    update_batch();
+  }
+}
+
+/* 事象(x, y)をミニバッチに加える. xの長さ1以上の各接尾辞とyの素性が無ければ作る */
+void MESGDTrainer::add_event(const int *x, int y)
+{
+  int x_size = maxN_gram-1;
+
+  batch_x.insert(batch_x.end(), x, x + x_size);
+  batch_y.push_back(y);
+  for (int len = 1; len <= x_size && x[x_size-len] != -1; len++) {
+    insert_feature(&x[x_size-len], len, y);
+  }
+}
+
+/* 素性を探し, 無ければ空きがある限り作る.
+   途中から現れた素性がそれまでの罰則をまとめて受けないよう, 受けた罰則は現在の累積から始める */
+void MESGDTrainer::insert_feature(const int *pattern_x, int length, int pattern_y)
+{
+  std::vector<int> key(pattern_x, pattern_x + length);
+  key.push_back(pattern_y);
+
+  int feature_id = feature_index.find(key);
+  if (feature_id != -1) {
+    feature_count[feature_id]++;
+    return;
+  }
+  if ((size_t)feature_index.size() >= max_features) {
+    return;
+  }
+
+  feature_id = feature_index.insert(key);
+  parameter.push_back(0.0f);
+  applied_penalty.push_back(-cumulative_penalty);
+  feature_count.push_back(1);
+  gradient.push_back(0.0f);
+
+  int suffix_id = suffix_index.insert(pattern_x, length);
+  if (suffix_id == (int)suffix_features.size()) {
+    suffix_features.push_back(std::vector<int>());
+  }
+  suffix_features[suffix_id].push_back(feature_id);
+}
+
+/* ミニバッチの勾配を計算してパラメタを更新する.
+   事象毎に, xで活性化する条件付き素性のエネルギーをyについて集計してZ(x)を求め,
+   活性化した素性fに f(x,y) - P(y_f|x) を足し込む. 最後に学習率を掛けて更新し, 累積L1罰則を掛ける */
+void MESGDTrainer::update_batch(void)
+{
+  int x_size = maxN_gram-1;
+  int num_batch_events = batch_y.size();
+  std::vector<int> active;    /* 事象のxで活性化する素性 */
+  std::vector<int> touched_y; /* 活性化した素性のy */
+
+  energy.resize(word_count.size(), 0.0f);
+  for (int e_i = 0; e_i < num_batch_events; e_i++) {
+    const int *x = batch_x.empty() ? NULL : &batch_x[e_i * x_size];
+    int y = batch_y[e_i];
+
+    /* 活性化する素性とエネルギーの集計 */
+    active.clear(); touched_y.clear();
+    for (int len = 1; len <= x_size && x[x_size-len] != -1; len++) {
+      int suffix_id = suffix_index.find(&x[x_size-len], len);
+      if (suffix_id == -1) {
+        continue;
+      }
+      const std::vector<int> &list = suffix_features[suffix_id];
+      for (int l_i = 0; l_i < (int)list.size(); l_i++) {
+        int feature_y = feature_index.get_key(list[l_i])[len];
+        touched_y.push_back(feature_y);
+        energy[feature_y] += parameter[list[l_i]];
+        active.push_back(list[l_i]);
+      }
+    }
+
+    /* Z(x) = Zm + Σ_{y∈Y(x)} z(y)(exp(e(y|x)) - 1) を, 最大の項aで割るlog-sum-expで対数のまま求める.
+         log Z(x) = a + log( Zm/e^a + Σ_{y∈Y(x)} (e^{log z(y)+e(y|x)-a} - e^{log z(y)-a}) ) */
+    std::sort(touched_y.begin(), touched_y.end());
+    touched_y.erase(std::unique(touched_y.begin(), touched_y.end()), touched_y.end());
+    double log_marginal_factor = log((double)total_count);
+    double max_log_z = log_marginal_factor;
+    for (int t_i = 0; t_i < (int)touched_y.size(); t_i++) {
+      int feature_y = touched_y[t_i];
+      max_log_z = std::max(max_log_z, log((double)word_count[feature_y]) + energy[feature_y]);
+    }
+    double sum_z_x = exp(log_marginal_factor - max_log_z);
+    for (int t_i = 0; t_i < (int)touched_y.size(); t_i++) {
+      int feature_y = touched_y[t_i];
+      double log_z_y = log((double)word_count[feature_y]);
+      sum_z_x += exp(log_z_y + energy[feature_y] - max_log_z) - exp(log_z_y - max_log_z);
+    }
+    double log_norm_factor = max_log_z + log(sum_z_x);
+
+    /* 勾配の足し込み */
+    for (int a_i = 0; a_i < (int)active.size(); a_i++) {
+      int feature_id = active[a_i];
+      int length     = feature_index.get_length(feature_id) - 1;
+      int feature_y  = feature_index.get_key(feature_id)[length];
+      double cond_prob = exp(log((double)word_count[feature_y]) + energy[feature_y] - log_norm_factor);
+      touched_features.push_back(feature_id);
+      gradient[feature_id] += ((feature_y == y) ? 1.0f : 0.0f) - cond_prob;
+    }
+
+    /* 作業領域を戻す */
+    for (int t_i = 0; t_i < (int)touched_y.size(); t_i++) {
+      energy[touched_y[t_i]] = 0.0f;
+    }
+  }
+
+  /* パラメタの更新と累積L1罰則 */
+  double eta = learning_rate / (1.0f + num_batches / SGD_DECAY_BATCHES);
+  cumulative_penalty += eta * l1_coefficient * num_batch_events;
+  std::sort(touched_features.begin(), touched_features.end());
+  touched_features.erase(std::unique(touched_features.begin(), touched_features.end()), touched_features.end());
+  for (int t_i = 0; t_i < (int)touched_features.size(); t_i++) {
+    int feature_id = touched_features[t_i];
+    parameter[feature_id] += eta * gradient[feature_id];
+    gradient[feature_id] = 0.0f;
+    apply_penalty(feature_id);
+  }
+  touched_features.clear();
+
+  num_batches++;
+  num_events += num_batch_events;
+  batch_x.clear();
+  batch_y.clear();
+
+  /* 素性が満杯なら, 一定間隔でパラメタ0の素性を掃除する */
+  if ((size_t)feature_index.size() >= max_features
+      && num_batches - last_compaction >= SGD_COMPACT_INTERVAL) {
+    compact_features();
+    last_compaction = num_batches;
+  }
+}
+
+/* 累積L1罰則を素性に掛ける. パラメタは0をまたがず0で止める */
+void MESGDTrainer::apply_penalty(int feature_id)
+{
+  double z = parameter[feature_id];
+
+  if (z > 0.0f) {
+    parameter[feature_id] = std::max(0.0, z - (cumulative_penalty + applied_penalty[feature_id]));
+  } else if (z < 0.0f) {
+    parameter[feature_id] = std::min(0.0, z + (cumulative_penalty - applied_penalty[feature_id]));
+  }
+  applied_penalty[feature_id] += parameter[feature_id] - z;
+}
+
+/* パラメタが0の素性を取り除いて表を作り直す */
+void MESGDTrainer::compact_features(void)
+{
+  MEPatternIndex      new_feature_index;
+  std::vector<double> new_parameter, new_applied_penalty;
+  std::vector<int>    new_feature_count;
+
+  suffix_index.clear();
+  suffix_features.clear();
+  for (int f_i = 0; f_i < feature_index.size(); f_i++) {
+    if (parameter[f_i] == 0.0f) {
+      continue;
+    }
+    int length     = feature_index.get_length(f_i) - 1;
+    int feature_id = new_feature_index.insert(feature_index.get_key(f_i), length+1);
+    new_parameter.push_back(parameter[f_i]);
+    new_applied_penalty.push_back(applied_penalty[f_i]);
+    new_feature_count.push_back(feature_count[f_i]);
+
+    int suffix_id = suffix_index.insert(feature_index.get_key(f_i), length);
+    if (suffix_id == (int)suffix_features.size()) {
+      suffix_features.push_back(std::vector<int>());
+    }
+    suffix_features[suffix_id].push_back(feature_id);
+  }
+
+  feature_index = new_feature_index;
+  parameter.swap(new_parameter);
+  applied_penalty.swap(new_applied_penalty);
+  feature_count.swap(new_feature_count);
+  gradient.assign(parameter.size(), 0.0f);
+}
+
+/* 学習した素性をモデルの形で書き出す */
+void MESGDTrainer::export_model(MEFeatureStore &features, MEVocabulary &vocabulary, std::set<int> &setY) const
+{
+  features.clear();
+  setY.clear();
+
+  /* 周辺素性: λ(y) = log count(y) */
+  for (int y = 0; y < (int)word_count.size(); y++) {
+    int count = (int)std::min(word_count[y], (long)INT_MAX);
+    int f_index = features.push_back(NULL, 0, y, count);
+    features.is_marginal[f_index]    = true;
+    features.parameter[f_index]      = log((double)word_count[y]);
+    features.empirical_prob[f_index] = (double)word_count[y] / total_count;
+    setY.insert(y);
+  }
+
+  /* 条件付き素性 */
+  for (int f_i = 0; f_i < feature_index.size(); f_i++) {
+    if (parameter[f_i] == 0.0f) {
+      continue;
+    }
+    int length = feature_index.get_length(f_i) - 1;
+    const int *key = feature_index.get_key(f_i);
+    int f_index = features.push_back(key, length, key[length], feature_count[f_i]);
+    features.is_marginal[f_index] = false;
+    features.parameter[f_index]   = parameter[f_i];
+  }
+
+  vocabulary = this->vocabulary;
+}
+
+/* 学習した事象数 */
+long MESGDTrainer::get_num_events(void) const
+{
+  return num_events;
+}
+
+/* 条件付き素性の数 */
+int MESGDTrainer::get_num_features(void) const
+{
+  return feature_index.size();
+}
+
+/* 条件付き素性1つあたりのメモリ量[byte]（概算）.
+   素性索引のキー, パラメタ/罰則/勾配/頻度, 接尾辞リストの要素と接尾辞索引のキー(最悪で素性毎に1つ) */
+size_t MESGDTrainer::memory_per_feature(int maxN_gram)
+{
+  return MEPatternIndex::memory_per_key(maxN_gram) + 3 * sizeof(double) + 2 * sizeof(int)
+    + MEPatternIndex::memory_per_key(maxN_gram-1) + sizeof(std::vector<int>);
+}
@@ -0,0 +1,91 @@
+#ifndef MESGDTRAINER_H_INCLUDED
+#define MESGDTRAINER_H_INCLUDED
+
+#include <vector>
+#include <set>
+#include <string>
+#include <cstddef>
+
+#include "MEFeatureStore.hpp"
+#include "MEPatternIndex.hpp"
+#include "MEVocabulary.hpp"
+
+/* ストリーミング学習のデフォルト値 */
+const int    SGD_BATCH_SIZE       = 256;   /* ミニバッチの事象(Nグラム)数 */
+const double SGD_LEARNING_RATE    = 1.0;   /* 学習率の初期値 */
+const double SGD_DECAY_BATCHES    = 1000;  /* 学習率を半分にするまでのミニバッチ数. 学習率はη0/(1+t/SGD_DECAY_BATCHES) */
+const double SGD_L1_COEFFICIENT   = 10e-6; /* 1事象あたりのL1正則化の係数 */
+const int    SGD_COMPACT_INTERVAL = 100;   /* 素性が満杯の時, パラメタ0の素性を掃除する間隔[ミニバッチ] */
+
+/* ミニバッチ確率的勾配法(SGD)によるストリーミング学習器.
+   トークナイザから読んだ単語列のNグラムをそのまま事象(x, y)として学習し, 素性候補や学習データ全体を保持しない.
+   - 周辺素性(ユニグラム)のパラメタは, 読んだ単語の頻度からの閉じた形 λ(y) = log count(y) とする.
+     このときz(y) = count(y), Zm = 総単語数 なので, 周辺素性の更新は定数時間で済む.
+   - 条件付き素性(長さ1以上の接尾辞)は, 事象毎に Z(x) = Zm + Σ_{y∈Y(x)} z(y)(exp(e(y|x)) - 1) を求め,
+     xで活性化する素性だけに勾配 f(x,y) - P(y_f|x) を足し込む.
+   - 正則化はTsuruokaらの累積L1罰則. 更新した素性にだけ, それまでに受けるべき罰則との差を掛け, 0をまたぐ時は0で止める.
+   - 素性数はmax_featuresで打ち切り, 満杯になるとパラメタが0になった素性を掃除して空きを作る.
+   学習器の状態は持ち越すので, 新しいファイルを読ませれば続きから学習する */
+class MESGDTrainer {
+private:
+  int                             maxN_gram;          /* 最大Nグラムのサイズ */
+  size_t                          max_features;       /* 条件付き素性の最大数 */
+  int                             batch_size;         /* ミニバッチの事象数 */
+  double                          learning_rate;      /* 学習率の初期値η0 */
+  double                          l1_coefficient;     /* L1正則化の係数C */
+  MEVocabulary                    vocabulary;         /* 単語と整数の対応をとる語彙表 */
+  std::vector<long>               word_count;         /* 単語ID -> 頻度 (= z(y)) */
+  long                            total_count;        /* 総単語数 (= Zm) */
+  MEPatternIndex                  feature_index;      /* 条件付き素性の(pattern_x, pattern_y) -> 素性ID */
+  std::vector<double>             parameter;          /* 素性ID -> パラメタ */
+  std::vector<double>             applied_penalty;    /* 素性ID -> これまでに受けたL1罰則の合計(符号付き. Tsuruokaらのq_i) */
+  std::vector<int>                feature_count;      /* 素性ID -> 読んだ事象で現れた回数 */
+  MEPatternIndex                  suffix_index;       /* 条件付き素性のpattern_x -> 接尾辞ID */
+  std::vector<std::vector<int> >  suffix_features;    /* 接尾辞ID -> その接尾辞で活性化する素性IDのリスト */
+  double                          cumulative_penalty; /* 1つの素性が受けるべきL1罰則の累積(Tsuruokaらのu) */
+  long                            num_batches;        /* 更新したミニバッチ数 */
+  long                            num_events;         /* 学習した事象数 */
+  long                            last_compaction;    /* 最後に素性を掃除した時のミニバッチ数 */
+  std::vector<int>                batch_x;            /* ミニバッチの事象のx. 1事象あたり(maxN_gram-1)個, 足りない先頭は-1 */
+  std::vector<int>                batch_y;            /* ミニバッチの事象のy */
+  std::vector<double>             gradient;           /* 素性ID -> ミニバッチでの勾配の和 */
+  std::vector<int>                touched_features;   /* ミニバッチで勾配を持った素性ID */
+  std::vector<double>             energy;             /* y -> xでの条件付き素性のエネルギー(作業用) */
+
+public:
+  /* コンストラクタ */
+  MESGDTrainer(int maxN_gram, size_t max_features,
+               int batch_size=SGD_BATCH_SIZE, double learning_rate=SGD_LEARNING_RATE,
+               double l1_coefficient=SGD_L1_COEFFICIENT);
+  /* デストラクタ */
+  ~MESGDTrainer(void);
+
+  /* ファイルの単語列を流し込んで学習する. 開けなければfalse */
+  bool read_file(const std::string &filename);
+  /* 溜まっている事象でミニバッチを更新する */
+  void flush(void);
+  /* 学習した素性をモデルの形で書き出す. 周辺素性は全単語分, 条件付き素性はパラメタが0でないものだけ.
+     語彙と学習データに現れた単語の集合も書き出す */
+  void export_model(MEFeatureStore &features, MEVocabulary &vocabulary, std::set<int> &setY) const;
+  /* 学習した事象数 */
+  long get_num_events(void) const;
+  /* 条件付き素性の数 */
+  int get_num_features(void) const;
+  /* 条件付き素性1つあたりのメモリ量[byte]（概算. 素性数の上限の見積もり用） */
+  static size_t memory_per_feature(int maxN_gram);
+
+private:
+  /* 事象(x, y)をミニバッチに加える. xで活性化すべき素性が無ければ作る */
+  void add_event(const int *x, int y);
+  /* 素性を探し, 無ければ空きがある限り作る */
+  void insert_feature(const int *pattern_x, int length, int pattern_y);
+  /* ミニバッチの勾配を計算してパラメタを更新する */
+  void update_batch(void);
+  /* 累積L1罰則を素性に掛ける */
+  void apply_penalty(int feature_id);
+  /* パラメタが0の素性を取り除いて表を作り直す */
+  void compact_features(void);
+
+};
+
+#endif /* MESGDTRAINER_H_INCLUDED */
@@ -0,0 +1,213 @@
+#include "MEServer.hpp"
+#include "METokenizer.hpp"
+#include <iostream>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* 成功の応答に結果の(文字列, 確率)の組を書く.
+   クライアントは本体がMESSAGE_MAX_SIZEを超えるフレームを壊れているとみなすので, 収まる所までで打ち切る */
+static void put_results(MEMessage &response, const std::vector<std::pair<std::string, double> > &results)
+{
+  size_t body_size   = 2 * 4; /* 状態, 結果の数 */
+  int    num_results = 0;
+
+  while (num_results < (int)results.size()) {
+    size_t entry_size = 4 + results[num_results].first.size() + 8; /* 文字列の長さ, 文字列, 確率 */
+    if (body_size + entry_size > MESSAGE_MAX_SIZE) {
+      break;
+    }
+    body_size += entry_size;
+    num_results++;
+  }
+
+  response.put_int(RESPONSE_OK);
+  response.put_int(num_results);
+  for (int r_i = 0; r_i < num_results; r_i++) {
+    response.put_string(results[r_i].first);
+    response.put_double(results[r_i].second);
+  }
+}
+
+/* コンストラクタ */
+MEServer::MEServer(MEModel *model, const std::set<std::string> &stop_words)
+{
+  this->model      = model;
+  this->stop_words = stop_words;
+  listen_fd        = -1;
+  is_stopping      = false;
+}
+
+/* デストラクタ */
+MEServer::~MEServer(void) { ; }
+
+/* 待ち受けと接続の受け付け.
+   残っている古いソケットファイルは消してから作り, 停止したら消す */
+bool MEServer::serve(const std::string &socket_path)
+{
+  struct sockaddr_un address;
+
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error : socket path \"" << socket_path << "\" is too long." << std::endl;
+    return false;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+  /* 待ち受けソケットはこの関数だけが作って閉じる. stopから見えるのは待ち受けを始めてから閉じるまでの間 */
+  int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server_fd == -1) {
+    std::cerr << "Error : cannot create socket : " << strerror(errno) << std::endl;
+    return false;
+  }
+  unlink(socket_path.c_str());
+  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+      || listen(server_fd, SOMAXCONN) == -1) {
+    std::cerr << "Error : cannot listen on \"" << socket_path << "\" : " << strerror(errno) << std::endl;
+    close(server_fd);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(listen_mutex);
+    listen_fd = server_fd;
+  }
+  std::cout << "Serving on " << socket_path << std::endl;
+
+  while (!is_stopping) {
+    int fd = accept(server_fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (!is_stopping) {
+        std::cerr << "Error : accept failed : " << strerror(errno) << std::endl;
+      }
+      break;
+    }
+    std::lock_guard<std::mutex> lock(connection_mutex);
+    connection_fds.insert(fd);
+    std::thread(&MEServer::handle_connection, this, fd).detach();
+  }
+
+  /* 開いている接続の読み書きを止めさせ, 全てのスレッドが抜けるのを待つ */
+  {
+    std::unique_lock<std::mutex> lock(connection_mutex);
+    for (std::set<int>::iterator fd_it = connection_fds.begin(); fd_it != connection_fds.end(); fd_it++) {
+      shutdown(*fd_it, SHUT_RDWR);
+    }
+    connection_closed.wait(lock, [this]() { return connection_fds.empty(); });
+  }
+  {
+    std::lock_guard<std::mutex> lock(listen_mutex);
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  unlink(socket_path.c_str());
+  std::cout << "Server stopped." << std::endl;
+
+  return true;
+}
+
+/* 待ち受けソケットを止めてacceptを戻らせる. 閉じるのはserveに任せ, ここではshutdownだけする */
+void MEServer::stop(void)
+{
+  std::lock_guard<std::mutex> lock(listen_mutex);
+
+  is_stopping = true;
+  if (listen_fd != -1) {
+    shutdown(listen_fd, SHUT_RDWR);
+  }
+}
+
+/* 1つの接続の処理 */
+void MEServer::handle_connection(int fd)
+{
+  MEMessage request, response;
+
+  while (request.receive(fd)) {
+    response.clear();
+    bool is_shutdown = handle_request(request, response);
+    if (!response.send(fd)) {
+      break;
+    }
+    /* 停止要求には応答を返してから止める(先に止めると応答を送る前に接続が閉じられる) */
+    if (is_shutdown) {
+      stop();
+    }
+  }
+
+  close(fd);
+  std::lock_guard<std::mutex> lock(connection_mutex);
+  connection_fds.erase(fd);
+  connection_closed.notify_all();
+}
+
+/* 要求を処理して応答を作る. 1つの要求は最後まで同じスナップショットで計算する */
+bool MEServer::handle_request(MEMessage &request, MEMessage &response)
+{
+  unsigned int type       = request.get_int();
+  int          count      = request.get_int();
+  int          max_length = request.get_int();
+  int          beam_width = request.get_int();
+  std::vector<std::string> pattern_x = METokenizer::split_words(request.get_string());
+
+  std::shared_ptr<const MEPredictor> predictor = model->get_predictor();
+  if (!request.is_ok() || predictor == NULL) {
+    response.put_int(RESPONSE_ERROR);
+    response.put_int(0);
+    return false;
+  }
+
+  std::vector<int> coded_x = predictor->encode_pattern_x(pattern_x);
+  std::vector<std::pair<std::string, double> > results;
+  switch (type) {
+    case REQUEST_RANKING: {
+      int ranking_size = std::min(std::max(count, 0), std::min(predictor->get_label_size(), SERVER_MAX_RANKING_SIZE));
+      std::vector<std::pair<int, double> > ranking = predictor->get_ranking(coded_x, ranking_size);
+      for (int r_i = 0; r_i < (int)ranking.size(); r_i++) {
+        results.push_back(std::make_pair(predictor->decode_word(ranking[r_i].first), ranking[r_i].second));
+      }
+      put_results(response, results);
+      break;
+    }
+    case REQUEST_COMPLETION: {
+      std::vector<int> coded_stop_words;
+      for (std::set<std::string>::const_iterator w_it = stop_words.begin(); w_it != stop_words.end(); w_it++) {
+        int word_id = predictor->encode_word(*w_it);
+        if (word_id != -1) {
+          coded_stop_words.push_back(word_id);
+        }
+      }
+      std::sort(coded_stop_words.begin(), coded_stop_words.end());
+      std::vector<std::pair<std::vector<int>, double> > sequences
+        = predictor->beam_search(coded_x, std::min(max_length, SERVER_MAX_COMPLETION_LENGTH),
+                                 std::min(beam_width, SERVER_MAX_BEAM_WIDTH),
+                                 std::min(count, SERVER_MAX_BEAM_WIDTH), coded_stop_words);
+      for (int s_i = 0; s_i < (int)sequences.size(); s_i++) {
+        std::string words;
+        for (int t = 0; t < (int)sequences[s_i].first.size(); t++) {
+          words += (t > 0 ? " " : "") + predictor->decode_word(sequences[s_i].first[t]);
+        }
+        results.push_back(std::make_pair(words, exp(sequences[s_i].second)));
+      }
+      put_results(response, results);
+      break;
+    }
+    case REQUEST_SHUTDOWN:
+      response.put_int(RESPONSE_OK);
+      response.put_int(0);
+      return true;
+    default:
+      response.put_int(RESPONSE_ERROR);
+      response.put_int(0);
+      break;
+  }
+  return false;
+}
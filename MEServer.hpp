@@ -0,0 +1,54 @@
+#ifndef MESERVER_H_INCLUDED
+#define MESERVER_H_INCLUDED
+
+#include <vector>
+#include <set>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "MEModel.hpp"
+#include "MEMessage.hpp"
+
+/* 予測サーバの要求の上限. 壊れた/悪意のある要求で重い計算をさせないため */
+const int SERVER_MAX_COMPLETION_LENGTH = 64;   /* 補完の最大単語数 */
+const int SERVER_MAX_BEAM_WIDTH        = 256;  /* ビーム幅 */
+const int SERVER_MAX_RANKING_SIZE      = 1024; /* ランキングサイズ */
+
+/* Unixドメインソケットで補完要求を受け付ける予測サーバ.
+   要求毎にモデルから予測器のスナップショットを得て, その上で計算する. スナップショットは作成後に変更されないので
+   接続をまたいで排他制御は要らず, 別のスレッドでモデルを学習し直している間も止まらずに答えられる.
+   接続毎にスレッドを1つ立て, 接続が閉じるまで要求(MEMessageのフレーム)を順に処理して応答を返す.
+   停止要求を受けるか stop() を呼ぶと新しい接続の受け付けをやめ, 開いている接続を閉じてからserveが戻る */
+class MEServer {
+private:
+  MEModel                 *model;              /* 予測器のスナップショットを引くモデル */
+  std::set<std::string>    stop_words;         /* 補完を終える単語. 語彙は学習し直すと変わるので, 要求毎に内部表現に直す */
+  int                      listen_fd;          /* 待ち受けソケット. 未作成/閉じた後は-1. 作って閉じるのはserveだけ */
+  std::mutex               listen_mutex;       /* listen_fdの排他制御. stopが閉じた後の(再利用された)番号を触らないように */
+  std::atomic<bool>        is_stopping;        /* 停止中か */
+  std::mutex               connection_mutex;   /* 接続の集合の排他制御 */
+  std::condition_variable  connection_closed;  /* 接続が閉じた時に通知する */
+  std::set<int>            connection_fds;     /* 開いている接続 */
+
+public:
+  /* コンストラクタ. stop_wordsは補完を終える単語(語彙に無い単語は無視する) */
+  MEServer(MEModel *model, const std::set<std::string> &stop_words);
+  /* デストラクタ */
+  ~MEServer(void);
+
+  /* socket_pathで待ち受け, 停止するまで要求を処理する. 待ち受けられなければfalse */
+  bool serve(const std::string &socket_path);
+  /* 新しい接続の受け付けをやめ, serveを戻らせる. どのスレッドから呼んでもよい */
+  void stop(void);
+
+private:
+  /* 1つの接続の要求を, 接続が閉じるまで順に処理する(接続毎のスレッドで動く) */
+  void handle_connection(int fd);
+  /* 要求を処理して応答を作る. 停止要求ならtrue */
+  bool handle_request(MEMessage &request, MEMessage &response);
+
+};
+
+#endif /* MESERVER_H_INCLUDED */
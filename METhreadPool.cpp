@@ -0,0 +1,153 @@
+#include "METhreadPool.hpp"
+
+/* コンストラクタ */
+METhreadPool::METhreadPool(int num_threads)
+{
+  this->num_threads = (num_threads < 1) ? 1 : num_threads;
+  job_generation    = 0;
+  num_running       = 0;
+  is_stopping       = false;
+
+  /* ワーカの起動. スレッド0は呼び出し元 */
+  for (int thread_id = 1; thread_id < this->num_threads; thread_id++) {
+    workers.push_back(std::thread(&METhreadPool::worker_loop, this, thread_id));
+  }
+}
+
+/* デストラクタ */
+METhreadPool::~METhreadPool(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    is_stopping = true;
+  }
+  start_cond.notify_all();
+
+  for (int w_i = 0; w_i < (int)workers.size(); w_i++) {
+    workers[w_i].join();
+  }
+}
+
+/* スレッド数の取得 */
+int METhreadPool::get_num_threads(void)
+{
+  return num_threads;
+}
+
+/* 連続区間に分けて並列実行 */
+void METhreadPool::parallel_for(int num_tasks, const std::function<void(int, int, int)> &func)
+{
+  int threads = num_threads;
+
+  run([num_tasks, threads, &func](int thread_id) {
+      /* スレッドthread_idの担当区間. 余りは先頭のスレッドから1つずつ配る */
+      int chunk = num_tasks / threads, rest = num_tasks % threads;
+      int begin = thread_id * chunk + (thread_id < rest ? thread_id : rest);
+      int end   = begin + chunk + (thread_id < rest ? 1 : 0);
+      if (begin < end) {
+        func(begin, end, thread_id);
+      }
+    });
+}
+
+/* ワークスティーリングで並列実行 */
+void METhreadPool::parallel_for_dynamic(int num_tasks, const std::function<void(int, int)> &func)
+{
+  int threads = num_threads;
+  std::unique_ptr<TaskRange[]> ranges(new TaskRange[threads]);
+
+  /* 最初の配分はparallel_forと同じ連続区間 */
+  int chunk = num_tasks / threads, rest = num_tasks % threads;
+  for (int t_i = 0; t_i < threads; t_i++) {
+    ranges[t_i].begin = t_i * chunk + (t_i < rest ? t_i : rest);
+    ranges[t_i].end   = ranges[t_i].begin + chunk + (t_i < rest ? 1 : 0);
+  }
+
+  TaskRange *range_list = ranges.get();
+  run([threads, range_list, &func](int thread_id) {
+      while (1) {
+        int task = -1;
+
+        /* まず自分の区間の先頭から取る */
+        {
+          TaskRange &own = range_list[thread_id];
+          std::lock_guard<std::mutex> lock(own.range_mutex);
+          if (own.begin < own.end) {
+            task = own.begin++;
+          }
+        }
+
+        /* 自分の区間が空なら, 他のスレッドの区間の末尾から盗む */
+        for (int v_i = 1; task == -1 && v_i < threads; v_i++) {
+          TaskRange &victim = range_list[(thread_id + v_i) % threads];
+          std::lock_guard<std::mutex> lock(victim.range_mutex);
+          if (victim.begin < victim.end) {
+            task = --victim.end;
+          }
+        }
+
+        /* 盗めるタスクも無ければ終了 */
+        if (task == -1) {
+          break;
+        }
+        func(task, thread_id);
+      }
+    });
+}
+
+/* 全スレッドで仕事を実行し, 終わるまで待つ */
+void METhreadPool::run(const std::function<void(int)> &new_job)
+{
+  /* ワーカが居なければ呼び出し元で実行するだけ */
+  if (num_threads == 1) {
+    new_job(0);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    job         = new_job;
+    num_running = num_threads - 1;
+    job_generation++;
+  }
+  start_cond.notify_all();
+
+  /* 呼び出し元はスレッド0の分を実行 */
+  new_job(0);
+
+  /* ワーカの終了を待つ */
+  std::unique_lock<std::mutex> lock(pool_mutex);
+  while (num_running > 0) {
+    finish_cond.wait(lock);
+  }
+  job = std::function<void(int)>();
+}
+
+/* ワーカスレッドの本体: 新しい世代の仕事を待って実行する */
+void METhreadPool::worker_loop(int thread_id)
+{
+  unsigned long done_generation = 0;
+
+  while (1) {
+    std::function<void(int)> current_job;
+    {
+      std::unique_lock<std::mutex> lock(pool_mutex);
+      while (!is_stopping && job_generation == done_generation) {
+        start_cond.wait(lock);
+      }
+      if (is_stopping) {
+        return;
+      }
+      done_generation = job_generation;
+      current_job     = job;
+    }
+
+    current_job(thread_id);
+
+    {
+      std::lock_guard<std::mutex> lock(pool_mutex);
+      num_running--;
+    }
+    finish_cond.notify_one();
+  }
+}
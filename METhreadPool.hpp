@@ -0,0 +1,59 @@
+#ifndef METHREADPOOL_H_INCLUDED
+#define METHREADPOOL_H_INCLUDED
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+/* 学習の並列化に使うスレッドプール.
+   ワーカスレッドは生成時に起動して待機させておき, parallel_forの度に起こす.
+   呼び出し元のスレッドもスレッド0として仕事をする */
+class METhreadPool {
+private:
+  int                                    num_threads;    /* 呼び出し元を含むスレッド数 */
+  std::vector<std::thread>               workers;        /* ワーカスレッド(スレッド1..num_threads-1) */
+  std::mutex                             pool_mutex;     /* 以下の状態の排他制御 */
+  std::condition_variable                start_cond;     /* 仕事開始の通知 */
+  std::condition_variable                finish_cond;    /* 仕事終了の通知 */
+  std::function<void(int)>               job;            /* 現在の仕事. 引数はスレッド番号 */
+  unsigned long                          job_generation; /* 仕事の世代. 新しい仕事が来る度に増える */
+  int                                    num_running;    /* 仕事中のワーカ数 */
+  bool                                   is_stopping;    /* 終了要求 */
+
+  /* 仕事を盗める, スレッド毎の未処理タスクの区間[begin, end).
+     持ち主は先頭から取り, 他のスレッドは末尾から盗む */
+  struct TaskRange {
+    std::mutex range_mutex;
+    int        begin, end;
+  };
+
+public:
+  /* コンストラクタ. num_threadsは呼び出し元を含むスレッド数(1ならワーカを作らない) */
+  METhreadPool(int num_threads);
+  /* デストラクタ. ワーカを止めて合流する */
+  ~METhreadPool(void);
+
+  /* スレッド数の取得 */
+  int get_num_threads(void);
+  /* [0, num_tasks)をスレッド数個の連続した区間に分け,
+     func(begin, end, thread_id)を全スレッドで並列に実行して, 全て終わるまで待つ.
+     区間の分け方はnum_tasksとスレッド数だけで決まる */
+  void parallel_for(int num_tasks, const std::function<void(int, int, int)> &func);
+  /* [0, num_tasks)の各タスクについてfunc(task, thread_id)を並列に実行し, 全て終わるまで待つ.
+     タスク毎の処理時間がばらつく時用: 最初は連続区間に分けて配り, 自分の区間を処理し終えた
+     スレッドは他のスレッドの区間の末尾からタスクを盗む(ワークスティーリング).
+     どのスレッドがどのタスクを処理するかは実行毎に変わるので, 結果はタスク毎に別の場所へ書くこと */
+  void parallel_for_dynamic(int num_tasks, const std::function<void(int, int)> &func);
+
+private:
+  /* 全スレッドでjob(thread_id)を実行し, 終わるまで待つ */
+  void run(const std::function<void(int)> &new_job);
+  /* ワーカスレッドの本体 */
+  void worker_loop(int thread_id);
+
+};
+
+#endif /* METHREADPOOL_H_INCLUDED */
@@ -0,0 +1,120 @@
+#include "METokenizer.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* コンストラクタ */
+METokenizer::METokenizer(void)
+{
+  map_begin = NULL;
+  map_size  = 0;
+  cursor    = NULL;
+  map_end   = NULL;
+}
+
+/* デストラクタ */
+METokenizer::~METokenizer(void)
+{
+  close();
+}
+
+/* ファイルを開いてマップする */
+bool METokenizer::open(const std::string &filename)
+{
+  int fd;
+  struct stat file_stat;
+
+  close();
+
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  if (fstat(fd, &file_stat) == -1) {
+    ::close(fd);
+    return false;
+  }
+
+  /* 空ファイルはマップできないので, 単語が無いものとして扱う */
+  if (file_stat.st_size > 0) {
+    void *map_addr = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map_addr == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    /* 先頭から順に一度だけ読む */
+    madvise(map_addr, file_stat.st_size, MADV_SEQUENTIAL);
+    map_begin = (const char *)map_addr;
+    map_size  = file_stat.st_size;
+  }
+  ::close(fd); /* マップはファイル記述子を閉じても残る */
+
+  cursor  = map_begin;
+  map_end = map_begin + map_size;
+  return true;
+}
+
+/* マップを解除する */
+void METokenizer::close(void)
+{
+  if (map_begin != NULL) {
+    munmap((void *)map_begin, map_size);
+  }
+  map_begin = NULL;
+  map_size  = 0;
+  cursor    = NULL;
+  map_end   = NULL;
+}
+
+/* 区切り文字か判定 */
+bool METokenizer::is_delimiter(char ch)
+{
+  return (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\0');
+}
+
+/* 次の単語を返す */
+bool METokenizer::next_word(const char **word, int *length)
+{
+  /* 区切り文字の読み飛ばし */
+  while (cursor < map_end && is_delimiter(*cursor)) {
+    cursor++;
+  }
+
+  /* ファイルの終端 */
+  if (cursor >= map_end) {
+    return false;
+  }
+
+  /* 次の区切り文字/終端までが単語 */
+  const char *word_begin = cursor;
+  while (cursor < map_end && !is_delimiter(*cursor)) {
+    cursor++;
+  }
+
+  *word   = word_begin;
+  *length = cursor - word_begin;
+  return true;
+}
+
+/* 1行の文字列を単語列に区切る */
+std::vector<std::string> METokenizer::split_words(const std::string &line)
+{
+  std::vector<std::string> words;
+  size_t current = 0;
+
+  while (current < line.size()) {
+    /* 区切り文字を読み飛ばし, 次の区切り文字までを単語にする */
+    while (current < line.size() && is_delimiter(line[current])) {
+      current++;
+    }
+    size_t begin = current;
+    while (current < line.size() && !is_delimiter(line[current])) {
+      current++;
+    }
+    if (current > begin) {
+      words.push_back(std::string(line, begin, current - begin));
+    }
+  }
+  return words;
+}
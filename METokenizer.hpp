@@ -0,0 +1,40 @@
+#ifndef METOKENIZER_H_INCLUDED
+#define METOKENIZER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/* テキストファイルを単語列に区切るトークナイザ.
+   ファイルをmmapし, 単語はマップした領域を指す(先頭, 長さ)の組で返す(単語毎のコピーやヒープ確保をしない).
+   区切り文字は空白, タブ, 改行(と, ナル文字) */
+class METokenizer {
+private:
+  const char *map_begin; /* マップした領域の先頭. 空ファイルや未オープンの時はNULL */
+  size_t      map_size;  /* マップした領域のサイズ */
+  const char *cursor;    /* 次に読む位置 */
+  const char *map_end;   /* 領域の終端 */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  METokenizer(void);
+  ~METokenizer(void);
+
+  /* ファイルを開いてマップする. 開けなければfalse */
+  bool open(const std::string &filename);
+  /* マップを解除する */
+  void close(void);
+  /* 次の単語を返す. 単語の先頭をword, 長さをlengthにセットしてtrue.
+     ファイルの終端に達していればfalse. 単語はcloseするまで有効 */
+  bool next_word(const char **word, int *length);
+  /* 1行の文字列をファイルと同じ区切り文字で単語列に区切る. 区切り文字が続いても空の単語は作らない.
+     REPL, クライアント, サーバの文脈はすべてこれで区切り, 同じ行から同じ文脈を得る */
+  static std::vector<std::string> split_words(const std::string &line);
+
+private:
+  /* 区切り文字か判定 */
+  static bool is_delimiter(char ch);
+
+};
+
+#endif /* METOKENIZER_H_INCLUDED */
@@ -0,0 +1,158 @@
+#include "MEVocabulary.hpp"
+#include <cstring>
+
+/* 初期スロット数（2の冪） */
+static const unsigned int INITIAL_NUM_SLOTS = 16;
+
+/* コンストラクタ */
+MEVocabulary::MEVocabulary(void)
+{
+  clear();
+}
+
+/* デストラクタ */
+MEVocabulary::~MEVocabulary(void) { ; }
+
+/* 単語のハッシュ値(FNV-1a) */
+unsigned int MEVocabulary::hash(const char *word, int length)
+{
+  unsigned int h = 2166136261u;
+
+  for (int i = 0; i < length; i++) {
+    h ^= (unsigned char)word[i];
+    h *= 16777619u;
+  }
+
+  /* 最終的な撹拌 */
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* IDの単語と引数の単語が一致するか */
+bool MEVocabulary::equal_word(int id, const char *word, int length) const
+{
+  if (word_offset[id+1] - word_offset[id] != length) {
+    return false;
+  }
+
+  return (length == 0 || std::memcmp(&word_pool[0] + word_offset[id], word, length) == 0);
+}
+
+/* 単語を探し, IDを返す. 見つからなければ-1 */
+int MEVocabulary::find(const char *word, int length) const
+{
+  unsigned int h    = hash(word, length);
+  unsigned int slot = h & table_mask;
+
+  /* 空きスロットに当たるまで線形探査 */
+  while (table[slot] != -1) {
+    int id = table[slot];
+    if (word_hash[id] == h && equal_word(id, word, length)) {
+      return id;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+
+  return -1;
+}
+
+int MEVocabulary::find(const std::string &word) const
+{
+  return find(word.data(), (int)word.size());
+}
+
+/* 単語を登録してIDを返す */
+int MEVocabulary::insert(const char *word, int length)
+{
+  unsigned int h    = hash(word, length);
+  unsigned int slot = h & table_mask;
+
+  /* 既に登録されていないか探査 */
+  while (table[slot] != -1) {
+    int id = table[slot];
+    if (word_hash[id] == h && equal_word(id, word, length)) {
+      return id;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+
+  /* 新しいIDを割り当て, 単語を連結配列の末尾に追加 */
+  int new_id = size();
+  word_pool.insert(word_pool.end(), word, word + length);
+  word_offset.push_back((int)word_pool.size());
+  word_hash.push_back(h);
+  table[slot] = new_id;
+
+  /* 負荷率が1/2を超えたらスロット数を倍にする */
+  if ((unsigned int)size() * 2 > table_mask + 1) {
+    rehash((table_mask + 1) * 2);
+  }
+
+  return new_id;
+}
+
+int MEVocabulary::insert(const std::string &word)
+{
+  return insert(word.data(), (int)word.size());
+}
+
+/* 登録されている単語の数 */
+int MEVocabulary::size(void) const
+{
+  return (int)word_hash.size();
+}
+
+/* IDから単語の先頭を取得 */
+const char *MEVocabulary::get_word(int id) const
+{
+  return (word_pool.empty() ? "" : &word_pool[0] + word_offset[id]);
+}
+
+/* IDから単語の長さを取得 */
+int MEVocabulary::get_length(int id) const
+{
+  return word_offset[id+1] - word_offset[id];
+}
+
+/* IDから単語を文字列で取得 */
+std::string MEVocabulary::get_string(int id) const
+{
+  return std::string(get_word(id), get_length(id));
+}
+
+/* 全ての単語を削除 */
+void MEVocabulary::clear(void)
+{
+  word_pool.clear();
+  word_offset.assign(1, 0);
+  word_hash.clear();
+  table.assign(INITIAL_NUM_SLOTS, -1);
+  table_mask = INITIAL_NUM_SLOTS - 1;
+}
+
+/* スロット数を変えて全単語を再配置 */
+void MEVocabulary::rehash(unsigned int num_slots)
+{
+  table.assign(num_slots, -1);
+  table_mask = num_slots - 1;
+
+  for (int id = 0; id < size(); id++) {
+    unsigned int slot = word_hash[id] & table_mask;
+    while (table[slot] != -1) {
+      slot = (slot + 1) & table_mask;
+    }
+    table[slot] = id;
+  }
+}
+
+/* 使用しているメモリ量（概算） */
+size_t MEVocabulary::memory_size(void) const
+{
+  return word_pool.capacity() * sizeof(char)
+    + word_offset.capacity() * sizeof(int)
+    + word_hash.capacity() * sizeof(unsigned int)
+    + table.capacity() * sizeof(int);
+}
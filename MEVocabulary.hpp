@@ -0,0 +1,52 @@
+#ifndef MEVOCABULARY_H_INCLUDED
+#define MEVOCABULARY_H_INCLUDED
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/* 単語文字列を密な整数ID(0,1,2,...)に対応付ける語彙表.
+   オープンアドレス法（線形探査）で, 単語の文字列は1本の文字配列に連結して格納する.
+   (先頭, 長さ)の組で引けるので, トークナイザが返す単語を文字列にコピーせずに登録/検索できる.
+   IDは挿入順に振られ, 削除はできない（必要ならclearして作り直す） */
+class MEVocabulary {
+private:
+  std::vector<char>         word_pool;   /* 全単語を連結した文字配列 */
+  std::vector<int>          word_offset; /* ID -> word_pool中の単語の先頭位置. 末尾に番兵を持つ(size()+1要素) */
+  std::vector<unsigned int> word_hash;   /* ID -> 単語のハッシュ値 */
+  std::vector<int>          table;       /* スロット -> ID. 空きスロットは-1 */
+  unsigned int              table_mask;  /* スロット数-1 (スロット数は2の冪) */
+
+public:
+  /* コンストラクタ/デストラクタ */
+  MEVocabulary(void);
+  ~MEVocabulary(void);
+
+  /* 単語を探し, IDを返す. 登録されていなければ-1を返す */
+  int find(const char *word, int length) const;
+  int find(const std::string &word) const;
+  /* 単語を登録してIDを返す. 既に登録されていれば既存のIDを返す */
+  int insert(const char *word, int length);
+  int insert(const std::string &word);
+  /* 登録されている単語の数 */
+  int size(void) const;
+  /* IDから単語を取得する(文字列はナル終端していない) */
+  const char *get_word(int id) const;
+  int get_length(int id) const;
+  std::string get_string(int id) const;
+  /* 全ての単語を削除 */
+  void clear(void);
+  /* 使用しているメモリ量[byte]（概算） */
+  size_t memory_size(void) const;
+
+private:
+  /* 単語のハッシュ値 */
+  static unsigned int hash(const char *word, int length);
+  /* IDの単語と引数の単語が一致するか */
+  bool equal_word(int id, const char *word, int length) const;
+  /* スロット数を変えて全単語を再配置 */
+  void rehash(unsigned int num_slots);
+
+};
+
+#endif /* MEVOCABULARY_H_INCLUDED */
@@ -1,26 +1,53 @@
 #include "MEModel.hpp"
+#include "MECRF.hpp"
+#include "MEServer.hpp"
+#include "MEClient.hpp"
+#include "METokenizer.hpp"
 #include <cstdio>
 #include <getopt.h>
 #include <boost/filesystem.hpp>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 static void print_usage(void);                                                 /* 使い方を印字 */
 static std::vector<std::string> split(const std::string &str, char delim); /* 文字列をdelimで区切ってvectorにする */
 static std::set<std::string> split_to_set(const std::string &str, char delim); /* 文字列をdelimで区切って集合にする */
+static int run_client(const std::string &socket_path, int completion_length, int beam_width); /* クライアントモードのREPL */
+static bool collect_files(const std::vector<std::string> &input_paths, const std::set<std::string> &extension_list,
+                          bool is_verbose, std::vector<std::string> &file_names); /* 読み込むファイルの走査 */
 
 int main(int argc, char **argv)
 {
   int option;                                  /* 実行時引数で選ばれたオプション */
   int maxN_gram = 3;                           /* 最大の素性Nグラム数 */
   int count_bias = 1;                          /* カウントバイアス : 頻度がこの値以下の素性は削除される */
+  int num_threads = 1;                         /* 学習に使うスレッド数 */
+  long candidate_memory_mb = (long)(MAX_CANDIDATE_MEMORY >> 20); /* 素性候補が使ってよいメモリ量[MB] */
+  MEOptimizerType optimizer_type = OPTIMIZER_GIS; /* 学習に使う最適化手法 */
+  double prior_variance = PRIOR_VARIANCE;      /* L-BFGS法のガウス事前分布の分散 */
+  bool is_streaming = false;                   /* ミニバッチSGDによるストリーミング学習を使うか */
+  double l1_coefficient = SGD_L1_COEFFICIENT;  /* ストリーミング学習のL1正則化の係数 */
+  int crf_length = 0;                          /* CRFで補完する単語列の長さ. 0ならCRFを使わない */
+  int completion_length = 0;                   /* ビーム探索で補完する単語列の最大長. 0なら補完しない */
+  int beam_width = COMPLETION_BEAM_WIDTH;      /* 補完のビーム幅 */
+  std::set<std::string> stop_words;            /* 補完を終える単語の集合 */
+  std::vector<std::string> input_paths;        /* 引数で与えたファイル/ディレクトリ */
   std::vector<std::string> read_file_name_buf; /* 読み込むファイル名（フルパス）のバッファ */
   std::set<std::string>    extension_list;     /* 読み込む拡張子リスト */
+  std::string save_file_name;                  /* モデルの保存先ファイル名 */
+  std::string load_file_name;                  /* モデルの読み込み元ファイル名 */
+  std::string update_file_name;                /* 更新モードで更新するモデルのファイル名 */
+  std::string server_socket_path;              /* サーバモードで待ち受けるソケットのパス */
+  std::string client_socket_path;              /* クライアントモードで接続するソケットのパス */
+  int retrain_interval = 0;                    /* サーバモードで読んだファイルから学習し直す間隔[秒]. 0なら学習し直さない */
   MEModel *model;                              /* 最大エントロピーモデル */
+  MECRF *crf = NULL;                           /* 単語列の補完に使う線形連鎖CRF */
 
-  namespace fs = boost::filesystem;            /* boostの名前空間 */
 
   /* オプション付きの引数の処理 */
-  while ((option = getopt(argc, argv, "g:c:e:s")) != -1) {
+  while ((option = getopt(argc, argv, "g:c:e:m:t:s:l:o:p:r:u:k:n:b:w:d:a:i:")) != -1) {
     switch (option) {
       case 'g': /* 最大グラム数の指定 (デフォルト:3) */
         maxN_gram = strtol(optarg, (char **)NULL, 10);
@@ -31,7 +58,60 @@ int main(int argc, char **argv)
       case 'e': /* 読み込むファイルの拡張子を指定 ex) -e ".c .h .hpp .cpp" */
         extension_list = split_to_set(std::string(optarg), ' ');
         break;
-      case 's': /* 素性の保存 */
+      case 'm': /* 素性候補が使ってよいメモリ量[MB]の指定 (デフォルト:512) */
+        candidate_memory_mb = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'o': /* 最適化手法の指定 gis|lbfgs|sgd (デフォルト:gis) */
+        if (std::string(optarg) == "sgd") {
+          is_streaming = true;
+        } else if (std::string(optarg) == "gis") {
+          optimizer_type = OPTIMIZER_GIS;
+        } else if (std::string(optarg) == "lbfgs") {
+          optimizer_type = OPTIMIZER_LBFGS;
+        } else {
+          std::cout << "Error : unknown optimizer \"" << optarg << "\"" << std::endl;
+          print_usage();
+          exit(1);
+        }
+        break;
+      case 'p': /* L-BFGS法のガウス事前分布の分散の指定. 0で事前分布なし (デフォルト:1.0) */
+        prior_variance = strtod(optarg, (char **)NULL);
+        break;
+      case 'r': /* ストリーミング学習のL1正則化の係数の指定 (デフォルト:1e-5) */
+        l1_coefficient = strtod(optarg, (char **)NULL);
+        break;
+      case 't': /* 学習に使うスレッド数の指定 (デフォルト:1) */
+        num_threads = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 's': /* 学習したモデルの保存先 */
+        save_file_name = optarg;
+        break;
+      case 'l': /* 学習済みモデルの読み込み : コーパスの読み込みと学習を省略する */
+        load_file_name = optarg;
+        break;
+      case 'u': /* 更新モード : 学習済みモデルを読み, 追加/変更されたファイルだけを読み足して学習し直す */
+        update_file_name = optarg;
+        break;
+      case 'k': /* CRFによる単語列の補完 : 補完する単語数の指定 */
+        crf_length = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'n': /* ビーム探索による単語列の補完 : 補完する最大の単語数の指定 */
+        completion_length = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'b': /* 補完のビーム幅の指定 (デフォルト:4) */
+        beam_width = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'w': /* 補完を終える単語の指定 ex) -w "; { }" */
+        stop_words = split_to_set(std::string(optarg), ' ');
+        break;
+      case 'd': /* サーバモード : 学習/読み込みしたモデルを常駐させ, ソケットで要求を受け付ける */
+        server_socket_path = std::string(optarg);
+        break;
+      case 'i': /* サーバモードの再学習の間隔[秒]の指定 : 追加/変更されたファイルを読み足して学習し直し, 予測器を差し替える */
+        retrain_interval = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'a': /* クライアントモード : モデルを作らず, 起動中のサーバに問い合わせる */
+        client_socket_path = std::string(optarg);
         break;
       case ':': /* 値が必要なオプションに値が設定されていない */ /* FALLTHRU */
         std::cout << "Error : may be forgotten option value" << std::endl;
@@ -42,42 +122,126 @@ int main(int argc, char **argv)
     }
   }
 
+  /* クライアントモード : モデルは作らない */
+  if (!client_socket_path.empty()) {
+    return run_client(client_socket_path, completion_length, beam_width);
+  }
+
   std::cout << "N_gram : " << maxN_gram << " Bias : " << count_bias << std::endl;
 
   /* optindは引数インデックス */
-  if (optind == argc) {
+  if (optind == argc && load_file_name.empty()) {
+    print_usage();
+    exit(1);
+  }
+  /* 再学習は読んだファイルの変化を見るので, 読み込むファイルが無ければできない */
+  if (optind == argc && retrain_interval > 0) {
+    std::cout << "Error : -i needs files or directories to re-read." << std::endl;
     print_usage();
     exit(1);
   }
 
-  bool is_all = (extension_list.size() == 0);
-  /* 読み込みファイルの走査 */
-  for (; optind < argc; optind++) {
-    fs::path path(argv[optind]);
+  /* 読み込みファイルの走査. 再学習では同じ引数から毎回走査し直す */
+  input_paths.assign(argv + optind, argv + argc);
+  if (!collect_files(input_paths, extension_list, true, read_file_name_buf)) {
+    exit(1);
+  }
 
-    if (fs::is_regular_file(path)) {
-      /* 単一ファイルの読み込み */
-      read_file_name_buf.push_back(path.string());
-      std::cout << "GET: " << path.string() << std::endl;
-    } else if ( fs::is_directory(path) ) {
-      /* ディレクトリの場合 : ディレクトリ以下を走査 */
-      fs::recursive_directory_iterator last;
-      for ( fs::recursive_directory_iterator itr(path); itr != last; itr++ ) {
-        if (is_all || extension_list.count(itr->path().extension().string()) > 0) {
-          std::cout << "GET: " << itr->path() << std::endl;
-          read_file_name_buf.push_back(("./" + itr->path().string()));
+  model = new MEModel(maxN_gram, count_bias);
+  model->set_candidate_memory_budget((size_t)candidate_memory_mb << 20);
+  model->set_num_threads(num_threads);
+  model->set_optimizer(optimizer_type);
+  model->set_prior_variance(prior_variance);
+  model->set_l1_coefficient(l1_coefficient);
+
+  if (!update_file_name.empty()) {
+    /* 更新モード : 保存先を指定しなければ, 読んだモデルファイルを上書きする */
+    if (!model->load_model(update_file_name) || !model->update_model(read_file_name_buf)) {
+      delete model;
+      exit(1);
+    }
+    if (save_file_name.empty()) {
+      save_file_name = update_file_name;
+    }
+  } else if (!load_file_name.empty()) {
+    /* 学習済みモデルの読み込み */
+    if (!model->load_model(load_file_name)) {
+      delete model;
+      exit(1);
+    }
+    std::cout << "Model loaded from " << load_file_name << std::endl;
+  } else if (is_streaming) {
+    /* ストリーミング学習 : 素性候補を作らずにファイルを流し込む */
+    model->stream_learning(read_file_name_buf);
+  } else {
+    /* モデルの生成, 素性選択 */
+    if (!model->read_file_str_list(read_file_name_buf)) {
+      delete model;
+      exit(1);
+    }
+    //model->print_candidate_features_info();
+    model->feature_selection();
+    //model->print_model_features_info();
+  }
+
+  /* モデルの保存 */
+  if (!save_file_name.empty()) {
+    if (!model->save_model(save_file_name)) {
+      delete model;
+      exit(1);
+    }
+    std::cout << "Model saved to " << save_file_name << std::endl;
+  }
+
+  /* CRFの学習. モデルの予測器を節点ポテンシャルに使い, 読んだファイルから遷移素性を学習する */
+  if (crf_length > 0) {
+    crf = new MECRF(model->get_predictor(), CRF_SEQUENCE_LENGTH, count_bias, num_threads);
+    crf->set_prior_variance(prior_variance);
+    crf->read_file_str_list(read_file_name_buf);
+    crf->learning();
+  }
+
+  /* サーバモード : 停止要求が来るまで要求を処理し, REPLには入らない.
+     再学習はバックグラウンドのスレッドで行い, 学習が終わる毎に予測器のスナップショットが差し替わる.
+     要求はその時のスナップショットで答えるので, 学習中も待たされない */
+  if (!server_socket_path.empty()) {
+    MEServer server(model, stop_words);
+    std::mutex retrain_mutex;
+    std::condition_variable retrain_wakeup;
+    bool is_serving = true;
+    std::thread retrainer;
+    if (retrain_interval > 0) {
+      retrainer = std::thread([&]() {
+        std::unique_lock<std::mutex> lock(retrain_mutex);
+        while (!retrain_wakeup.wait_for(lock, std::chrono::seconds(retrain_interval), [&]() { return !is_serving; })) {
+          lock.unlock();
+          /* ファイルを走査し直して, 前回から増えたファイルも読む. 走査し切れなければ消えたファイルと区別できないので見送る.
+             失敗しても予測器は差し替わらないので, 前のモデルで答え続けて次の周期にまた試す */
+          std::vector<std::string> file_names;
+          if (!collect_files(input_paths, extension_list, false, file_names)
+              || !model->update_model(file_names)) {
+            std::cerr << "Error : retraining failed. Serving the previous model." << std::endl;
+          } else if (!save_file_name.empty() && !model->save_model(save_file_name)) {
+            std::cerr << "Error : cannot save the retrained model. \"" << save_file_name << "\" keeps the previous model." << std::endl;
+          }
+          lock.lock();
         }
+      });
+    }
+    bool is_served = server.serve(server_socket_path);
+    if (retrainer.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(retrain_mutex);
+        is_serving = false;
       }
+      retrain_wakeup.notify_all();
+      retrainer.join();
     }
+    delete crf;
+    delete model;
+    return (is_served ? 0 : 1);
   }
 
-  /* モデルの生成, 素性選択 */
-  model = new MEModel(maxN_gram, count_bias);
-  model->read_file_str_list(read_file_name_buf);
-  //model->print_candidate_features_info();
-  model->feature_selection();
-  //model->print_model_features_info();
-
   /* REPL(インタラクティブ)に使いたい... */
   std::string repl_line;
   /* quitで終了も... うーん */
@@ -86,14 +250,41 @@ int main(int argc, char **argv)
     std::cout << std::endl;
     std::cout << ">> ";
     std::getline(std::cin, repl_line);
-    if (repl_line == "quit") {
+    if (repl_line == "quit" || !std::cin) {
+      unsigned long cache_hits, cache_misses;
+      model->get_cache_statistics(&cache_hits, &cache_misses);
+      std::cout << "Context cache hits : " << cache_hits << " misses : " << cache_misses << std::endl;
       break;
     } else {
-      pattern = split(repl_line, ' ');
-      model->get_ranking(pattern, 10);
+      pattern = METokenizer::split_words(repl_line);
+      std::vector<std::pair<int, double> > ranking = model->get_ranking(pattern, 10);
+      for (int rank = 0; rank < (int)ranking.size(); rank++) {
+        std::cout << "Rank " << rank+1 << " : " << model->convert_pattern_to_string(ranking[rank].first);
+        std::cout << " Prob. : " << ranking[rank].second << std::endl;
+      }
+      if (completion_length > 0) {
+        std::vector<std::pair<std::vector<std::string>, double> > completions
+          = model->get_completions(pattern, completion_length, beam_width, COMPLETION_RESULTS, stop_words);
+        for (int c_i = 0; c_i < (int)completions.size(); c_i++) {
+          std::cout << "Sequence " << c_i+1 << " :";
+          for (int i = 0; i < (int)completions[c_i].first.size(); i++) {
+            std::cout << " " << completions[c_i].first[i];
+          }
+          std::cout << " Prob. : " << completions[c_i].second << std::endl;
+        }
+      }
+      if (crf != NULL) {
+        std::pair<std::vector<std::string>, double> completion = crf->viterbi(pattern, crf_length);
+        std::cout << "Completion :";
+        for (int i = 0; i < (int)completion.first.size(); i++) {
+          std::cout << " " << completion.first[i];
+        }
+        std::cout << " Prob. : " << completion.second << std::endl;
+      }
     }
   }
 
+  delete crf;
   delete model;
   return 0;
 
@@ -103,11 +294,24 @@ int main(int argc, char **argv)
 static void print_usage(void)
 {
   std::cout << "Usage :" << std::endl;
-  std::cout << "./mepredict [-g maxN_gram] [-c count_bias] [-s] [-l filename] -e extensions filedir" << std::endl;
+  std::cout << "./mepredict [-g maxN_gram] [-c count_bias] [-m memory_mb] [-t num_threads] [-o gis|lbfgs|sgd] [-p prior_variance] [-r l1_coefficient] [-s filename] [-l filename] [-u filename] [-k length] [-n length] [-b beam_width] [-w stop_words] [-d socket_path] [-i seconds] [-a socket_path] -e extensions filedir" << std::endl;
   std::cout << "-g maxN_gram(int) : set maximum N-gram model length to maxN_gram" << std::endl;
   std::cout << "-c count_bias(int) : set count bias to count_bias." << std::endl;
-  std::cout << "-s : save model features." << std::endl;
-  std::cout << "-l : load model features from filename" << std::endl;
+  std::cout << "-m memory_mb(int) : memory budget for pattern counts in MB. the summed counts and the per-file counts each stay within it. (default 512)" << std::endl;
+  std::cout << "-t num_threads(int) : number of threads used for learning. (default 1)" << std::endl;
+  std::cout << "-o gis|lbfgs|sgd : optimizer used for learning parameters. sgd streams the files without feature selection. (default gis)" << std::endl;
+  std::cout << "-p prior_variance(double) : variance of the Gaussian prior for lbfgs. 0 disables the prior. (default 1.0)" << std::endl;
+  std::cout << "-r l1_coefficient(double) : L1 regularization coefficient for sgd. (default 1e-5)" << std::endl;
+  std::cout << "-s filename : save the trained model to filename." << std::endl;
+  std::cout << "-l filename : load a trained model from filename. (skip reading files and learning)" << std::endl;
+  std::cout << "-u filename : update the model in filename by reading only added or modified files (the saved per-file counts of modified or removed files are subtracted), then save it back (or to -s filename)." << std::endl;
+  std::cout << "-k length(int) : also complete the next length words with a linear-chain CRF trained on the files. (default 0: off)" << std::endl;
+  std::cout << "-n length(int) : also show multi-word completions of up to length words found by beam search. (default 0: off)" << std::endl;
+  std::cout << "-b beam_width(int) : beam width for -n completions. (default 4)" << std::endl;
+  std::cout << "-w stop_words : words that end a -n completion. ex) -w \"; { }\"" << std::endl;
+  std::cout << "-d socket_path : serve predictions on a Unix domain socket instead of the REPL, until a client sends shutdown." << std::endl;
+  std::cout << "-i seconds(int) : with -d, every seconds rescan filedir, re-read added or modified files and retrain in the background, swapping in the new model without stopping the server. needs filedir. (default 0: off)" << std::endl;
+  std::cout << "-a socket_path : query a server started with -d instead of building a model. (-n and -b are passed to the server)" << std::endl;
   std::cout << "-e : file extension list. ex) -e \".cpp .hpp .c .h\" " << std::endl;
   std::cout << "filedir : can directory name. If you set directory name, read all files are in the directory." << std::endl;
 }
@@ -131,3 +335,97 @@ static std::set<std::string> split_to_set(const std::string &str, char delim){
   std::set<std::string> set_str(split_str.begin(), split_str.end());
   return set_str;
 }
+
+/* 引数のファイル/ディレクトリから読み込むファイルをfile_namesに集める. ディレクトリは以下を再帰的に走査し,
+   拡張子リストが空でなければ拡張子の合うファイルだけを集める. is_verboseなら集めたファイルを印字する.
+   無いパスは飛ばす. 再学習のスレッドからも呼ぶので例外は投げず, ディレクトリを走査し切れなければfalse */
+static bool collect_files(const std::vector<std::string> &input_paths, const std::set<std::string> &extension_list,
+                          bool is_verbose, std::vector<std::string> &file_names)
+{
+  namespace fs = boost::filesystem;            /* boostの名前空間 */
+  bool is_all = (extension_list.size() == 0);
+  boost::system::error_code error;
+
+  file_names.clear();
+  for (int p_i = 0; p_i < (int)input_paths.size(); p_i++) {
+    fs::path path(input_paths[p_i]);
+
+    if (fs::is_regular_file(path, error)) {
+      /* 単一ファイルの読み込み */
+      file_names.push_back(path.string());
+      if (is_verbose) {
+        std::cout << "GET: " << path.string() << std::endl;
+      }
+    } else if (fs::is_directory(path, error)) {
+      /* ディレクトリの場合 : ディレクトリ以下を走査 */
+      fs::recursive_directory_iterator last;
+      for (fs::recursive_directory_iterator itr(path, error); !error && itr != last; itr.increment(error)) {
+        if (is_all || extension_list.count(itr->path().extension().string()) > 0) {
+          if (is_verbose) {
+            std::cout << "GET: " << itr->path() << std::endl;
+          }
+          file_names.push_back(("./" + itr->path().string()));
+        }
+      }
+      if (error) {
+        std::cerr << "Error : cannot scan directory " << path << " : " << error.message() << std::endl;
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/* クライアントモードのREPL. 表示はモデルを持つ時のREPLと同じ. shutdownでサーバを止めて終わる */
+static int run_client(const std::string &socket_path, int completion_length, int beam_width)
+{
+  MEClient client;
+  std::string repl_line;
+
+  if (!client.connect(socket_path)) {
+    return 1;
+  }
+  std::cout << "Connected to " << socket_path << std::endl;
+
+  while (1) {
+    std::vector<std::string> pattern;
+    std::cout << std::endl;
+    std::cout << ">> ";
+    std::getline(std::cin, repl_line);
+    if (repl_line == "quit" || !std::cin) {
+      break;
+    } else if (repl_line == "shutdown") {
+      if (!client.shutdown_server()) {
+        return 1;
+      }
+      std::cout << "Server shut down." << std::endl;
+      break;
+    } else {
+      pattern = METokenizer::split_words(repl_line);
+      std::vector<std::pair<std::string, double> > ranking;
+      if (!client.get_ranking(pattern, 10, ranking)) {
+        return 1;
+      }
+      for (int rank = 0; rank < (int)ranking.size(); rank++) {
+        std::cout << "Rank " << rank+1 << " : " << ranking[rank].first;
+        std::cout << " Prob. : " << ranking[rank].second << std::endl;
+      }
+      if (completion_length > 0) {
+        std::vector<std::pair<std::vector<std::string>, double> > completions;
+        if (!client.get_completions(pattern, completion_length, beam_width, COMPLETION_RESULTS, completions)) {
+          return 1;
+        }
+        for (int c_i = 0; c_i < (int)completions.size(); c_i++) {
+          std::cout << "Sequence " << c_i+1 << " :";
+          for (int i = 0; i < (int)completions[c_i].first.size(); i++) {
+            std::cout << " " << completions[c_i].first[i];
+          }
+          std::cout << " Prob. : " << completions[c_i].second << std::endl;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include "MEModel.hpp"
+#include "METokenizer.hpp"
+#include <cstdio>
+#include <getopt.h>
+#include <boost/filesystem.hpp>
+#include <iostream>
+#include <iomanip>
+
+/* 次単語予測の評価/ベンチマーク.
+   学習用ディレクトリでモデルを学習し, 評価用ディレクトリの各単語を直前の(maxN_gram-1)語から予測して,
+   top-1/5/10正解率, パープレキシティ, 1問い合わせ毎の遅延(p50/p99)と, 学習の各段階の所要時間を報告する */
+
+const int    EVAL_RANKING_SIZE   = 10;    /* 評価するランキングの長さ(top-10まで) */
+const int    EVAL_BATCH_SIZE     = 65536; /* バッチ予測1回あたりの文脈数 */
+const int    LATENCY_SAMPLE_SIZE = 10000; /* 遅延を測る問い合わせの数(評価位置から等間隔に選ぶ) */
+
+static void print_usage(void);                                                 /* 使い方を印字 */
+static std::set<std::string> split_to_set(const std::string &str, char delim); /* 文字列をdelimで区切って集合にする */
+static void collect_files(const std::string &path_name, const std::set<std::string> &extension_list,
+                          std::vector<std::string> &file_names);              /* パス以下の読み込むファイルを集める */
+static void print_phase_times(const std::vector<std::pair<std::string, double> > &phase_times); /* 段階毎の所要時間を印字 */
+static double percentile(std::vector<double> values, double ratio);            /* 値のratio分位点 */
+
+int main(int argc, char **argv)
+{
+  int option;                                  /* 実行時引数で選ばれたオプション */
+  int maxN_gram = 3;                           /* 最大の素性Nグラム数 */
+  int count_bias = 1;                          /* カウントバイアス */
+  int num_threads = 1;                         /* 学習/評価に使うスレッド数 */
+  long candidate_memory_mb = (long)(MAX_CANDIDATE_MEMORY >> 20); /* 素性候補が使ってよいメモリ量[MB] */
+  MEOptimizerType optimizer_type = OPTIMIZER_GIS; /* 学習に使う最適化手法 */
+  double prior_variance = PRIOR_VARIANCE;      /* L-BFGS法のガウス事前分布の分散 */
+  bool is_streaming = false;                   /* ミニバッチSGDによるストリーミング学習を使うか */
+  double l1_coefficient = SGD_L1_COEFFICIENT;  /* ストリーミング学習のL1正則化の係数 */
+  std::set<std::string>    extension_list;     /* 読み込む拡張子リスト */
+  std::vector<std::string> train_file_names;   /* 学習用ファイル */
+  std::vector<std::string> test_file_names;    /* 評価用ファイル */
+  MEModel *model;                              /* 最大エントロピーモデル */
+
+  /* オプション付きの引数の処理 */
+  while ((option = getopt(argc, argv, "g:c:e:m:t:o:p:r:")) != -1) {
+    switch (option) {
+      case 'g': /* 最大グラム数の指定 (デフォルト:3) */
+        maxN_gram = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'c': /* カウントバイアスの指定 (デフォルト:1) */
+        count_bias = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'e': /* 読み込むファイルの拡張子を指定 */
+        extension_list = split_to_set(std::string(optarg), ' ');
+        break;
+      case 'm': /* 素性候補が使ってよいメモリ量[MB]の指定 */
+        candidate_memory_mb = strtol(optarg, (char **)NULL, 10);
+        break;
+      case 'o': /* 最適化手法の指定 gis|lbfgs|sgd (デフォルト:gis) */
+        if (std::string(optarg) == "sgd") {
+          is_streaming = true;
+        } else if (std::string(optarg) == "gis") {
+          optimizer_type = OPTIMIZER_GIS;
+        } else if (std::string(optarg) == "lbfgs") {
+          optimizer_type = OPTIMIZER_LBFGS;
+        } else {
+          std::cout << "Error : unknown optimizer \"" << optarg << "\"" << std::endl;
+          print_usage();
+          exit(1);
+        }
+        break;
+      case 'p': /* L-BFGS法のガウス事前分布の分散の指定. 0で事前分布なし (デフォルト:1.0) */
+        prior_variance = strtod(optarg, (char **)NULL);
+        break;
+      case 'r': /* ストリーミング学習のL1正則化の係数の指定 (デフォルト:1e-5) */
+        l1_coefficient = strtod(optarg, (char **)NULL);
+        break;
+      case 't': /* スレッド数の指定 (デフォルト:1) */
+        num_threads = strtol(optarg, (char **)NULL, 10);
+        break;
+      default:
+        print_usage();
+        exit(1);
+    }
+  }
+
+  if (argc - optind != 2) {
+    print_usage();
+    exit(1);
+  }
+  collect_files(argv[optind], extension_list, train_file_names);
+  collect_files(argv[optind+1], extension_list, test_file_names);
+  std::cout << "N_gram : " << maxN_gram << " Bias : " << count_bias
+            << " Train files : " << train_file_names.size()
+            << " Test files : " << test_file_names.size() << std::endl;
+
+  /* 学習 */
+  model = new MEModel(maxN_gram, count_bias);
+  model->set_candidate_memory_budget((size_t)candidate_memory_mb << 20);
+  model->set_num_threads(num_threads);
+  model->set_optimizer(optimizer_type);
+  model->set_prior_variance(prior_variance);
+  model->set_l1_coefficient(l1_coefficient);
+  if (is_streaming) {
+    model->stream_learning(train_file_names);
+  } else {
+    if (!model->read_file_str_list(train_file_names)) {
+      delete model;
+      exit(1);
+    }
+    model->feature_selection();
+  }
+
+  /* 評価位置の作成: 各ファイルの各単語を, 同じファイル内の直前(maxN_gram-1)語から予測する */
+  std::vector<std::vector<std::string> > contexts;
+  std::vector<std::string>               targets;
+  for (int file_i = 0; file_i < (int)test_file_names.size(); file_i++) {
+    METokenizer tokenizer;
+    const char *word;
+    int word_length;
+    std::vector<std::string> history;
+
+    if (!tokenizer.open(test_file_names[file_i])) {
+      std::cerr << "Error : cannot open file \"" << test_file_names[file_i] << "\"." << std::endl;
+      continue;
+    }
+    while (tokenizer.next_word(&word, &word_length)) {
+      std::string target(word, word_length);
+      contexts.push_back(history);
+      targets.push_back(target);
+      history.push_back(target);
+      if ((int)history.size() > maxN_gram-1) {
+        history.erase(history.begin());
+      }
+    }
+  }
+
+  /* バッチ予測による正解率とパープレキシティ */
+  long num_positions = contexts.size(), num_oov = 0;
+  long num_correct[EVAL_RANKING_SIZE+1] = {0};   /* num_correct[k] : 正解がtop-kに入った数 */
+  double sum_log_prob = 0.0f;
+  std::chrono::steady_clock::time_point eval_start = std::chrono::steady_clock::now();
+  for (long batch_begin = 0; batch_begin < num_positions; batch_begin += EVAL_BATCH_SIZE) {
+    long batch_end = std::min(batch_begin + EVAL_BATCH_SIZE, num_positions);
+    std::vector<std::vector<std::string> > batch_contexts(contexts.begin() + batch_begin, contexts.begin() + batch_end);
+    std::vector<std::string>               batch_targets(targets.begin() + batch_begin, targets.begin() + batch_end);
+    std::vector<int>    ranking_ids;
+    std::vector<double> ranking_probs, target_probs;
+
+    model->get_ranking_batch(batch_contexts, EVAL_RANKING_SIZE, ranking_ids, ranking_probs,
+                             &batch_targets, &target_probs);
+
+    for (long b_i = 0; b_i < batch_end - batch_begin; b_i++) {
+      /* 正解の順位 */
+      for (int rank = 0; rank < EVAL_RANKING_SIZE; rank++) {
+        int word_id = ranking_ids[b_i * EVAL_RANKING_SIZE + rank];
+        if (word_id != -1 && model->convert_pattern_to_string(word_id) == batch_targets[b_i]) {
+          for (int k = rank+1; k <= EVAL_RANKING_SIZE; k++) {
+            num_correct[k]++;
+          }
+          break;
+        }
+      }
+      /* 学習データに無い単語はパープレキシティから除く */
+      if (target_probs[b_i] > 0.0f) {
+        sum_log_prob += log(target_probs[b_i]);
+      } else {
+        num_oov++;
+      }
+    }
+  }
+  std::chrono::duration<double> eval_time = std::chrono::steady_clock::now() - eval_start;
+
+  /* 1問い合わせ毎の遅延. 評価位置から等間隔に選んだ文脈で単体のget_rankingを測る.
+     キャッシュを空にした直後の1回目(cold)と, 同じ文脈の2回目(warm: キャッシュに載っている)を分けて測る.
+     clear_cacheはヒット数/ミス数も0に戻すので, 文脈毎の統計を足し合わせてcold/warmの分かれ方を確かめる */
+  std::vector<double> cold_latencies, warm_latencies;
+  unsigned long latency_hits = 0, latency_misses = 0;
+  long sample_step = std::max(1L, num_positions / LATENCY_SAMPLE_SIZE);
+  for (long p_i = 0; p_i < num_positions; p_i += sample_step) {
+    unsigned long cache_hits, cache_misses;
+    model->clear_cache();
+    for (int trial = 0; trial < 2; trial++) {
+      std::chrono::steady_clock::time_point query_start = std::chrono::steady_clock::now();
+      model->get_ranking(contexts[p_i], EVAL_RANKING_SIZE);
+      std::chrono::duration<double> query_time = std::chrono::steady_clock::now() - query_start;
+      (trial == 0 ? cold_latencies : warm_latencies).push_back(query_time.count());
+    }
+    model->get_cache_statistics(&cache_hits, &cache_misses);
+    latency_hits   += cache_hits;
+    latency_misses += cache_misses;
+  }
+
+  /* 結果の印字 */
+  long num_known = num_positions - num_oov;
+  std::cout << std::endl << "******** Evaluation ********" << std::endl;
+  std::cout << "Positions : " << num_positions << " (OOV targets : " << num_oov << ")" << std::endl;
+  if (num_positions > 0) {
+    std::cout << "Top-1 accuracy : "  << (double)num_correct[1] / num_positions << std::endl;
+    std::cout << "Top-5 accuracy : "  << (double)num_correct[5] / num_positions << std::endl;
+    std::cout << "Top-10 accuracy : " << (double)num_correct[10] / num_positions << std::endl;
+  }
+  if (num_known > 0) {
+    std::cout << "Perplexity (in-vocabulary targets) : " << exp(-sum_log_prob / num_known) << std::endl;
+  }
+  std::cout << "Batch evaluation time : " << eval_time.count() << " sec" << std::endl;
+  if (!cold_latencies.empty()) {
+    std::cout << "Query latency (cold) p50 : " << percentile(cold_latencies, 0.50) * 1e6 << " usec"
+              << " p99 : " << percentile(cold_latencies, 0.99) * 1e6 << " usec"
+              << " (" << cold_latencies.size() << " queries)" << std::endl;
+    std::cout << "Query latency (warm) p50 : " << percentile(warm_latencies, 0.50) * 1e6 << " usec"
+              << " p99 : " << percentile(warm_latencies, 0.99) * 1e6 << " usec"
+              << " (" << warm_latencies.size() << " queries)" << std::endl;
+    std::cout << "Context cache hits : " << latency_hits << " misses : " << latency_misses
+              << " (latency queries)" << std::endl;
+  }
+  print_phase_times(model->get_phase_times());
+
+  delete model;
+  return 0;
+}
+
+/* 引数の説明を印字 */
+static void print_usage(void)
+{
+  std::cout << "Usage :" << std::endl;
+  std::cout << "./nextword_test [-g maxN_gram] [-c count_bias] [-m memory_mb] [-t num_threads] [-o gis|lbfgs|sgd] [-p prior_variance] [-r l1_coefficient] [-e extensions] traindir testdir" << std::endl;
+  std::cout << "-g maxN_gram(int) : set maximum N-gram model length to maxN_gram" << std::endl;
+  std::cout << "-c count_bias(int) : set count bias to count_bias." << std::endl;
+  std::cout << "-m memory_mb(int) : memory budget for candidate features in MB. (default 512)" << std::endl;
+  std::cout << "-t num_threads(int) : number of threads used for learning and evaluation. (default 1)" << std::endl;
+  std::cout << "-o gis|lbfgs|sgd : optimizer used for learning parameters. sgd streams the files without feature selection. (default gis)" << std::endl;
+  std::cout << "-p prior_variance(double) : variance of the Gaussian prior for lbfgs. 0 disables the prior. (default 1.0)" << std::endl;
+  std::cout << "-r l1_coefficient(double) : L1 regularization coefficient for sgd. (default 1e-5)" << std::endl;
+  std::cout << "-e : file extension list. ex) -e \".cpp .hpp .c .h\" " << std::endl;
+  std::cout << "traindir : file or directory to learn the model from." << std::endl;
+  std::cout << "testdir : held-out file or directory to evaluate next word prediction on." << std::endl;
+}
+
+/* パス以下の読み込むファイルを集める */
+static void collect_files(const std::string &path_name, const std::set<std::string> &extension_list,
+                          std::vector<std::string> &file_names)
+{
+  namespace fs = boost::filesystem;
+  fs::path path(path_name);
+  bool is_all = (extension_list.size() == 0);
+
+  if (fs::is_regular_file(path)) {
+    file_names.push_back(path.string());
+  } else if (fs::is_directory(path)) {
+    fs::recursive_directory_iterator last;
+    for (fs::recursive_directory_iterator itr(path); itr != last; itr++) {
+      if (fs::is_regular_file(itr->path())
+          && (is_all || extension_list.count(itr->path().extension().string()) > 0)) {
+        file_names.push_back(itr->path().string());
+      }
+    }
+    /* 走査順はファイルシステム依存なので, 名前順にして結果を再現可能にする */
+    std::sort(file_names.begin(), file_names.end());
+  } else {
+    std::cerr << "Error : \"" << path_name << "\" is not a file or directory." << std::endl;
+  }
+}
+
+/* 段階毎の所要時間を, 同じ名前の段階をまとめて(回数, 合計, 最大)で印字する. 順序は最初に現れた順 */
+static void print_phase_times(const std::vector<std::pair<std::string, double> > &phase_times)
+{
+  std::vector<std::string>  names;
+  std::map<std::string, int>    count;
+  std::map<std::string, double> total, max_time;
+
+  for (int p_i = 0; p_i < (int)phase_times.size(); p_i++) {
+    const std::string &name = phase_times[p_i].first;
+    if (count.count(name) == 0) {
+      names.push_back(name);
+      max_time[name] = 0.0f;
+    }
+    count[name]++;
+    total[name] += phase_times[p_i].second;
+    max_time[name] = std::max(max_time[name], phase_times[p_i].second);
+  }
+
+  std::cout << "******** Phase times ********" << std::endl;
+  for (int n_i = 0; n_i < (int)names.size(); n_i++) {
+    const std::string &name = names[n_i];
+    std::cout << name << " : count " << count[name]
+              << " total " << total[name] << " sec"
+              << " mean " << total[name] / count[name] << " sec"
+              << " max " << max_time[name] << " sec" << std::endl;
+  }
+}
+
+/* 値のratio分位点(最近傍順位) */
+static double percentile(std::vector<double> values, double ratio)
+{
+  int index = (int)(ratio * (values.size() - 1) + 0.5);
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+/* 文字列をdelimで区切ってsetを返す */
+static std::set<std::string> split_to_set(const std::string &str, char delim){
+  size_t current = 0, found;
+  std::set<std::string> ret;
+  while((found = str.find_first_of(delim, current)) != std::string::npos){
+    ret.insert(std::string(str, current, found - current));
+    current = found + 1;
+  }
+  ret.insert(std::string(str, current, str.size() - current));
+  return ret;
+}